@@ -0,0 +1,111 @@
+#!/usr/bin/env tarantool
+
+-- Leader failover time: several candidates on sessions of their own, the
+-- leader's session is closed and the time until the next candidate
+-- reports became_leader is measured. Runs against an in-process mock
+-- server unless ZOOKEEPER=host:port points to a real one. Every result is
+-- printed as one JSON object per line.
+
+package.path = "../?/init.lua;./?/init.lua;../tests/?.lua;" .. package.path
+package.cpath = "../?.so;../?.dylib;./?.so;./?.dylib;" .. package.cpath
+
+local clock = require 'clock'
+local fiber = require 'fiber'
+local json = require 'json'
+
+local zookeeper = require 'zookeeper'
+local mock_server = require 'mock_server'
+
+local ROOT = '/zookeeper_bench_election'
+local ROUNDS = tonumber(os.getenv('ROUNDS')) or 20
+local CANDIDATES = {2, 10, 100}
+
+
+local function quantile(sorted, q)
+    if #sorted == 0 then
+        return 0
+    end
+    return sorted[math.max(1, math.ceil(q * #sorted))]
+end
+
+
+local function connect(hosts)
+    local z = zookeeper.init(hosts)
+    z:start()
+    z:wait_connected(10)
+    return z
+end
+
+
+local function bench_failover(hosts, server, count)
+    local elected = fiber.channel(count)
+    local candidates = {}
+    local function join()
+        local c = {z = connect(hosts)}
+        c.election = c.z:election(ROOT, {callback = function(event)
+            if event == 'became_leader' then
+                elected:put(c)
+            end
+        end})
+        table.insert(candidates, c)
+    end
+    for _ = 1, count do
+        join()
+    end
+    
+    local leader = elected:get(10)
+    local times = {}
+    for _ = 1, ROUNDS do
+        -- keep the number of candidates constant
+        join()
+        local start = clock.monotonic()
+        leader.z:close()
+        leader = elected:get(10)
+        if leader == nil then
+            break
+        end
+        table.insert(times, clock.monotonic() - start)
+    end
+    
+    table.sort(times)
+    print(json.encode({
+        bench = 'election_failover',
+        server = server,
+        candidates = count,
+        rounds = #times,
+        p50 = quantile(times, 0.5),
+        p99 = quantile(times, 0.99),
+        max = times[#times] or 0,
+    }))
+    
+    for _, c in ipairs(candidates) do
+        c.election:resign()
+        pcall(c.z.close, c.z)
+    end
+end
+
+
+local function main()
+    local hosts = os.getenv('ZOOKEEPER')
+    local server = 'zookeeper'
+    local mock
+    if hosts == nil then
+        mock = mock_server.new()
+        hosts = mock:start()
+        server = 'mock'
+    end
+    
+    for _, count in ipairs(CANDIDATES) do
+        bench_failover(hosts, server, count)
+    end
+    
+    local z = connect(hosts)
+    z:delete(ROOT)
+    z:close()
+    if mock ~= nil then
+        mock:stop()
+    end
+    os.exit(0)
+end
+
+main()
@@ -0,0 +1,194 @@
+#!/usr/bin/env tarantool
+
+-- Throughput and latency of the basic requests at several value sizes,
+-- child counts and fiber counts. Runs against an in-process mock server
+-- unless ZOOKEEPER=host:port points to a real one. Every result is
+-- printed as one JSON object per line.
+
+package.path = "../?/init.lua;./?/init.lua;../tests/?.lua;" .. package.path
+package.cpath = "../?.so;../?.dylib;./?.so;./?.dylib;" .. package.cpath
+
+local clock = require 'clock'
+local fiber = require 'fiber'
+local json = require 'json'
+
+local zookeeper = require 'zookeeper'
+local mock_server = require 'mock_server'
+
+local ROOT = '/zookeeper_bench_ops'
+local OPS = tonumber(os.getenv('OPS')) or 5000
+local VALUE_SIZES = {16, 1024, 65536}
+local CHILD_COUNTS = {10, 100, 1000}
+local FIBERS = {1, 10, 100}
+
+
+local function quantile(sorted, q)
+    if #sorted == 0 then
+        return 0
+    end
+    return sorted[math.max(1, math.ceil(q * #sorted))]
+end
+
+
+-- op(fiber_no, i) does one request; it may return its own latency
+local function run(server, name, params, fibers, op)
+    local latencies = {}
+    local per_fiber = math.ceil(OPS / fibers)
+    local ch = fiber.channel(fibers)
+    local start = clock.monotonic()
+    for f = 1, fibers do
+        fiber.create(function()
+            for i = 1, per_fiber do
+                local t0 = clock.monotonic()
+                local latency = op(f, i)
+                table.insert(latencies, latency or clock.monotonic() - t0)
+            end
+            ch:put(true)
+        end)
+    end
+    for _ = 1, fibers do
+        ch:get()
+    end
+    local elapsed = clock.monotonic() - start
+    
+    table.sort(latencies)
+    local result = {
+        bench = name,
+        server = server,
+        fibers = fibers,
+        ops = #latencies,
+        ops_per_sec = #latencies / elapsed,
+        p50 = quantile(latencies, 0.5),
+        p99 = quantile(latencies, 0.99),
+        p999 = quantile(latencies, 0.999),
+    }
+    for k, v in pairs(params) do
+        result[k] = v
+    end
+    print(json.encode(result))
+end
+
+
+local function bench_values(z, server)
+    for _, size in ipairs(VALUE_SIZES) do
+        local path = ROOT .. '/value_' .. size
+        local value = string.rep('x', size)
+        z:create(path, value)
+        for _, fibers in ipairs(FIBERS) do
+            run(server, 'get', {value_size = size}, fibers, function()
+                z:get(path)
+            end)
+            run(server, 'set', {value_size = size}, fibers, function()
+                z:set(path, value)
+            end)
+        end
+        z:delete(path)
+    end
+end
+
+
+local function bench_create(z, server)
+    local dir = ROOT .. '/create'
+    for _, fibers in ipairs(FIBERS) do
+        z:create(dir)
+        run(server, 'create', {value_size = 16}, fibers, function(f, i)
+            z:create(string.format('%s/n%d_%d', dir, f, i), 'xxxxxxxxxxxxxxxx')
+        end)
+        for _, name in ipairs(z:get_children(dir)) do
+            z:delete(dir .. '/' .. name)
+        end
+        z:delete(dir)
+    end
+end
+
+
+local function bench_children(z, server)
+    for _, count in ipairs(CHILD_COUNTS) do
+        local dir = ROOT .. '/children_' .. count
+        z:create(dir)
+        local futures = {}
+        for i = 1, count do
+            table.insert(futures, z:create_async(dir .. '/n' .. i))
+        end
+        z:wait_all(futures)
+        
+        for _, fibers in ipairs(FIBERS) do
+            run(server, 'get_children', {children = count}, fibers, function()
+                z:get_children(dir)
+            end)
+        end
+        
+        futures = {}
+        for i = 1, count do
+            table.insert(futures, z:delete_async(dir .. '/n' .. i))
+        end
+        z:wait_all(futures)
+        z:delete(dir)
+    end
+end
+
+
+local function watch_fired(_, _, _, _, ctx)
+    ctx.fired = clock.monotonic()
+    ctx.cond:signal()
+end
+
+
+-- time from sending a set until the watcher runs
+local function bench_watch(z, server)
+    for _, fibers in ipairs(FIBERS) do
+        local ctxs = {}
+        for f = 1, fibers do
+            z:create(ROOT .. '/watch_' .. f)
+            ctxs[f] = {cond = fiber.cond()}
+        end
+        
+        run(server, 'watch_fire', {}, fibers, function(f)
+            local path = ROOT .. '/watch_' .. f
+            local ctx = ctxs[f]
+            ctx.fired = nil
+            z:wget(path, watch_fired, ctx)
+            local sent = clock.monotonic()
+            z:set(path, 'value')
+            while ctx.fired == nil do
+                ctx.cond:wait()
+            end
+            return ctx.fired - sent
+        end)
+        
+        for f = 1, fibers do
+            z:delete(ROOT .. '/watch_' .. f)
+        end
+    end
+end
+
+
+local function main()
+    local hosts = os.getenv('ZOOKEEPER')
+    local server = 'zookeeper'
+    local mock
+    if hosts == nil then
+        mock = mock_server.new()
+        hosts = mock:start()
+        server = 'mock'
+    end
+    
+    local z = zookeeper.init(hosts)
+    z:start()
+    z:wait_connected(10)
+    z:create(ROOT)
+    
+    bench_values(z, server)
+    bench_create(z, server)
+    bench_children(z, server)
+    bench_watch(z, server)
+    
+    z:delete(ROOT)
+    z:close()
+    if mock ~= nil then
+        mock:stop()
+    end
+    os.exit(0)
+end
+
+main()
@@ -0,0 +1,100 @@
+#!/usr/bin/env tarantool
+
+-- Completion context allocations per request with and without the
+-- context pool. Runs against an in-process mock server unless
+-- ZOOKEEPER=host:port points to a real one. Every result is printed as
+-- one JSON object per line.
+
+package.path = "../?/init.lua;./?/init.lua;../tests/?.lua;" .. package.path
+package.cpath = "../?.so;../?.dylib;./?.so;./?.dylib;" .. package.cpath
+
+local clock = require 'clock'
+local fiber = require 'fiber'
+local json = require 'json'
+
+local zookeeper = require 'zookeeper'
+local mock_server = require 'mock_server'
+
+local ROOT = '/zookeeper_bench_pool'
+local OPS = tonumber(os.getenv('OPS')) or 20000
+local FIBERS = 50
+
+
+local function noop_watcher()
+end
+
+
+local function run(z, server, pool, name, op)
+    local before = zookeeper.pool_stats()
+    local start = clock.monotonic()
+    
+    local ch = fiber.channel(FIBERS)
+    for _ = 1, FIBERS do
+        fiber.create(function()
+            for _ = 1, OPS / FIBERS do
+                op(z)
+            end
+            ch:put(true)
+        end)
+    end
+    for _ = 1, FIBERS do
+        ch:get()
+    end
+    
+    local elapsed = clock.monotonic() - start
+    local after = zookeeper.pool_stats()
+    print(json.encode({
+        bench = name,
+        server = server,
+        pool = pool,
+        ops = OPS,
+        ops_per_sec = OPS / elapsed,
+        allocs_per_op = (after.allocs - before.allocs) / OPS,
+        reuses_per_op = (after.reuses - before.reuses) / OPS,
+    }))
+end
+
+
+local function bench(z, server, pool)
+    run(z, server, pool, 'get', function(z)
+        z:get(ROOT)
+    end)
+    run(z, server, pool, 'get_async', function(z)
+        z:get_async(ROOT):wait()
+    end)
+    -- the watcher context is released right away on ZNONODE
+    run(z, server, pool, 'wget_miss', function(z)
+        z:wget(ROOT .. '/missing', noop_watcher)
+    end)
+end
+
+
+local function main()
+    local hosts = os.getenv('ZOOKEEPER')
+    local server = 'zookeeper'
+    local mock
+    if hosts == nil then
+        mock = mock_server.new()
+        hosts = mock:start()
+        server = 'mock'
+    end
+    
+    local z = zookeeper.init(hosts)
+    z:start()
+    z:wait_connected(10)
+    z:create(ROOT, 'value')
+    
+    zookeeper.set_pool_size(0)
+    bench(z, server, false)
+    zookeeper.set_pool_size(1024)
+    bench(z, server, true)
+    
+    z:delete(ROOT)
+    z:close()
+    if mock ~= nil then
+        mock:stop()
+    end
+    os.exit(0)
+end
+
+main()
@@ -3,6 +3,8 @@
 package.path = "../?/init.lua;./?/init.lua;" .. package.path
 package.cpath = "../?.so;../?.dylib;./?.so;./?.dylib;" .. package.cpath
 
+local fiber = require 'fiber'
+local msgpack = require 'msgpack'
 local tap = require 'tap'
 local zookeeper = require 'zookeeper'
 local zkacl = require 'zookeeper.acl'
@@ -37,7 +39,9 @@ local function test_op_on_not_connected(t, z)
         {'wget_children', '/path'},
         {'wget_children2', '/path'},
         {'get_acl', '/path'},
-        {'set_acl', '/path', nil, zkacl.ACLS.OPEN_ACL_UNSAFE}
+        {'set_acl', '/path', nil, zkacl.ACLS.OPEN_ACL_UNSAFE},
+        {'get_async', '/path'},
+        {'multi', { {op = 'check', path = '/path'} }},
     }
     
     t:plan(#operations * 2)
@@ -239,6 +243,39 @@ local function test_get_children2(t, z)
 end
 
 
+local function test_stat(t, z)
+    t:plan(10)
+    
+    z:create('/newpath', 'value')
+    local _, stat = z:get('/newpath')
+    t:is(stat.dataLength, 5, 'field access')
+    t:is(stat.version, 0, 'version field')
+    t:is(stat.nofield, nil, 'unknown field is nil')
+    
+    local tbl = stat:totable()
+    t:is(type(tbl), 'table', 'totable returns a table')
+    t:is(tbl.mzxid, stat.mzxid, 'totable keeps the values')
+    
+    local _, same = z:get('/newpath')
+    t:ok(same == stat, 'equal stats are ==')
+    z:set('/newpath', 'value2')
+    local _, changed = z:get('/newpath')
+    t:ok(changed ~= stat, 'different stats are ~=')
+    
+    local czxid = string.match(tostring(stat), 'czxid=(%d+)')
+    t:is(tostring(stat.czxid), czxid .. 'LL', 'zxid keeps all 64 bits')
+    z:create('/newpath/ephemeral', '', nil, zkconst.create_flags.EPHEMERAL)
+    local _, eph = z:get('/newpath/ephemeral')
+    t:is(type(eph.ephemeralOwner), 'cdata', 'session id is a 64-bit integer')
+    -- session ids are above 2^53, where a double can not add 1
+    t:ok(eph.ephemeralOwner + 1 ~= eph.ephemeralOwner,
+         'session id keeps all 64 bits')
+    
+    z:delete('/newpath/ephemeral')
+    z:delete('/newpath')
+end
+
+
 local function test_get_acl(t, z)
     t:plan(3)
     
@@ -275,6 +312,405 @@ local function test_set_acl(t, z)
 end
 
 
+local function test_async(t, z)
+    t:plan(11)
+    
+    z:create('/newpath')
+    
+    local futures = {}
+    for i = 1, 10 do
+        futures[i] = z:create_async('/newpath/n' .. i, 'v' .. i)
+    end
+    
+    local results = z:wait_all(futures, 5)
+    local all_ok = true
+    for i, res in ipairs(results) do
+        if res[1] ~= '/newpath/n' .. i or res[2] ~= zkconst.ZOK then
+            all_ok = false
+        end
+    end
+    t:is(#results, 10, 'wait_all returned all results')
+    t:ok(all_ok, 'all async creates succeeded')
+    
+    local f = z:get_async('/newpath/n3')
+    local value, stat, rc = f:wait(5)
+    t:is(value, 'v3', 'get_async value')
+    t:is(rc, zkconst.ZOK, 'get_async rc is ZOK')
+    t:ok(f:is_ready(), 'future is ready after wait')
+    t:is(f:wait(), 'v3', 'wait can be called again')
+    
+    local _, _, rc = z:get_async('/newpath/n11'):wait(5)
+    t:is(rc, zkconst.api_errors.ZNONODE, 'get_async ZNONODE')
+    
+    local results, rc = z:wait_all({f, z:get_async('/newpath/n4')}, 0)
+    t:is(rc, zkconst.errors.ZOPERATIONTIMEOUT, 'wait_all reports a late future')
+    t:is(results[1][1], 'v3', 'ready future keeps its results')
+    t:is(results[2].rc, zkconst.errors.ZOPERATIONTIMEOUT, 'late future rc')
+    
+    futures = {}
+    for i = 1, 10 do
+        futures[i] = z:delete_async('/newpath/n' .. i)
+    end
+    z:wait_all(futures)
+    
+    local children = z:get_children('/newpath')
+    t:is_deeply(children, {}, 'all async deletes done')
+    
+    z:delete('/newpath')
+end
+
+
+local function test_concurrent_ops(t, z)
+    t:plan(2)
+    
+    z:create('/newpath')
+    for i = 1, 10 do
+        z:create('/newpath/n' .. i, 'v' .. i)
+    end
+    
+    -- many fibers waiting at once, each gets its own reply
+    local all_ok = true
+    local ch = fiber.channel(10)
+    for i = 1, 10 do
+        fiber.create(function()
+            for _ = 1, 10 do
+                local value, stat, rc = z:get('/newpath/n' .. i)
+                if value ~= 'v' .. i or rc ~= zkconst.ZOK
+                        or stat.dataLength ~= #value then
+                    all_ok = false
+                end
+            end
+            ch:put(true)
+        end)
+    end
+    for _ = 1, 10 do
+        ch:get()
+    end
+    t:ok(all_ok, 'concurrent gets returned their own values')
+    
+    local children = z:get_children('/newpath')
+    t:is(#children, 10, 'children list')
+    
+    for i = 1, 10 do
+        z:delete('/newpath/n' .. i)
+    end
+    z:delete('/newpath')
+end
+
+
+local function test_pool(t, z)
+    t:plan(2)
+    
+    z:create('/newpath')
+    z:get('/newpath')
+    
+    local before = zookeeper.pool_stats()
+    for _ = 1, 10 do
+        z:get('/newpath')
+    end
+    local after = zookeeper.pool_stats()
+    t:is(after.allocs, before.allocs, 'no new contexts allocated')
+    t:is(after.reuses - before.reuses, 10, 'contexts are reused')
+    
+    z:delete('/newpath')
+end
+
+
+local function test_trace(t, z)
+    t:plan(6)
+    
+    z:create('/newpath')
+    zookeeper.set_trace_size(2)
+    z:get('/newpath')
+    z:exists('/newpath')
+    z:get('/newpath/missing')
+    
+    local events, total = zookeeper.trace_dump()
+    t:is(total, 3, 'all requests counted')
+    t:is(#events, 2, 'ring keeps the last events')
+    t:is(events[1].op, 'exists', 'oldest event first')
+    t:is(events[2].rc, zkconst.api_errors.ZNONODE, 'rc recorded')
+    t:ok(events[2].latency >= 0, 'latency recorded')
+    
+    zookeeper.set_trace_size(0)
+    z:get('/newpath')
+    t:is(#zookeeper.trace_dump(), 0, 'tracing disabled')
+    
+    z:delete('/newpath')
+end
+
+
+local function test_stats(t, z)
+    t:plan(7)
+    
+    z:create('/newpath')
+    local before = z:stats()
+    for _ = 1, 10 do
+        z:get('/newpath')
+    end
+    z:get('/newpath/missing')
+    
+    local stats = z:stats()
+    local get = stats.ops.get
+    local issued = before.ops.get and before.ops.get.issued or 0
+    t:is(get.issued - issued, 11, 'requests counted')
+    t:is(get.inflight, 0, 'nothing in flight')
+    t:ok(get.rcs.ZNONODE >= 1, 'result codes counted')
+    t:ok(get.latency.p50 <= get.latency.p99, 'quantiles ordered')
+    t:is(get.latency.buckets[#get.latency.buckets].count <= get.latency.count,
+         true, 'buckets are cumulative')
+    t:ok(stats.state_time.CONNECTED > 0, 'time connected')
+    t:like(z:stats_prometheus(), 'zookeeper_requests_total{op="get"}',
+           'prometheus format')
+    
+    z:delete('/newpath')
+end
+
+
+local function test_multi(t, z)
+    t:plan(10)
+    
+    local results, rc = z:multi({
+        {op = 'create', path = '/newpath', value = 'v1'},
+        {op = 'create', path = '/newpath/n1'},
+        {op = 'set', path = '/newpath', value = 'v2', version = 0},
+        {op = 'check', path = '/newpath', version = 1},
+    })
+    t:is(rc, zkconst.ZOK, 'multi ZOK')
+    t:is(#results, 4, 'result per op')
+    t:is(results[1].path, '/newpath', 'create result has path')
+    t:is(results[3].stat.version, 1, 'set result has stat')
+    t:is(z:get('/newpath'), 'v2', 'multi applied')
+    
+    local results, rc = z:multi({
+        {op = 'delete', path = '/newpath/n1'},
+        {op = 'check', path = '/newpath', version = 0},
+    })
+    t:is(rc, zkconst.api_errors.ZBADVERSION, 'failed check fails multi')
+    t:is(results[2].rc, zkconst.api_errors.ZBADVERSION, 'failed op rc')
+    local exists = z:exists('/newpath/n1')
+    t:ok(exists, 'nothing applied on failure')
+    
+    local ok = pcall(z.multi, z, { {op = 'rename', path = '/newpath'} })
+    t:is(ok, false, 'unknown op raises')
+    
+    local _, rc = z:multi({
+        {op = 'delete', path = '/newpath/n1'},
+        {op = 'delete', path = '/newpath'},
+    })
+    t:is(rc, zkconst.ZOK, 'multi delete ZOK')
+end
+
+
+local function test_multi_on_close(t, z)
+    t:plan(2)
+    
+    local z2 = zookeeper.init(z.hosts)
+    z2:start()
+    z2:wait_connected(10)
+    local f = z2:multi_async({
+        {op = 'check', path = '/', version = -1},
+    })
+    z2:close()
+    local results, rc = f:wait(5)
+    t:is(rc, zkconst.api_errors.ZCLOSING, 'multi fails with the handle')
+    t:is(results, nil, 'no per-op results from the client')
+end
+
+
+local function test_get_buffer(t, z)
+    t:plan(6)
+    
+    local doc = {flags = {a = true, b = false}, list = {1, 2, 3}}
+    local encoded = msgpack.encode(doc)
+    z:create('/buffer', encoded)
+    
+    local buf, stat, rc = z:get('/buffer', nil, nil, {buffer = true})
+    t:is(rc, zkconst.ZOK, 'rc is ZOK')
+    t:is(buf:size(), #encoded, 'size')
+    t:is(stat.dataLength, #encoded, 'stat')
+    t:is(buf:value(), encoded, 'value')
+    t:is_deeply(msgpack.decode(buf:ptr(), buf:size()), doc,
+                'decoded in place')
+    
+    local f = z:get_async('/buffer', nil, {buffer = true})
+    t:is(f:wait():value(), encoded, 'async')
+    
+    z:delete('/buffer')
+end
+
+
+local function test_iter_children(t, z)
+    t:plan(5)
+    
+    local iter, rc = z:iter_children('/newpath')
+    t:is(rc, zkconst.api_errors.ZNONODE, 'ZNONODE error')
+    t:is(iter(), nil, 'nothing on error')
+    
+    z:create('/newpath')
+    for i = 1, 25 do
+        z:create(string.format('/newpath/%s%02d', i % 2 == 0 and 'a' or 'b', i))
+    end
+    
+    local batches = {}
+    local names = {}
+    for batch in z:iter_children('/newpath', {batch = 5, prefix = 'b',
+                                              sorted = true}) do
+        table.insert(batches, #batch)
+        for _, name in ipairs(batch) do
+            table.insert(names, name)
+        end
+    end
+    t:is_deeply(batches, {5, 5, 3}, 'batched')
+    t:is(#names, 13, 'filtered by prefix')
+    local sorted = true
+    for i = 2, #names do
+        sorted = sorted and names[i - 1] < names[i]
+    end
+    t:ok(sorted, 'sorted')
+    
+    for i = 1, 25 do
+        z:delete(string.format('/newpath/%s%02d', i % 2 == 0 and 'a' or 'b', i))
+    end
+    z:delete('/newpath')
+end
+
+
+local function test_sequence_children(t, z)
+    t:plan(8)
+    
+    z:create('/newpath')
+    -- the counter is shared, so the prefixes interleave
+    local nodes = {}
+    for i = 1, 6 do
+        local prefix = i % 2 == 0 and 'b-' or 'a-'
+        local path = z:create('/newpath/' .. prefix, nil, nil,
+                              zkconst.create_flags.SEQUENCE)
+        nodes[i] = string.match(path, '[^/]+$')
+    end
+    z:create('/newpath/plain')
+    
+    local names, rc = z:sequence_children('/newpath')
+    t:is(rc, zkconst.ZOK, 'ZOK')
+    t:is_deeply(names, nodes, 'ordered by counter, plain node skipped')
+    t:is_deeply(z:sequence_children('/newpath', {prefix = 'b-'}),
+                {nodes[2], nodes[4], nodes[6]}, 'filtered by prefix')
+    
+    local first, pred = z:sequence_children('/newpath',
+        {prefix = 'a-', node = nodes[5]})
+    t:is_deeply({first, pred}, {nodes[1], nodes[3]}, 'first and predecessor')
+    local first, pred = z:sequence_children('/newpath',
+        {prefix = 'a-', node = nodes[1]})
+    t:is_deeply({first, pred}, {nodes[1]}, 'no predecessor for the first')
+    local _, _, rc = z:sequence_children('/newpath',
+        {node = 'a-9999999999'})
+    t:is(rc, zkconst.api_errors.ZNONODE, 'ZNONODE for a missing node')
+    local _, _, _, name = z:sequence_children('/newpath', {node_tag = 'b-'})
+    t:is(name, nodes[2], 'node found by tag')
+    local _, _, rc = z:sequence_children('/newpath', {node_tag = 'c-'})
+    t:is(rc, zkconst.api_errors.ZNONODE, 'ZNONODE for a missing tag')
+    
+    for _, name in ipairs(z:get_children('/newpath')) do
+        z:delete('/newpath/' .. name)
+    end
+    z:delete('/newpath')
+end
+
+
+local function test_counter(t, z)
+    t:plan(6)
+    
+    local c = z:counter('/newpath/counter', {initial = 10})
+    t:is(c:get(), 10, 'initial value of a missing counter')
+    t:is(c:increment(), 11, 'created on first increment')
+    t:is(c:increment(5), 16, 'increment by delta')
+    t:is(c:decrement(), 15, 'decrement')
+    
+    local ch = fiber.channel(50)
+    for _ = 1, 50 do
+        fiber.create(function()
+            -- every fiber has its own cached version, like separate clients
+            local fc = z:counter('/newpath/counter')
+            for _ = 1, 4 do
+                fc:increment()
+            end
+            ch:put(true)
+        end)
+    end
+    for _ = 1, 50 do
+        ch:get()
+    end
+    t:is(c:get(), 215, 'no increment lost under contention')
+    t:ok(z:stats().counters.increments >= 203, 'increments counted')
+    
+    z:delete('/newpath/counter')
+    z:delete('/newpath')
+end
+
+
+local function test_get_many(t, z)
+    t:plan(6)
+    
+    z:create('/newpath')
+    local paths = {}
+    for i = 1, 20 do
+        paths[i] = '/newpath/n' .. i
+        z:create(paths[i], 'v' .. i)
+    end
+    table.insert(paths, '/newpath/n21')
+    
+    local results = z:get_many(paths, {max_inflight = 4})
+    local all_ok = true
+    for i = 1, 20 do
+        local res = results['/newpath/n' .. i]
+        if res == nil or res.value ~= 'v' .. i or res.rc ~= zkconst.ZOK then
+            all_ok = false
+        end
+    end
+    t:ok(all_ok, 'all values fetched')
+    t:isnt(results['/newpath/n1'].stat.mtime, 0, 'stat is returned')
+    t:is(results['/newpath/n21'].value, nil, 'no value for missing node')
+    t:is(results['/newpath/n21'].rc, zkconst.api_errors.ZNONODE,
+         'ZNONODE for missing node')
+    
+    t:is_deeply(z:get_many({}), {}, 'empty paths list')
+    
+    local ok = pcall(z.get_many, z, {'/newpath', 1})
+    t:is(ok, false, 'non-string path raises')
+    
+    for i = 1, 20 do
+        z:delete(paths[i])
+    end
+    z:delete('/newpath')
+end
+
+
+local function test_op_timeout(t, z)
+    t:plan(6)
+    
+    z:create('/newpath', 'value1')
+    
+    local ok, err = pcall(z.get, z, '/newpath', nil, 0)
+    t:is(ok, false, 'get raises on timeout')
+    t:is(zookeeper.error_code(err), zkconst.errors.ZOPERATIONTIMEOUT,
+         'timeout error code')
+    t:like(tostring(err), 'operation timeout', 'timeout error message')
+    
+    local value = z:get('/newpath', nil, 5)
+    t:is(value, 'value1', 'reply within timeout')
+    
+    local results = z:get_many({'/newpath'}, {timeout = 0})
+    t:is(results['/newpath'].rc, zkconst.errors.ZOPERATIONTIMEOUT,
+         'get_many marks late paths on timeout')
+    
+    -- late replies of the abandoned requests are dropped
+    local value = z:get('/newpath')
+    t:is(value, 'value1', 'handle works after timeouts')
+    
+    z:delete('/newpath')
+end
+
+
 local function main()
     local hosts = os.getenv('ZOOKEEPER') or '127.0.0.1:2181'
     local z = zookeeper.init(hosts)
@@ -289,8 +725,22 @@ local function main()
     tap.test('test_set', test_set, z)
     tap.test('test_get_children', test_get_children, z)
     tap.test('test_get_children2', test_get_children2, z)
+    tap.test('test_stat', test_stat, z)
     tap.test('test_get_acl', test_get_acl, z)
     tap.test('test_set_acl', test_set_acl, z)
+    tap.test('test_async', test_async, z)
+    tap.test('test_concurrent_ops', test_concurrent_ops, z)
+    tap.test('test_pool', test_pool, z)
+    tap.test('test_trace', test_trace, z)
+    tap.test('test_stats', test_stats, z)
+    tap.test('test_multi', test_multi, z)
+    tap.test('test_multi_on_close', test_multi_on_close, z)
+    tap.test('test_get_buffer', test_get_buffer, z)
+    tap.test('test_iter_children', test_iter_children, z)
+    tap.test('test_sequence_children', test_sequence_children, z)
+    tap.test('test_counter', test_counter, z)
+    tap.test('test_get_many', test_get_many, z)
+    tap.test('test_op_timeout', test_op_timeout, z)
 
     z:close()
 end
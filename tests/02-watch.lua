@@ -505,6 +505,375 @@ local function test_wget_children2(t, z)
 end
 
 
+local function test_slow_watcher_does_not_block_io(t, z)
+    t:plan(3)
+    
+    local cond = fiber.cond()
+    local function local_watcher()
+        fiber.sleep(2)
+        cond:signal()
+    end
+    
+    z:create('/mypath')
+    z:wget('/mypath', local_watcher)
+    z:set('/mypath', 'value1')
+    
+    local start = fiber.time()
+    local value = z:get('/mypath')
+    t:is(value, 'value1', 'get works while the watcher sleeps')
+    t:ok(fiber.time() - start < 1, 'get is not blocked by the watcher')
+    t:ok(cond:wait(3), 'watcher finished')
+    
+    z:delete('/mypath')
+end
+
+
+local function test_cache(t, z)
+    t:plan(9)
+    
+    z:create('/mypath', 'value1')
+    local cache = z:cache()
+    
+    local value, _, rc = cache:get('/mypath')
+    t:is(value, 'value1', 'value on miss')
+    t:is(rc, zkconst.ZOK, 'ZOK on miss')
+    local value = cache:get('/mypath')
+    t:is(value, 'value1', 'value on hit')
+    
+    local stats = cache:stats()
+    t:is(stats.hits, 1, 'one hit')
+    t:is(stats.misses, 1, 'one miss')
+    t:is(stats.entries, 1, 'one entry cached')
+    
+    z:set('/mypath', 'value2')
+    fiber.sleep(0.1) -- let the watcher run
+    t:is(cache:get('/mypath'), 'value2', 'entry invalidated on change')
+    
+    z:delete('/mypath')
+    fiber.sleep(0.1)
+    local _, _, rc = cache:get('/mypath')
+    t:is(rc, zkconst.api_errors.ZNONODE, 'entry invalidated on delete')
+    t:is(cache:stats().entries, 0, 'no entries left')
+end
+
+
+local function test_tree_cache(t, z)
+    t:plan(8)
+    
+    z:create('/mypath', 'root')
+    z:create('/mypath/n1', 'value1')
+    
+    local tc = z:tree_cache('/mypath')
+    tc:start()
+    t:is(tc:get('/mypath'), 'root', 'root loaded')
+    t:is(tc:get('/mypath/n1'), 'value1', 'child loaded')
+    t:is_deeply(tc:children('/mypath'), {'n1'}, 'children loaded')
+    
+    local events = {}
+    tc:on_change(function(event, path, value)
+        table.insert(events, {event, path, value})
+    end)
+    
+    z:set('/mypath/n1', 'value2')
+    z:create('/mypath/n2', 'value3')
+    z:create('/mypath/n2/n3')
+    fiber.sleep(0.5)
+    t:is(tc:get('/mypath/n1'), 'value2', 'value updated')
+    t:is_deeply(tc:children('/mypath'), {'n1', 'n2'}, 'child added')
+    t:is_deeply(tc:children('/mypath/n2'), {'n3'}, 'grandchild added')
+    
+    z:delete('/mypath/n2/n3')
+    z:delete('/mypath/n2')
+    fiber.sleep(0.5)
+    t:is(tc:get('/mypath/n2'), nil, 'subtree removed')
+    t:is_deeply(events, {
+        {'changed', '/mypath/n1', 'value2'},
+        {'created', '/mypath/n2', 'value3'},
+        {'created', '/mypath/n2/n3', nil},
+        {'deleted', '/mypath/n2/n3', nil},
+        {'deleted', '/mypath/n2', 'value3'},
+    }, 'change events')
+    
+    tc:stop()
+    z:delete('/mypath/n1')
+    z:delete('/mypath')
+end
+
+
+local function test_persistent_watch(t, z)
+    t:plan(3)
+    
+    local events = {}
+    local function watcher(_, type, _, path)
+        table.insert(events, {zkconst.watch_types_rev[type], path})
+    end
+    
+    z:create('/mypath')
+    z:add_watch('/mypath', zkconst.watch_modes.PERSISTENT, watcher)
+    z:set('/mypath', 'value1')
+    z:set('/mypath', 'value2')
+    z:create('/mypath/n1')
+    z:delete('/mypath/n1')
+    fiber.sleep(0.5)
+    t:is_deeply(events, {
+        {'CHANGED', '/mypath'},
+        {'CHANGED', '/mypath'},
+        {'CHILD', '/mypath'},
+        {'CHILD', '/mypath'},
+    }, 'watch fires on every change')
+    
+    t:is(z:remove_watches('/mypath'), 1, 'watch removed')
+    events = {}
+    z:set('/mypath', 'value3')
+    fiber.sleep(0.2)
+    t:is(#events, 0, 'no events after remove')
+    
+    z:delete('/mypath')
+end
+
+
+local function test_recursive_watch(t, z)
+    t:plan(2)
+    
+    local events = {}
+    local function watcher(_, type, _, path)
+        table.insert(events, {zkconst.watch_types_rev[type], path})
+    end
+    
+    z:create('/mypath')
+    z:create('/mypath/n1')
+    z:add_watch('/mypath', zkconst.watch_modes.PERSISTENT_RECURSIVE, watcher)
+    fiber.sleep(0.2)
+    z:set('/mypath/n1', 'value1')
+    z:create('/mypath/n1/n2')
+    fiber.sleep(0.2)
+    z:set('/mypath/n1/n2', 'value2')
+    z:delete('/mypath/n1/n2')
+    fiber.sleep(0.5)
+    t:is_deeply(events, {
+        {'CHANGED', '/mypath/n1'},
+        {'CREATED', '/mypath/n1/n2'},
+        {'CHANGED', '/mypath/n1/n2'},
+        {'DELETED', '/mypath/n1/n2'},
+    }, 'events of the whole subtree')
+    
+    local function other() end
+    t:is(z:remove_watches('/mypath', other), 0, 'other watcher not removed')
+    z:remove_watches('/mypath', watcher)
+    
+    z:delete('/mypath/n1')
+    z:delete('/mypath')
+end
+
+
+local function test_coalesced_watch(t, z)
+    t:plan(4)
+    
+    local calls = {}
+    local function watcher(_, type, _, path, context, children, rc)
+        table.insert(calls, {type = type, path = path, context = context,
+                             count = children and #children, rc = rc})
+    end
+    
+    z:create('/mypath')
+    local context = {k1 = 'v1'}
+    z:add_watch('/mypath', zkconst.watch_modes.PERSISTENT, watcher, context,
+                {coalesce = 0.3, read = true})
+    for i = 1, 10 do
+        z:create('/mypath/n' .. i)
+    end
+    fiber.sleep(0.6)
+    
+    t:is(#calls, 1, 'one callback for the window')
+    t:is_deeply(calls[1], {type = zkconst.watch_types.CHILD, path = '/mypath',
+                           context = context, count = 10, rc = zkconst.ZOK},
+                'children read once')
+    t:is(z:remove_watches('/mypath', watcher), 1, 'watch removed')
+    
+    calls = {}
+    z:create('/mypath/n11')
+    fiber.sleep(0.5)
+    t:is(#calls, 0, 'no callbacks after remove')
+    
+    for i = 1, 11 do
+        z:delete('/mypath/n' .. i)
+    end
+    z:delete('/mypath')
+end
+
+
+local function test_shared_watch(t, z)
+    t:plan(5)
+    
+    z:create('/mypath', 'value1')
+    local issued = z:stats().ops.wget.issued
+    local fired = 0
+    local function watcher(_, type)
+        if type == zkconst.watch_types.CHANGED then
+            fired = fired + 1
+        end
+    end
+    
+    local ch = fiber.channel(10)
+    for _ = 1, 10 do
+        fiber.create(function()
+            ch:put(z:wget('/mypath', watcher))
+        end)
+    end
+    local values = {}
+    for i = 1, 10 do
+        values[i] = ch:get()
+    end
+    t:is_deeply(values, {'value1', 'value1', 'value1', 'value1', 'value1',
+                         'value1', 'value1', 'value1', 'value1', 'value1'},
+                'every caller gets the value')
+    t:is(z:stats().ops.wget.issued, issued + 1, 'one request sent')
+    
+    t:is(z:wget('/mypath', watcher), 'value1', 'armed watch reused')
+    t:is(z:stats().ops.wget.issued, issued + 1, 'no request for it')
+    
+    z:set('/mypath', 'value2')
+    fiber.sleep(0.2)
+    t:is(fired, 11, 'every watcher called')
+    
+    z:delete('/mypath')
+end
+
+
+local function test_shared_watch_backlog(t, z)
+    t:plan(1)
+    
+    local z2 = zookeeper.init(z.hosts, nil, {watch_workers = 1})
+    z2:start()
+    z2:wait_connected(10)
+    z2:create('/slowpath', 'value1')
+    z2:create('/mypath', 'value1')
+    local function watcher() end
+    
+    -- the only worker is busy, so the next event waits in the queue
+    z2:wget('/slowpath', function() fiber.sleep(0.5) end)
+    z2:wget('/mypath', watcher)
+    z2:set('/slowpath', 'value2')
+    fiber.sleep(0.1)
+    z2:set('/mypath', 'value2')
+    t:is(z2:wget('/mypath', watcher), 'value2',
+         'fired watch is not reused while its event is queued')
+    
+    fiber.sleep(0.5)
+    z2:delete('/mypath')
+    z2:delete('/slowpath')
+    z2:close()
+end
+
+
+local function test_lock(t, z)
+    t:plan(7)
+    
+    local l1, rc = z:lock('/mylock')
+    t:is(rc, zkconst.ZOK, 'acquired, directory created')
+    t:ok(l1:is_held(), 'held')
+    
+    local _, rc = z:lock('/mylock', {timeout = 0.1})
+    t:is(rc, zkconst.errors.ZOPERATIONTIMEOUT, 'busy lock times out')
+    t:is(#z:get_children('/mylock'), 1, 'gave up waiter removed its node')
+    
+    local order = {}
+    local ch = fiber.channel(3)
+    for i = 1, 3 do
+        fiber.create(function()
+            local l = z:lock('/mylock', {timeout = 5})
+            table.insert(order, i)
+            fiber.sleep(0.01)
+            l:unlock()
+            ch:put(true)
+        end)
+        -- queue the waiters in order
+        fiber.sleep(0.05)
+    end
+    l1:unlock()
+    t:is(l1:is_held(), false, 'released')
+    for _ = 1, 3 do
+        ch:get(5)
+    end
+    t:is_deeply(order, {1, 2, 3}, 'handed over in queue order')
+    t:ok(z:stats().locks.acquired >= 4, 'acquires counted')
+    
+    z:delete('/mylock')
+end
+
+
+local function test_election(t, z)
+    t:plan(6)
+    
+    -- candidates need sessions of their own
+    local z1 = zookeeper.init(get_hosts())
+    z1:start()
+    z1:wait_connected(10)
+    local z2 = zookeeper.init(get_hosts())
+    z2:start()
+    z2:wait_connected(10)
+    
+    local ch1 = fiber.channel(10)
+    local e1 = z1:election('/myelection', {value = 'one', channel = ch1})
+    t:is(ch1:get(5), 'became_leader', 'first candidate leads')
+    
+    local events = {}
+    local ch2 = fiber.channel(10)
+    local e2 = z2:election('/myelection', {value = 'two', channel = ch2,
+        callback = function(event) table.insert(events, event) end})
+    fiber.sleep(0.2)
+    t:is(e2:is_leader(), false, 'second candidate waits')
+    t:is(e2:leader(), 'one', 'leader value')
+    
+    -- the leader's session goes away with its node
+    z1:close()
+    t:is(ch2:get(5), 'became_leader', 'second candidate takes over')
+    t:is_deeply(events, {'became_leader'}, 'callback called')
+    
+    e2:resign()
+    t:is(ch2:get(5), 'lost_leadership', 'resign reported')
+    e1:resign()
+    
+    z2:close()
+    z:delete('/myelection')
+end
+
+
+local function test_barrier(t, z)
+    t:plan(4)
+    
+    local entered = {}
+    local leaving = 0
+    local ch = fiber.channel(3)
+    for i = 1, 3 do
+        fiber.create(function()
+            local b = z:barrier('/mybarrier', 3)
+            b:enter(5)
+            table.insert(entered, i)
+            fiber.sleep(0.05 * i)
+            leaving = leaving + 1
+            b:leave(5)
+            -- nobody is past leave() while a member is still in
+            ch:put(leaving == 3)
+        end)
+        fiber.sleep(0.1)
+        if i < 3 then
+            t:is(#entered, 0, string.format('%d of 3 members wait', i))
+        end
+    end
+    local ok = #entered == 3
+    for _ = 1, 3 do
+        ok = ch:get(5) and ok
+    end
+    t:ok(ok, 'everyone entered and left together')
+    
+    local b = z:barrier('/mybarrier', 2)
+    t:is(b:enter(0.1), zkconst.errors.ZOPERATIONTIMEOUT, 'enter times out')
+    
+    z:delete('/mybarrier')
+end
+
+
 local function main()
     local hosts = get_hosts()
     local z = zookeeper.init(hosts)
@@ -522,6 +891,18 @@ local function main()
     tap.test('test_wget', test_wget, z)
     tap.test('test_wget_children', test_wget_children, z)
     tap.test('test_wget_children2', test_wget_children2, z)
+    tap.test('test_slow_watcher_does_not_block_io',
+             test_slow_watcher_does_not_block_io, z)
+    tap.test('test_cache', test_cache, z)
+    tap.test('test_tree_cache', test_tree_cache, z)
+    tap.test('test_persistent_watch', test_persistent_watch, z)
+    tap.test('test_shared_watch', test_shared_watch, z)
+    tap.test('test_shared_watch_backlog', test_shared_watch_backlog, z)
+    tap.test('test_coalesced_watch', test_coalesced_watch, z)
+    tap.test('test_recursive_watch', test_recursive_watch, z)
+    tap.test('test_lock', test_lock, z)
+    tap.test('test_election', test_election, z)
+    tap.test('test_barrier', test_barrier, z)
 
     z:close()
 end
@@ -0,0 +1,347 @@
+#!/usr/bin/env tarantool
+
+package.path = "../?/init.lua;./?/init.lua;./?.lua;" .. package.path
+package.cpath = "../?.so;../?.dylib;./?.so;./?.dylib;" .. package.cpath
+
+local clock = require 'clock'
+local fiber = require 'fiber'
+local tap = require 'tap'
+local zookeeper = require 'zookeeper'
+local zkconst = require 'zookeeper.const'
+
+local mock_server = require 'mock_server'
+
+local SESSION_TIMEOUT = 6000
+
+
+local function wait_for(check, timeout)
+    local deadline = clock.monotonic() + timeout
+    while not check() do
+        if clock.monotonic() > deadline then
+            return false
+        end
+        fiber.sleep(0.01)
+    end
+    return true
+end
+
+
+local function connect(hosts)
+    local z = zookeeper.init(hosts, SESSION_TIMEOUT)
+    z:start()
+    z:wait_connected(5)
+    return z
+end
+
+
+local function test_reconnect_after_drop(t, server, z)
+    t:plan(4)
+    
+    z:create('/drop', 'value')
+    local sessions = server:session_ids()
+    local resumes = server.resumes
+    
+    local start = clock.monotonic()
+    server:drop_connections()
+    t:ok(wait_for(function() return not z:is_connected() end, 5),
+         'disconnect noticed')
+    t:ok(wait_for(function() return z:is_connected() end, 5),
+         string.format('reconnected in %.3fs', clock.monotonic() - start))
+    t:is(server.resumes, resumes + 1, 'session resumed')
+    t:is_deeply(server:session_ids(), sessions, 'no new session')
+    
+    z:delete('/drop')
+end
+
+
+local function test_inflight_on_drop(t, server, z)
+    t:plan(2)
+    
+    z:create('/inflight', 'value')
+    server:set_latency(1)
+    local f = z:get_async('/inflight')
+    fiber.sleep(0.1)
+    server:drop_connections()
+    local _, _, rc = f:wait(5)
+    t:is(rc, zkconst.errors.ZCONNECTIONLOSS, 'in-flight request lost')
+    server:set_latency(0)
+    
+    wait_for(function() return z:is_connected() end, 5)
+    local value = z:get('/inflight')
+    t:is(value, 'value', 'requests work after reconnect')
+    z:delete('/inflight')
+end
+
+
+local function test_latency(t, server, z)
+    t:plan(2)
+    
+    z:create('/latency')
+    server:set_latency(0.2)
+    local start = clock.monotonic()
+    z:exists('/latency')
+    t:ok(clock.monotonic() - start >= 0.2, 'latency injected')
+    
+    local ok = pcall(z.exists, z, '/latency', nil, 0.05)
+    t:is(ok, false, 'slow request times out')
+    server:set_latency(0)
+    
+    z:delete('/latency')
+end
+
+
+local function test_stall(t, server, z)
+    t:plan(3)
+    
+    z:create('/stall')
+    server:stall()
+    local f = z:exists_async('/stall')
+    fiber.sleep(0.2)
+    t:is(f:is_ready(), false, 'no reply while stalled')
+    server:resume()
+    local exists, _, rc = f:wait(5)
+    t:is(rc, zkconst.ZOK, 'reply after resume')
+    t:ok(exists, 'request completed')
+    
+    z:delete('/stall')
+end
+
+
+local function test_reorder_watches(t, server, z)
+    t:plan(1)
+    
+    z:create('/w1')
+    z:create('/w2')
+    local fired = {}
+    local function watcher(_, _, _, path)
+        table.insert(fired, path)
+    end
+    z:wget('/w1', watcher)
+    z:wget('/w2', watcher)
+    
+    server:set_reorder_watches(true)
+    z:set('/w1', 'v')
+    z:set('/w2', 'v')
+    server:set_reorder_watches(false)
+    wait_for(function() return #fired == 2 end, 5)
+    t:is_deeply(fired, {'/w2', '/w1'}, 'notifications delivered reordered')
+    
+    z:delete('/w1')
+    z:delete('/w2')
+end
+
+
+local function test_watch_reregistration(t, server, z)
+    t:plan(2)
+    
+    z:create('/rewatch')
+    local fired = false
+    z:wget('/rewatch', function() fired = true end)
+    
+    local set_watches = server:request_count('set_watches')
+    server:drop_connections()
+    wait_for(function() return not z:is_connected() end, 5)
+    wait_for(function() return z:is_connected() end, 5)
+    t:is(server:request_count('set_watches'), set_watches + 1,
+         'watches re-registered with one request')
+    
+    z:set('/rewatch', 'v')
+    t:ok(wait_for(function() return fired end, 5), 'watch survives reconnect')
+    
+    z:delete('/rewatch')
+end
+
+
+local function test_server_restart(t, server, z, port)
+    t:plan(3)
+    
+    local sessions = server:session_ids()
+    local resumes = server.resumes
+    server:stop()
+    wait_for(function() return not z:is_connected() end, 5)
+    -- connection attempts are refused meanwhile
+    fiber.sleep(0.5)
+    server:start(port)
+    
+    t:ok(wait_for(function() return z:is_connected() end, 10),
+         'reconnected after restart')
+    t:is(server.resumes, resumes + 1, 'session resumed')
+    t:is_deeply(server:session_ids(), sessions, 'no new session')
+end
+
+
+local function test_reconnect_backoff(t, server, z, port)
+    t:plan(5)
+    
+    t:is(pcall(z.set_reconnect_backoff, z, {multiplier = 0.5}), false,
+         'multiplier below 1 rejected')
+    z:set_reconnect_backoff({initial = 0.05, max = 0.2, multiplier = 2,
+                             jitter = 'none'})
+    local before = z:stats()
+    
+    server:stop()
+    wait_for(function() return not z:is_connected() end, 5)
+    fiber.sleep(0.5)
+    server:start(port)
+    t:ok(wait_for(function() return z:is_connected() end, 5),
+         'reconnected after restart')
+    
+    local after = z:stats()
+    t:ok(after.reconnect_attempts > before.reconnect_attempts,
+         'failed attempts counted')
+    t:is(after.outages.count, before.outages.count + 1, 'one outage')
+    t:ok(after.outages.last >= 0.5, 'outage time measured')
+    
+    z:set_reconnect_backoff({initial = 1, max = 30, jitter = 'full'})
+end
+
+
+local function test_lock_on_drop(t, server, z)
+    t:plan(3)
+    
+    local l1 = z:lock('/droplock')
+    local acquired = fiber.channel(1)
+    fiber.create(function()
+        acquired:put(z:lock('/droplock', {timeout = 10}))
+    end)
+    fiber.sleep(0.1)
+    
+    server:drop_connections()
+    wait_for(function() return not z:is_connected() end, 5)
+    wait_for(function() return z:is_connected() end, 5)
+    t:is(#z:get_children('/droplock'), 2, 'waiter kept its node')
+    
+    l1:unlock()
+    local l2 = acquired:get(5)
+    t:ok(l2 ~= nil and l2:is_held(), 'waiter acquired after reconnect')
+    l2:unlock()
+    t:is(#z:get_children('/droplock'), 0, 'no nodes left')
+    
+    z:delete('/droplock')
+end
+
+
+local function test_lock_timeout_in_request(t, server, z)
+    t:plan(4)
+    
+    z:create('/slowlock')
+    local before = z:stats().locks.timeouts
+    server:set_latency(0.5)
+    local ok, l, rc = pcall(z.lock, z, '/slowlock', {timeout = 0.1})
+    server:set_latency(0)
+    t:ok(ok, 'lock does not raise')
+    t:is(l, nil, 'lock not acquired')
+    t:is(rc, zkconst.errors.ZOPERATIONTIMEOUT, 'deadline expired in a request')
+    t:is(z:stats().locks.timeouts, before + 1, 'timeout counted')
+    
+    z:delete('/slowlock')
+end
+
+
+local function test_recipes_timeout_in_request(t, server, z)
+    t:plan(5)
+    
+    z:create('/slowrecipes')
+    local c = z:counter('/slowrecipes/counter')
+    local b = z:barrier('/slowrecipes/barrier', 2)
+    local before = z:stats().barriers.timeouts
+    server:set_latency(0.5)
+    local ok, value, rc = pcall(c.increment, c, 1, 0.1)
+    t:ok(ok, 'increment does not raise')
+    t:is_deeply({value, rc}, {nil, zkconst.errors.ZOPERATIONTIMEOUT},
+                'increment times out in a request')
+    local ok, rc = pcall(b.enter, b, 0.1)
+    t:ok(ok, 'enter does not raise')
+    t:is(rc, zkconst.errors.ZOPERATIONTIMEOUT, 'enter times out in a request')
+    server:set_latency(0)
+    t:is(z:stats().barriers.timeouts, before + 1, 'timeout counted')
+    
+    fiber.sleep(0.5)
+    for _, name in ipairs(z:get_children('/slowrecipes/barrier') or {}) do
+        z:delete('/slowrecipes/barrier/' .. name)
+    end
+    z:delete('/slowrecipes/barrier')
+    z:delete('/slowrecipes/counter')
+    z:delete('/slowrecipes')
+end
+
+
+local function test_expire_session(t, server, z)
+    t:plan(4)
+    
+    local states = {}
+    local function listener(_, state)
+        table.insert(states, state)
+    end
+    z:add_session_listener(listener)
+    z:create('/ephemeral', '', nil, zkconst.create_flags.EPHEMERAL)
+    
+    server:expire_session()
+    t:ok(wait_for(function()
+        for _, state in ipairs(states) do
+            if state == zkconst.states.EXPIRED_SESSION then
+                return true
+            end
+        end
+        return false
+    end, 5), 'session expiry reported')
+    t:is(server.nodes['/ephemeral'], nil, 'ephemeral node removed')
+    
+    t:ok(wait_for(function() return z:is_connected() end, 10),
+         'connected with a new session')
+    t:is(#server:session_ids(), 1, 'one live session')
+    
+    z:remove_session_listener(listener)
+end
+
+
+local function test_cache_on_expire(t, server, z)
+    t:plan(3)
+    
+    z:create('/cached', 'value')
+    local cache = z:cache()
+    cache:get('/cached')
+    cache:get('/cached')
+    t:is(cache:stats().misses, 1, 'second get is a hit')
+    
+    server:expire_session()
+    wait_for(function() return not z:is_connected() end, 5)
+    t:ok(wait_for(function() return cache:stats().entries == 0 end, 10),
+         'entries dropped with the session')
+    wait_for(function() return z:is_connected() end, 10)
+    cache:get('/cached')
+    t:is(cache:stats().misses, 2, 'get after expiry is a miss')
+    
+    z:delete('/cached')
+end
+
+
+local function main()
+    local server = mock_server.new()
+    local hosts = server:start()
+    local port = tonumber(string.match(hosts, ':(%d+)$'))
+    local z = connect(hosts)
+    
+    tap.test('test_reconnect_after_drop', test_reconnect_after_drop, server, z)
+    tap.test('test_inflight_on_drop', test_inflight_on_drop, server, z)
+    tap.test('test_latency', test_latency, server, z)
+    tap.test('test_stall', test_stall, server, z)
+    tap.test('test_reorder_watches', test_reorder_watches, server, z)
+    tap.test('test_watch_reregistration', test_watch_reregistration,
+             server, z)
+    tap.test('test_server_restart', test_server_restart, server, z, port)
+    tap.test('test_reconnect_backoff', test_reconnect_backoff,
+             server, z, port)
+    tap.test('test_lock_on_drop', test_lock_on_drop, server, z)
+    tap.test('test_lock_timeout_in_request', test_lock_timeout_in_request,
+             server, z)
+    tap.test('test_recipes_timeout_in_request',
+             test_recipes_timeout_in_request, server, z)
+    tap.test('test_expire_session', test_expire_session, server, z)
+    tap.test('test_cache_on_expire', test_cache_on_expire, server, z)
+    
+    z:close()
+    server:stop()
+end
+
+main()
@@ -0,0 +1,705 @@
+-- In-process ZooKeeper stand-in speaking the jute wire protocol. It keeps
+-- the tree in memory and serves just enough of the protocol for the
+-- benchmarks and tests: sessions, pings, reads, writes and one-shot
+-- watches. There is no persistence, no ACL checking and no multi. Faults
+-- (latency, dropped connections, expired sessions, stalled reads and
+-- reordered notifications) can be injected at any time.
+
+local clock = require 'clock'
+local errno = require 'errno'
+local fiber = require 'fiber'
+local log = require 'log'
+local socket = require 'socket'
+
+
+local ZOK = 0
+local ZUNIMPLEMENTED = -6
+local ZMARSHALLINGERROR = -5
+local ZNONODE = -101
+local ZBADVERSION = -103
+local ZNOCHILDRENFOREPHEMERALS = -108
+local ZNODEEXISTS = -110
+local ZNOTEMPTY = -111
+
+local OP_CREATE = 1
+local OP_DELETE = 2
+local OP_EXISTS = 3
+local OP_GET_DATA = 4
+local OP_SET_DATA = 5
+local OP_GET_ACL = 6
+local OP_SET_ACL = 7
+local OP_GET_CHILDREN = 8
+local OP_SYNC = 9
+local OP_PING = 11
+local OP_GET_CHILDREN2 = 12
+local OP_AUTH = 100
+local OP_SET_WATCHES = 101
+local OP_CLOSE_SESSION = -11
+
+local OP_CODES = {
+    create = OP_CREATE,
+    delete = OP_DELETE,
+    exists = OP_EXISTS,
+    get = OP_GET_DATA,
+    set = OP_SET_DATA,
+    get_acl = OP_GET_ACL,
+    set_acl = OP_SET_ACL,
+    get_children = OP_GET_CHILDREN,
+    get_children2 = OP_GET_CHILDREN2,
+    sync = OP_SYNC,
+    ping = OP_PING,
+    auth = OP_AUTH,
+    set_watches = OP_SET_WATCHES,
+    close_session = OP_CLOSE_SESSION,
+}
+
+local EVENT_CREATED = 1
+local EVENT_DELETED = 2
+local EVENT_CHANGED = 3
+local EVENT_CHILD = 4
+local STATE_CONNECTED = 3
+
+local FLAG_EPHEMERAL = 1
+local FLAG_SEQUENCE = 2
+
+local MIN_SESSION_TIMEOUT = 4000
+local MAX_SESSION_TIMEOUT = 40000
+
+local TWO_32 = 4294967296
+
+
+local function i32(n)
+    n = n % TWO_32
+    return string.char(math.floor(n / 16777216) % 256,
+                       math.floor(n / 65536) % 256,
+                       math.floor(n / 256) % 256,
+                       n % 256)
+end
+
+
+local function i64(n)
+    local hi = math.floor(n / TWO_32)
+    return i32(hi) .. i32(n - hi * TWO_32)
+end
+
+
+local function buffer(s)
+    if s == nil then
+        return i32(-1)
+    end
+    return i32(#s) .. s
+end
+
+
+local function strings(list)
+    local parts = {i32(#list)}
+    for _, s in ipairs(list) do
+        table.insert(parts, buffer(s))
+    end
+    return table.concat(parts)
+end
+
+
+local function stat(node)
+    local children = 0
+    for _ in pairs(node.children) do
+        children = children + 1
+    end
+    return table.concat({
+        i64(node.czxid), i64(node.mzxid), i64(node.ctime), i64(node.mtime),
+        i32(node.version), i32(node.cversion), i32(node.aversion),
+        i64(node.ephemeral_owner), i32(#node.data), i32(children),
+        i64(node.pzxid),
+    })
+end
+
+
+local reader_methods = {
+    i32 = function(self)
+        local a, b, c, d = string.byte(self.s, self.pos, self.pos + 3)
+        if d == nil then
+            error('short packet')
+        end
+        self.pos = self.pos + 4
+        local n = ((a * 256 + b) * 256 + c) * 256 + d
+        if n >= 2147483648 then
+            n = n - TWO_32
+        end
+        return n
+    end,
+    
+    i64 = function(self)
+        local hi = self:i32()
+        local lo = self:i32() % TWO_32
+        return hi * TWO_32 + lo
+    end,
+    
+    bool = function(self)
+        local b = string.byte(self.s, self.pos)
+        if b == nil then
+            error('short packet')
+        end
+        self.pos = self.pos + 1
+        return b ~= 0
+    end,
+    
+    buffer = function(self)
+        local len = self:i32()
+        if len < 0 then
+            return nil
+        end
+        local s = string.sub(self.s, self.pos, self.pos + len - 1)
+        if #s ~= len then
+            error('short packet')
+        end
+        self.pos = self.pos + len
+        return s
+    end,
+    
+    strings = function(self)
+        local list = {}
+        for i = 1, self:i32() do
+            list[i] = self:buffer()
+        end
+        return list
+    end,
+    
+    acl = function(self)
+        for _ = 1, self:i32() do
+            self:i32()
+            self:buffer()
+            self:buffer()
+        end
+    end,
+}
+
+
+local function reader(s)
+    return setmetatable({s = s, pos = 1}, {__index = reader_methods})
+end
+
+
+local function split_path(path)
+    local parent, name = string.match(path, '^(.*)/([^/]+)$')
+    if parent == nil then
+        return nil
+    end
+    if parent == '' then
+        parent = '/'
+    end
+    return parent, name
+end
+
+
+local function child_path(parent, name)
+    if parent == '/' then
+        return '/' .. name
+    end
+    return parent .. '/' .. name
+end
+
+
+local server_methods
+
+local function server_new()
+    local self = setmetatable({
+        zxid = 0,
+        nodes = {},
+        sessions = {},
+        next_session = 0x1000,
+        data_watches = {},
+        child_watches = {},
+        conns = {},
+        _socket = nil,
+        
+        -- counters for tests
+        connects = 0,
+        resumes = 0,
+        requests = {},
+        
+        _latency = 0,
+        _stalled = false,
+        _resumed = fiber.cond(),
+        _reorder_watches = false,
+    }, {
+        __index = server_methods,
+    })
+    self.nodes['/'] = self:_node('', 0)
+    return self
+end
+
+
+-- packets leave in order, each not before its due time
+local function send(conn, packet, delay)
+    if conn.closed then
+        return
+    end
+    local due = 0
+    if delay ~= nil and delay > 0 then
+        due = clock.monotonic() + delay
+    end
+    table.insert(conn.queue, {due = due, data = i32(#packet) .. packet})
+    conn.cond:signal()
+end
+
+
+local function writer(conn)
+    local head = 1
+    while not conn.closed do
+        local first = conn.queue[head]
+        if first == nil then
+            conn.queue = {}
+            head = 1
+            conn.cond:wait()
+        elseif first.due > clock.monotonic() then
+            conn.cond:wait(first.due - clock.monotonic())
+        else
+            local parts = {}
+            local now = clock.monotonic()
+            while conn.queue[head] ~= nil and conn.queue[head].due <= now do
+                table.insert(parts, conn.queue[head].data)
+                conn.queue[head] = nil
+                head = head + 1
+            end
+            if conn.sock:write(table.concat(parts)) == nil then
+                conn.closed = true
+            end
+        end
+    end
+end
+
+
+local function add_watch(watches, path, conn)
+    local set = watches[path]
+    if set == nil then
+        set = {}
+        watches[path] = set
+    end
+    set[conn] = true
+end
+
+
+server_methods = {
+    _node = function(self, data, owner)
+        local now = math.floor(fiber.time() * 1000)
+        return {
+            data = data or '',
+            children = {},
+            czxid = self.zxid,
+            mzxid = self.zxid,
+            ctime = now,
+            mtime = now,
+            version = 0,
+            cversion = 0,
+            aversion = 0,
+            ephemeral_owner = owner,
+            pzxid = self.zxid,
+        }
+    end,
+    
+    _create = function(self, path, data, flags, session)
+        local parent_path, name = split_path(path)
+        local parent = parent_path and self.nodes[parent_path]
+        if parent == nil then
+            return ZNONODE
+        end
+        if parent.ephemeral_owner ~= 0 then
+            return ZNOCHILDRENFOREPHEMERALS
+        end
+        if bit.band(flags, FLAG_SEQUENCE) ~= 0 then
+            name = name .. string.format('%010d', parent.cversion)
+            path = child_path(parent_path, name)
+        end
+        if self.nodes[path] ~= nil then
+            return ZNODEEXISTS
+        end
+        
+        self.zxid = self.zxid + 1
+        local owner = 0
+        if bit.band(flags, FLAG_EPHEMERAL) ~= 0 then
+            owner = session.id
+            session.ephemerals[path] = true
+        end
+        self.nodes[path] = self:_node(data, owner)
+        parent.children[name] = true
+        parent.cversion = parent.cversion + 1
+        parent.pzxid = self.zxid
+        
+        self:_fire(self.data_watches, path, EVENT_CREATED)
+        self:_fire(self.child_watches, parent_path, EVENT_CHILD)
+        return ZOK, path
+    end,
+    
+    _delete = function(self, path, version)
+        local node = self.nodes[path]
+        if node == nil or path == '/' then
+            return ZNONODE
+        end
+        if version ~= -1 and version ~= node.version then
+            return ZBADVERSION
+        end
+        if next(node.children) ~= nil then
+            return ZNOTEMPTY
+        end
+        
+        self.zxid = self.zxid + 1
+        local parent_path, name = split_path(path)
+        local parent = self.nodes[parent_path]
+        self.nodes[path] = nil
+        parent.children[name] = nil
+        parent.cversion = parent.cversion + 1
+        parent.pzxid = self.zxid
+        if node.ephemeral_owner ~= 0 then
+            local session = self.sessions[node.ephemeral_owner]
+            if session ~= nil then
+                session.ephemerals[path] = nil
+            end
+        end
+        
+        self:_fire(self.data_watches, path, EVENT_DELETED)
+        self:_fire(self.child_watches, path, EVENT_DELETED)
+        self:_fire(self.child_watches, parent_path, EVENT_CHILD)
+        return ZOK
+    end,
+    
+    _set = function(self, path, data, version)
+        local node = self.nodes[path]
+        if node == nil then
+            return ZNONODE
+        end
+        if version ~= -1 and version ~= node.version then
+            return ZBADVERSION
+        end
+        
+        self.zxid = self.zxid + 1
+        node.data = data or ''
+        node.mzxid = self.zxid
+        node.mtime = math.floor(fiber.time() * 1000)
+        node.version = node.version + 1
+        
+        self:_fire(self.data_watches, path, EVENT_CHANGED)
+        return ZOK, stat(node)
+    end,
+    
+    _children = function(self, path)
+        local names = {}
+        for name in pairs(self.nodes[path].children) do
+            table.insert(names, name)
+        end
+        return strings(names)
+    end,
+    
+    -- returns rc and the reply body
+    _request = function(self, conn, op, r)
+        local nodes = self.nodes
+        
+        if op == OP_CREATE then
+            local path = r:buffer()
+            local data = r:buffer()
+            r:acl()
+            local rc, created = self:_create(path, data, r:i32(), conn.session)
+            return rc, rc == ZOK and buffer(created) or ''
+        elseif op == OP_DELETE then
+            return self:_delete(r:buffer(), r:i32()), ''
+        elseif op == OP_EXISTS then
+            local path, watch = r:buffer(), r:bool()
+            if watch then
+                add_watch(self.data_watches, path, conn)
+            end
+            if nodes[path] == nil then
+                return ZNONODE, ''
+            end
+            return ZOK, stat(nodes[path])
+        elseif op == OP_GET_DATA then
+            local path, watch = r:buffer(), r:bool()
+            local node = nodes[path]
+            if node == nil then
+                return ZNONODE, ''
+            end
+            if watch then
+                add_watch(self.data_watches, path, conn)
+            end
+            return ZOK, buffer(node.data) .. stat(node)
+        elseif op == OP_SET_DATA then
+            local path = r:buffer()
+            local data = r:buffer()
+            local rc, body = self:_set(path, data, r:i32())
+            return rc, body or ''
+        elseif op == OP_GET_CHILDREN or op == OP_GET_CHILDREN2 then
+            local path, watch = r:buffer(), r:bool()
+            local node = nodes[path]
+            if node == nil then
+                return ZNONODE, ''
+            end
+            if watch then
+                add_watch(self.child_watches, path, conn)
+            end
+            if op == OP_GET_CHILDREN then
+                return ZOK, self:_children(path)
+            end
+            return ZOK, self:_children(path) .. stat(node)
+        elseif op == OP_SYNC then
+            return ZOK, buffer(r:buffer())
+        elseif op == OP_GET_ACL then
+            local node = nodes[r:buffer()]
+            if node == nil then
+                return ZNONODE, ''
+            end
+            local acl = i32(1) .. i32(31) .. buffer('world') .. buffer('anyone')
+            return ZOK, acl .. stat(node)
+        elseif op == OP_SET_ACL then
+            local node = nodes[r:buffer()]
+            r:acl()
+            local version = r:i32()
+            if node == nil then
+                return ZNONODE, ''
+            end
+            if version ~= -1 and version ~= node.aversion then
+                return ZBADVERSION, ''
+            end
+            node.aversion = node.aversion + 1
+            return ZOK, stat(node)
+        elseif op == OP_SET_WATCHES then
+            r:i64()
+            for _, path in ipairs(r:strings()) do
+                add_watch(self.data_watches, path, conn)
+            end
+            for _, path in ipairs(r:strings()) do
+                add_watch(self.data_watches, path, conn)
+            end
+            for _, path in ipairs(r:strings()) do
+                add_watch(self.child_watches, path, conn)
+            end
+            return ZOK, ''
+        elseif op == OP_PING or op == OP_AUTH then
+            return ZOK, ''
+        end
+        return ZUNIMPLEMENTED, ''
+    end,
+    
+    _fire = function(self, watches, path, event)
+        local set = watches[path]
+        if set == nil then
+            return
+        end
+        watches[path] = nil
+        local packet = i32(-1) .. i64(-1) .. i32(ZOK)
+                       .. i32(event) .. i32(STATE_CONNECTED) .. buffer(path)
+        for conn in pairs(set) do
+            if self._reorder_watches then
+                table.insert(conn.held, packet)
+            else
+                send(conn, packet, self._latency)
+            end
+        end
+    end,
+    
+    _connect = function(self, conn, r)
+        r:i32() -- protocol version
+        r:i64() -- last zxid seen
+        local timeout = r:i32()
+        local session_id = r:i64()
+        r:buffer() -- password
+        
+        self.connects = self.connects + 1
+        timeout = math.max(MIN_SESSION_TIMEOUT,
+                           math.min(timeout, MAX_SESSION_TIMEOUT))
+        local session = self.sessions[session_id]
+        if session == nil and session_id ~= 0 then
+            -- a zero timeout tells the client its session has expired
+            send(conn, i32(0) .. i32(0) .. i64(0)
+                       .. buffer(string.rep('\0', 16)) .. '\0')
+            return false
+        elseif session == nil then
+            session_id = self.next_session
+            self.next_session = self.next_session + 1
+            session = {id = session_id, ephemerals = {}}
+            self.sessions[session_id] = session
+        else
+            self.resumes = self.resumes + 1
+        end
+        conn.session = session
+        
+        send(conn, i32(0) .. i32(timeout) .. i64(session_id)
+                   .. buffer(string.rep('\0', 16)) .. '\0')
+        return true
+    end,
+    
+    _close_session = function(self, session)
+        for path in pairs(session.ephemerals) do
+            self:_delete(path, -1)
+        end
+        self.sessions[session.id] = nil
+    end,
+    
+    _close_conn = function(self, conn)
+        conn.closed = true
+        conn.cond:signal()
+        conn.sock:shutdown('RW')
+    end,
+    
+    _serve = function(self, sock)
+        local conn = {
+            sock = sock,
+            queue = {},
+            held = {},
+            cond = fiber.cond(),
+            closed = false,
+            session = nil,
+        }
+        self.conns[conn] = true
+        fiber.create(writer, conn)
+        
+        while not conn.closed do
+            local header = sock:read(4)
+            if header == nil or #header < 4 then
+                break
+            end
+            local len = reader(header):i32()
+            local packet = sock:read(len)
+            if packet == nil or #packet < len then
+                break
+            end
+            while self._stalled and not conn.closed do
+                self._resumed:wait()
+            end
+            if conn.closed then
+                break
+            end
+            
+            local r = reader(packet)
+            if conn.session == nil then
+                if not self:_connect(conn, r) then
+                    break
+                end
+            else
+                local xid, op = r:i32(), r:i32()
+                self.requests[op] = (self.requests[op] or 0) + 1
+                local ok, rc, body = pcall(self._request, self, conn, op, r)
+                if not ok then
+                    log.error('mock zookeeper: bad request %d: %s', op, rc)
+                    rc, body = ZMARSHALLINGERROR, ''
+                end
+                if rc ~= ZOK then
+                    body = ''
+                end
+                send(conn, i32(xid) .. i64(self.zxid) .. i32(rc) .. body,
+                     self._latency)
+                
+                if op == OP_CLOSE_SESSION then
+                    self:_close_session(conn.session)
+                    break
+                end
+            end
+        end
+        
+        -- let the writer flush the last replies
+        while next(conn.queue) ~= nil and not conn.closed do
+            fiber.sleep(0.001)
+        end
+        conn.closed = true
+        conn.cond:signal()
+        self.conns[conn] = nil
+    end,
+    
+    -- listens on 127.0.0.1 and returns 'host:port' to connect to
+    start = function(self, port)
+        self._socket = socket.tcp_server('127.0.0.1', port or 0, {
+            name = 'mock_zookeeper',
+            handler = function(sock)
+                self:_serve(sock)
+            end,
+        })
+        if self._socket == nil then
+            error('mock zookeeper: cannot listen: ' .. errno.strerror())
+        end
+        local addr = self._socket:name()
+        return string.format('%s:%d', addr.host, addr.port)
+    end,
+    
+    stop = function(self)
+        if self._socket ~= nil then
+            self._socket:close()
+            self._socket = nil
+        end
+        self:resume()
+        self:drop_connections()
+    end,
+    
+    -- Fault injection. All of it applies to the connections already open
+    -- as well as to new ones.
+    
+    -- delays every reply and notification by seconds; order is kept
+    set_latency = function(self, seconds)
+        self._latency = seconds
+    end,
+    
+    -- closes every client connection; sessions stay alive
+    drop_connections = function(self)
+        for conn in pairs(self.conns) do
+            self:_close_conn(conn)
+        end
+    end,
+    
+    -- ends the session (all of them without an id): its ephemeral nodes
+    -- are deleted and the client is told so when it reconnects
+    expire_session = function(self, session_id)
+        for id, session in pairs(self.sessions) do
+            if session_id == nil or id == session_id then
+                self:_close_session(session)
+                for conn in pairs(self.conns) do
+                    if conn.session == session then
+                        self:_close_conn(conn)
+                    end
+                end
+            end
+        end
+    end,
+    
+    -- requests are read but not answered until resume(), pings included
+    stall = function(self)
+        self._stalled = true
+    end,
+    
+    resume = function(self)
+        self._stalled = false
+        self._resumed:broadcast()
+    end,
+    
+    -- holds watch notifications back; flush_watches() sends them in
+    -- reverse order
+    set_reorder_watches = function(self, enabled)
+        self._reorder_watches = enabled
+        if not enabled then
+            self:flush_watches()
+        end
+    end,
+    
+    flush_watches = function(self)
+        for conn in pairs(self.conns) do
+            for i = #conn.held, 1, -1 do
+                send(conn, conn.held[i], self._latency)
+            end
+            conn.held = {}
+        end
+    end,
+    
+    -- number of requests of a type received so far, e.g. 'exists'
+    request_count = function(self, name)
+        return self.requests[OP_CODES[name]] or 0
+    end,
+    
+    -- ids of the live sessions
+    session_ids = function(self)
+        local ids = {}
+        for id in pairs(self.sessions) do
+            table.insert(ids, id)
+        end
+        table.sort(ids)
+        return ids
+    end,
+}
+
+return {
+    new = server_new,
+}
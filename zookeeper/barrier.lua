@@ -0,0 +1,309 @@
+local bit = require 'bit'
+local clock = require 'clock'
+local fiber = require 'fiber'
+local uuid = require 'uuid'
+
+local const = require 'zookeeper.const'
+local driver = require 'zookeeper.driver'
+
+local ZOK = const.ZOK
+local ZNONODE = const.api_errors.ZNONODE
+local ZNODEEXISTS = const.api_errors.ZNODEEXISTS
+local ZOPERATIONTIMEOUT = const.errors.ZOPERATIONTIMEOUT
+local CREATED = const.watch_types.CREATED
+local MEMBER_FLAGS = bit.bor(const.create_flags.EPHEMERAL,
+                             const.create_flags.SEQUENCE)
+local READY = 'ready'
+
+
+local barrier_methods
+
+local function stats_new()
+    return {
+        entered = 0,
+        left = 0,
+        timeouts = 0,
+        enter_time = 0,
+        leave_time = 0,
+    }
+end
+
+
+-- Double barrier for count members on the children of path: enter()
+-- returns once count members have entered, leave() once all of them have
+-- left. A member is an ephemeral sequential child; the ready child marks
+-- that everyone is in.
+local function barrier_new(z, path, count, opts)
+    if type(count) ~= 'number' or count < 1 then
+        error('count must be a positive number')
+    end
+    if opts ~= nil and opts.value ~= nil and type(opts.value) ~= 'string' then
+        error('value must be a string')
+    end
+    
+    return setmetatable({
+        path = path,
+        count = count,
+        node = nil,
+        
+        _z = z,
+        _entered = false,
+        _value = opts and opts.value or '',
+        _name = nil,
+        _stats = z._barrier_stats,
+    }, {
+        __index = barrier_methods,
+    })
+end
+
+
+local function _remaining(deadline)
+    if deadline == nil then
+        return nil
+    end
+    return math.max(deadline - clock.monotonic(), 0)
+end
+
+
+local function _timed_out(deadline)
+    return deadline ~= nil and clock.monotonic() >= deadline
+end
+
+
+-- calls fn returning its code at position n; a request that ran out of
+-- time gives ZOPERATIONTIMEOUT there
+local function _call(n, fn, ...)
+    local res = {pcall(fn, ...)}
+    if res[1] then
+        return unpack(res, 2, table.maxn(res))
+    end
+    if driver.error_code(res[2]) ~= ZOPERATIONTIMEOUT then
+        error(res[2], 0)
+    end
+    res = {}
+    res[n] = ZOPERATIONTIMEOUT
+    return unpack(res, 1, n)
+end
+
+
+-- the member node, the watch on ready and the members list are sent
+-- together and take one round trip
+local function _join(self, on_ready, deadline)
+    local z = self._z
+    local tag = '_c_' .. uuid.str() .. '-'
+    local fc = z:create_async(self.path .. '/' .. tag .. 'n-', self._value,
+                              nil, MEMBER_FLAGS)
+    local fw = z:wexists_async(self.path .. '/' .. READY, on_ready)
+    local names, rc = _call(2, z.sequence_children, z, self.path,
+                            {timeout = _remaining(deadline)})
+    local created, crc = _call(2, fc.wait, fc, _remaining(deadline))
+    local ready, _, wrc = _call(3, fw.wait, fw, _remaining(deadline))
+    if crc == ZOPERATIONTIMEOUT then
+        -- the node may be created yet; a member that gave up must not
+        -- be counted
+        fiber.create(function()
+            local ok, late, lrc = pcall(fc.wait, fc)
+            if ok and lrc == ZOK then
+                pcall(z.delete, z, late)
+            end
+        end)
+    end
+    if crc ~= ZOK then
+        return crc
+    end
+    -- set before the other replies are looked at, so that a member
+    -- giving up removes its node
+    self.node = created
+    self._name = string.match(created, '[^/]+$')
+    if wrc == ZOPERATIONTIMEOUT then
+        return wrc
+    end
+    if ready then
+        return ZOK, true
+    end
+    return rc, false, names
+end
+
+
+local function _enter(self, deadline)
+    local z = self._z
+    local cond = fiber.cond()
+    local ready = false
+    -- created is enough: the last member to leave deletes ready, possibly
+    -- before a slow member looks at it again
+    local function on_ready(_, type)
+        if type == CREATED then
+            ready = true
+        end
+        cond:signal()
+    end
+    
+    local rc, exists, names = _join(self, on_ready, deadline)
+    if rc == ZNONODE then
+        rc = _call(1, z.ensure_path, z, self.path, _remaining(deadline))
+        if rc ~= ZOK then
+            return rc
+        end
+        rc, exists, names = _join(self, on_ready, deadline)
+    end
+    if rc ~= ZOK then
+        return rc
+    end
+    if exists then
+        return ZOK
+    end
+    
+    if #names >= self.count then
+        local _, crc = _call(2, z.create, z, self.path .. '/' .. READY, nil,
+                             nil, nil, _remaining(deadline))
+        if crc == ZOK or crc == ZNODEEXISTS then
+            return ZOK
+        end
+        return crc
+    end
+    while not ready do
+        if _timed_out(deadline) then
+            return ZOPERATIONTIMEOUT
+        end
+        cond:wait(_remaining(deadline))
+        if not ready and z:is_connected() and not _timed_out(deadline) then
+            -- a session event; the watch may be gone with the session
+            local found, _, erc = _call(3, z.wexists, z,
+                self.path .. '/' .. READY, on_ready, nil, _remaining(deadline))
+            if erc == ZOK and found then
+                ready = true
+            end
+        end
+    end
+    return ZOK
+end
+
+
+-- waits until node is deleted; a get sets no watch if it is gone already
+local function _wait_gone(self, name, deadline)
+    local z = self._z
+    local cond = fiber.cond()
+    local fired = false
+    local _, _, rc = _call(3, z.wget, z, self.path .. '/' .. name, function()
+        fired = true
+        cond:signal()
+    end, nil, _remaining(deadline))
+    if rc == ZNONODE then
+        return ZOK
+    end
+    if rc ~= ZOK then
+        return rc
+    end
+    while not fired do
+        if _timed_out(deadline) then
+            return ZOPERATIONTIMEOUT
+        end
+        cond:wait(_remaining(deadline))
+    end
+    return ZOK
+end
+
+
+local function _finish(self, deadline)
+    local z = self._z
+    if self.node ~= nil then
+        _call(1, z.delete, z, self.node, nil, _remaining(deadline))
+        self.node = nil
+    end
+    -- the last member out removes the mark for the next round
+    _call(1, z.delete, z, self.path .. '/' .. READY, nil,
+          _remaining(deadline))
+    return ZOK
+end
+
+
+-- the lowest member leaves last; the others leave at once and wait for
+-- it. Every member waits for a single node, not for the whole group.
+local function _leave(self, deadline)
+    local z = self._z
+    while true do
+        if _timed_out(deadline) then
+            return ZOPERATIONTIMEOUT
+        end
+        local names, rc = _call(2, z.sequence_children, z, self.path,
+                                {timeout = _remaining(deadline)})
+        if rc ~= ZOK then
+            return rc
+        end
+        
+        if self.node == nil then
+            if #names == 0 then
+                return _finish(self, deadline)
+            end
+            rc = _wait_gone(self, names[1], deadline)
+        elseif #names <= 1 then
+            return _finish(self, deadline)
+        elseif names[1] == self._name then
+            rc = _wait_gone(self, names[#names], deadline)
+        else
+            -- the delete and the watch on the lowest go out together
+            local f = z:delete_async(self.node)
+            rc = _wait_gone(self, names[1], deadline)
+            local drc = _call(1, f.wait, f, _remaining(deadline))
+            if drc ~= ZOK and drc ~= ZNONODE then
+                return drc
+            end
+            self.node = nil
+        end
+        if rc ~= ZOK then
+            return rc
+        end
+    end
+end
+
+
+local function _timed(self, fn, field, deadline)
+    local stats = self._stats
+    local start = clock.monotonic()
+    local rc = fn(self, deadline)
+    stats[field] = stats[field] + clock.monotonic() - start
+    if rc == ZOPERATIONTIMEOUT then
+        stats.timeouts = stats.timeouts + 1
+    end
+    return rc
+end
+
+
+barrier_methods = {
+    -- waits for count members to enter; a member that gives up leaves
+    enter = function(self, timeout)
+        if self._entered then
+            error('barrier is already entered')
+        end
+        local deadline = timeout and clock.monotonic() + timeout
+        local rc = _timed(self, _enter, 'enter_time', deadline)
+        if rc == ZOK then
+            self._entered = true
+            self._stats.entered = self._stats.entered + 1
+        elseif self.node ~= nil then
+            pcall(self._z.delete, self._z, self.node)
+            self.node = nil
+        end
+        return rc
+    end,
+    
+    -- waits for every member to leave
+    leave = function(self, timeout)
+        if not self._entered then
+            error('barrier is not entered')
+        end
+        local deadline = timeout and clock.monotonic() + timeout
+        local rc = _timed(self, _leave, 'leave_time', deadline)
+        if rc == ZOK then
+            self._entered = false
+            self._stats.left = self._stats.left + 1
+        end
+        return rc
+    end,
+}
+
+
+return {
+    new = barrier_new,
+    stats_new = stats_new,
+}
@@ -0,0 +1,135 @@
+local fiber = require 'fiber'
+
+local const = require 'zookeeper.const'
+
+local watch_types = const.watch_types
+local states = const.states
+
+
+local cache_methods
+
+-- Read-through cache of node values. Every cached node holds a one-shot
+-- data watch, so an entry lives exactly until the node changes, is
+-- deleted or the session is interrupted.
+local function cache_new(z)
+    return setmetatable({
+        _z = z,
+        _entries = {},
+        _loading = {},
+        _hits = 0,
+        _misses = 0,
+        _invalidations = 0,
+        _bytes = 0,
+    }, {
+        __index = cache_methods,
+    })
+end
+
+
+local function _entry_size(path, value)
+    return #path + (value ~= nil and #value or 0)
+end
+
+
+local function _drop(self, path)
+    local entry = self._entries[path]
+    if entry == nil then
+        return
+    end
+    self._entries[path] = nil
+    self._bytes = self._bytes - entry.size
+    self._invalidations = self._invalidations + 1
+end
+
+
+local function _watcher(_, type, state, path, self)
+    if type == watch_types.SESSION then
+        -- the path of a session event is empty. An expired session took
+        -- every watch with it, so nothing cached can be trusted.
+        if state ~= states.CONNECTED then
+            cache_methods.clear(self)
+        end
+        return
+    end
+    _drop(self, path)
+end
+
+
+local function _load(self, path)
+    local cond = fiber.cond()
+    self._loading[path] = cond
+    
+    local ok, value, stat, rc = pcall(self._z.wget, self._z,
+                                      path, _watcher, self)
+    self._loading[path] = nil
+    cond:broadcast()
+    if not ok then
+        error(value)
+    end
+    
+    if rc == const.ZOK then
+        local size = _entry_size(path, value)
+        self._entries[path] = {
+            value = value,
+            stat = stat,
+            size = size,
+        }
+        self._bytes = self._bytes + size
+    end
+    return value, stat, rc
+end
+
+
+cache_methods = {
+    -- Same results as z:get(path). Only existing nodes are cached.
+    get = function(self, path)
+        local entry = self._entries[path]
+        if entry ~= nil then
+            self._hits = self._hits + 1
+            return entry.value, entry.stat, const.ZOK
+        end
+        
+        -- a concurrent miss for the same path is already on the wire
+        local loading = self._loading[path]
+        if loading ~= nil then
+            loading:wait()
+            entry = self._entries[path]
+            if entry ~= nil then
+                self._hits = self._hits + 1
+                return entry.value, entry.stat, const.ZOK
+            end
+        end
+        
+        self._misses = self._misses + 1
+        return _load(self, path)
+    end,
+    
+    invalidate = function(self, path)
+        _drop(self, path)
+    end,
+    
+    clear = function(self)
+        for path in pairs(self._entries) do
+            _drop(self, path)
+        end
+    end,
+    
+    stats = function(self)
+        local entries = 0
+        for _ in pairs(self._entries) do
+            entries = entries + 1
+        end
+        return {
+            hits = self._hits,
+            misses = self._misses,
+            invalidations = self._invalidations,
+            entries = entries,
+            bytes = self._bytes,
+        }
+    end,
+}
+
+
+return {
+    new = cache_new,
+}
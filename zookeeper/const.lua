@@ -2,6 +2,7 @@ local driver = require 'zookeeper.driver'
 
 local fields = {
     'watch_types',
+    'watch_modes',
     'states',
     'log_level',
     'errors',
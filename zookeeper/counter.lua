@@ -0,0 +1,255 @@
+local clock = require 'clock'
+local fiber = require 'fiber'
+
+local const = require 'zookeeper.const'
+local driver = require 'zookeeper.driver'
+
+local ZOK = const.ZOK
+local ZNONODE = const.api_errors.ZNONODE
+local ZNODEEXISTS = const.api_errors.ZNODEEXISTS
+local ZBADVERSION = const.api_errors.ZBADVERSION
+local ZOPERATIONTIMEOUT = const.errors.ZOPERATIONTIMEOUT
+
+local DEFAULT_BACKOFF_INITIAL = 0.001
+local DEFAULT_BACKOFF_MAX = 0.1
+
+
+local counter_methods
+
+local function stats_new()
+    return {
+        increments = 0,
+        -- writes rejected because another client got there first
+        conflicts = 0,
+        max_retries = 0,
+        backoff_time = 0,
+        reads = 0,
+    }
+end
+
+
+-- Shared counter stored as a decimal string in the value of path.
+-- Increments are compare-and-set writes against the version seen last,
+-- so an uncontended increment is a single set with no read before it.
+local function counter_new(z, path, opts)
+    if opts == nil then
+        opts = {}
+    end
+    local initial = opts.initial or 0
+    if type(initial) ~= 'number' then
+        error('initial must be a number')
+    end
+    local backoff_initial = opts.backoff_initial or DEFAULT_BACKOFF_INITIAL
+    local backoff_max = opts.backoff_max or DEFAULT_BACKOFF_MAX
+    if type(backoff_initial) ~= 'number' or backoff_initial <= 0 or
+            type(backoff_max) ~= 'number' or backoff_max < backoff_initial then
+        error('backoff must be positive with backoff_max >= backoff_initial')
+    end
+    
+    return setmetatable({
+        path = path,
+        
+        _z = z,
+        _initial = initial,
+        _backoff_initial = backoff_initial,
+        _backoff_max = backoff_max,
+        -- the value and version seen last, nil until read
+        _value = nil,
+        _version = nil,
+        -- the current backoff, 0 while there are no conflicts
+        _backoff = 0,
+        _stats = z._counter_stats,
+    }, {
+        __index = counter_methods,
+    })
+end
+
+
+local function _remaining(deadline)
+    if deadline == nil then
+        return nil
+    end
+    return math.max(deadline - clock.monotonic(), 0)
+end
+
+
+-- calls fn returning its code at position n; a request that ran out of
+-- time gives ZOPERATIONTIMEOUT there
+local function _call(n, fn, ...)
+    local res = {pcall(fn, ...)}
+    if res[1] then
+        return unpack(res, 2, table.maxn(res))
+    end
+    if driver.error_code(res[2]) ~= ZOPERATIONTIMEOUT then
+        error(res[2], 0)
+    end
+    res = {}
+    res[n] = ZOPERATIONTIMEOUT
+    return unpack(res, 1, n)
+end
+
+
+local function _remember(self, value, stat)
+    local number = tonumber(value)
+    if number == nil then
+        error(string.format('counter %s holds a non-number', self.path))
+    end
+    self._value = number
+    self._version = stat.version
+end
+
+
+local function _read(self, deadline)
+    local z = self._z
+    self._stats.reads = self._stats.reads + 1
+    local value, stat, rc = _call(3, z.get, z, self.path, nil,
+                                  _remaining(deadline))
+    if rc == ZOK then
+        _remember(self, value, stat)
+    end
+    return rc
+end
+
+
+-- creates the node holding the first value; ZNODEEXISTS if another
+-- client created it first
+local function _create(self, value, deadline)
+    local z = self._z
+    local _, rc = _call(2, z.create, z, self.path, tostring(value), nil, nil,
+                        _remaining(deadline))
+    if rc == ZNONODE then
+        local parent = string.match(self.path, '^(.+)/[^/]+$')
+        if parent ~= nil then
+            rc = _call(1, z.ensure_path, z, parent, _remaining(deadline))
+            if rc == ZOK then
+                _, rc = _call(2, z.create, z, self.path, tostring(value),
+                              nil, nil, _remaining(deadline))
+            end
+        end
+    end
+    if rc == ZOK then
+        self._value = value
+        self._version = 0
+    end
+    return rc
+end
+
+
+-- an increment that lost the race waits a random part of the backoff,
+-- which doubles with every conflict and halves with every success
+local function _back_off(self, deadline)
+    self._backoff = math.min(self._backoff_max,
+        math.max(self._backoff_initial, self._backoff * 2))
+    local wait = math.random() * self._backoff
+    if deadline ~= nil then
+        wait = math.min(wait, _remaining(deadline))
+    end
+    self._stats.backoff_time = self._stats.backoff_time + wait
+    fiber.sleep(wait)
+end
+
+
+local function _increment(self, delta, deadline)
+    local z = self._z
+    local stats = self._stats
+    local retries = 0
+    while true do
+        if deadline ~= nil and clock.monotonic() >= deadline then
+            return nil, ZOPERATIONTIMEOUT
+        end
+        
+        if self._version == nil then
+            local rc = _read(self, deadline)
+            if rc == ZNONODE then
+                rc = _create(self, self._initial + delta, deadline)
+                if rc == ZOK then
+                    stats.increments = stats.increments + 1
+                    return self._value, rc
+                end
+                if rc ~= ZNODEEXISTS then
+                    return nil, rc
+                end
+            elseif rc ~= ZOK then
+                return nil, rc
+            end
+        else
+            local value = self._value + delta
+            local f = z:set_async(self.path, tostring(value), self._version)
+            -- after a conflict the next attempt is likely to need a fresh
+            -- value, so the read goes out with the write instead of after
+            -- it. If the write wins after all, the read is wasted.
+            local g
+            if self._backoff > 0 then
+                g = z:get_async(self.path)
+            end
+            local _, stat, rc = _call(3, f.wait, f, _remaining(deadline))
+            
+            if rc == ZOK then
+                self._value = value
+                self._version = stat.version
+                self._backoff = self._backoff / 2
+                if self._backoff < self._backoff_initial then
+                    self._backoff = 0
+                end
+                stats.increments = stats.increments + 1
+                stats.max_retries = math.max(stats.max_retries, retries)
+                return value, rc
+            elseif rc == ZBADVERSION then
+                stats.conflicts = stats.conflicts + 1
+                retries = retries + 1
+                self._version = nil
+                if g ~= nil then
+                    stats.reads = stats.reads + 1
+                    local current, gstat, grc = _call(3, g.wait, g,
+                                                      _remaining(deadline))
+                    if grc == ZOK then
+                        _remember(self, current, gstat)
+                    end
+                end
+                _back_off(self, deadline)
+            elseif rc == ZNONODE then
+                self._version = nil
+            else
+                return nil, rc
+            end
+        end
+    end
+end
+
+
+counter_methods = {
+    -- adds delta (1 by default) and returns the new value and the return
+    -- code; the node is created with opts.initial + delta if missing
+    increment = function(self, delta, timeout)
+        if delta == nil then
+            delta = 1
+        end
+        if type(delta) ~= 'number' then
+            error('delta must be a number')
+        end
+        local deadline = timeout and clock.monotonic() + timeout
+        return _increment(self, delta, deadline)
+    end,
+    
+    decrement = function(self, delta, timeout)
+        return self:increment(-(delta or 1), timeout)
+    end,
+    
+    -- the current value read from the server
+    get = function(self)
+        local rc = _read(self)
+        if rc == ZNONODE then
+            return self._initial, rc
+        end
+        if rc ~= ZOK then
+            return nil, rc
+        end
+        return self._value, rc
+    end,
+}
+
+
+return {
+    new = counter_new,
+    stats_new = stats_new,
+}
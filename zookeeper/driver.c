@@ -1,6 +1,11 @@
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE /* fopencookie */
+#endif
+
 #include "driver.h"
 
 #include <string.h>
+#include <unistd.h>
 
 #ifndef ZOO_NOTCONNECTED_STATE
 #  define ZOO_NOTCONNECTED_STATE 999
@@ -14,7 +19,10 @@ static int
 _zk_build_stat(lua_State *L, const struct Stat *stat);
 
 static int
-_zk_build_string_vector(lua_State *L, const struct String_vector *sv);
+_zk_build_buffer(lua_State *L, struct zk_buffer *buffer);
+
+static int
+_zk_build_string_vector(lua_State *L, const char *buf, int count);
 
 static int
 _zk_copy_acl_list(lua_State *L, const struct ACL_vector *acls);
@@ -22,6 +30,21 @@ _zk_copy_acl_list(lua_State *L, const struct ACL_vector *acls);
 static void
 _zk_local_wctx_free(lua_State *L, struct zk_local_wctx *wctx);
 
+static void
+_zk_data_result_complete(struct zk_data_result *cdata, int rc);
+
+static void
+_zk_multi_ctx_free(struct zk_multi_ctx *multi);
+
+static int
+_zk_multi_push_results(lua_State *L, struct zk_multi_ctx *multi, int rc);
+
+static void
+_zk_batch_complete(struct zk_data_result *cdata);
+
+static void
+_zk_persistent_wctx_unref(lua_State *L, struct zk_persistent_wctx *wctx);
+
 
 static inline struct lua_zoo_handle *
 _zk_check_zoo_handle(struct lua_State *L, int index)
@@ -62,8 +85,216 @@ _zk_check_zoo_acl(struct lua_State *L, int index)
     return NULL;
 }
 
+/***************** result begin *****************/
+
+static int
+_zk_result_reserve(struct zk_result *result,
+                   size_t size)
+{
+    if (size <= result->buf_size) {
+        return 0;
+    }
+    char *buf = (char *) realloc(result->buf, size);
+    if (buf == NULL) {
+        return -1;
+    }
+    result->buf = buf;
+    result->buf_size = size;
+    return 0;
+}
+
+static void
+_zk_result_set_stat(struct zk_result *result,
+                    const struct Stat *stat)
+{
+    result->has_stat = stat != NULL;
+    if (stat != NULL) {
+        result->stat = *stat;
+    }
+}
+
+static void
+_zk_buffer_unref(struct zk_buffer *buffer)
+{
+    if (buffer != NULL && --buffer->refs == 0) {
+        free(buffer);
+    }
+}
+
+static int
+_zk_result_set_value(struct zk_result *result,
+                     const char *value,
+                     int value_len)
+{
+    result->value_len = -1;
+    _zk_buffer_unref(result->value_buf);
+    result->value_buf = NULL;
+    if (value == NULL || value_len < 0) {
+        return 0;
+    }
+    if (result->want_buffer) {
+        /* the only copy: Lua gets this memory, not an interned string */
+        struct zk_buffer *buffer = (struct zk_buffer *) malloc(
+            sizeof(struct zk_buffer) + value_len + 1);
+        if (buffer == NULL) {
+            return -1;
+        }
+        buffer->refs = 1;
+        buffer->size = value_len;
+        memcpy(buffer->data, value, value_len);
+        buffer->data[value_len] = '\0';
+        result->value_buf = buffer;
+        result->value_len = value_len;
+        return 0;
+    }
+    if (_zk_result_reserve(result, value_len + 1) != 0) {
+        return -1;
+    }
+    memcpy(result->buf, value, value_len);
+    result->value_len = value_len;
+    return 0;
+}
+
+/* strings are stored back to back, each one with its terminating zero */
+static int
+_zk_result_set_strings(struct zk_result *result,
+                       const struct String_vector *strings)
+{
+    result->strings_count = -1;
+    if (strings == NULL) {
+        return 0;
+    }
+    
+    size_t size = 1;
+    int i;
+    for (i = 0; i < strings->count; ++i) {
+        size += strlen(strings->data[i]) + 1;
+    }
+    if (_zk_result_reserve(result, size) != 0) {
+        return -1;
+    }
+    
+    char *p = result->buf;
+    for (i = 0; i < strings->count; ++i) {
+        size_t len = strlen(strings->data[i]) + 1;
+        memcpy(p, strings->data[i], len);
+        p += len;
+    }
+    result->strings_count = strings->count;
+    return 0;
+}
+
+/* the ACL array goes first in the buffer, followed by its strings */
+static int
+_zk_result_set_acl(struct zk_result *result,
+                   const struct ACL_vector *acl)
+{
+    result->has_acl = false;
+    if (acl == NULL) {
+        return 0;
+    }
+    
+    size_t size = acl->count * sizeof(struct ACL) + 1;
+    int i;
+    for (i = 0; i < acl->count; ++i) {
+        size += strlen(acl->data[i].id.scheme) + 1;
+        size += strlen(acl->data[i].id.id) + 1;
+    }
+    if (_zk_result_reserve(result, size) != 0) {
+        return -1;
+    }
+    
+    struct ACL *data = (struct ACL *) result->buf;
+    char *p = result->buf + acl->count * sizeof(struct ACL);
+    for (i = 0; i < acl->count; ++i) {
+        size_t len = strlen(acl->data[i].id.scheme) + 1;
+        data[i].perms = acl->data[i].perms;
+        data[i].id.scheme = memcpy(p, acl->data[i].id.scheme, len);
+        p += len;
+        
+        len = strlen(acl->data[i].id.id) + 1;
+        data[i].id.id = memcpy(p, acl->data[i].id.id, len);
+        p += len;
+    }
+    result->acl.count = acl->count;
+    result->acl.data = data;
+    result->has_acl = true;
+    return 0;
+}
+
+/**
+ * build the Lua values of a completed request on L, in the order the
+ * synchronous operations return them.
+ **/
+static int
+_zk_result_push(lua_State *L,
+                struct zk_data_result *cdata)
+{
+    struct zk_result *result = &cdata->result;
+    const struct Stat *stat = result->has_stat ? &result->stat : NULL;
+    int count = 0;
+    
+    lua_checkstack(L, 4);
+    switch (result->kind) {
+    case ZK_RESULT_VOID:
+        break;
+    case ZK_RESULT_DATA:
+    case ZK_RESULT_STRING:
+        if (result->value_len < 0) {
+            lua_pushnil(L);
+        } else if (result->value_buf != NULL) {
+            _zk_build_buffer(L, result->value_buf);
+        } else {
+            lua_pushlstring(L, result->buf, result->value_len);
+        }
+        count = 1;
+        if (result->kind == ZK_RESULT_DATA) {
+            _zk_build_stat(L, stat);
+            count = 2;
+        }
+        break;
+    case ZK_RESULT_STAT:
+        lua_pushboolean(L, stat != NULL);
+        _zk_build_stat(L, stat);
+        count = 2;
+        break;
+    case ZK_RESULT_STRINGS:
+        _zk_build_string_vector(L, result->buf, result->strings_count);
+        count = 1;
+        break;
+    case ZK_RESULT_STRINGS_STAT:
+        _zk_build_string_vector(L, result->buf, result->strings_count);
+        _zk_build_stat(L, stat);
+        count = 2;
+        break;
+    case ZK_RESULT_ACL:
+        _zk_copy_acl_list(L, result->has_acl ? &result->acl : NULL);
+        _zk_build_stat(L, stat);
+        count = 2;
+        break;
+    case ZK_RESULT_MULTI:
+        _zk_multi_push_results(L, cdata->multi, result->rc);
+        count = 1;
+        break;
+    }
+    lua_pushinteger(L, result->rc);
+    return count + 1;
+}
+
+/***************** result end *****************/
+
 /***************** cb functions *****************/
 
+/**
+ * Watchers are called from inside zookeeper_process(). They only put the
+ * event into the handle's watch queue; lua_zoo_dispatch() fibers run the
+ * user's functions, so a slow watcher never stalls the session I/O.
+ **/
+static void
+_zk_watch_queue_push(struct zk_watch_queue *queue,
+                     struct zk_watch_event *event,
+                     const char *path);
+
 void
 watcher_dispatch(zhandle_t *zh,
                  int type,
@@ -73,27 +304,20 @@ watcher_dispatch(zhandle_t *zh,
 {
     (void) zh;
     struct zk_global_wctx *wctx = (struct zk_global_wctx *) watcherctx;
-    lua_State *L = wctx->L;
-    int cbref = wctx->cbref;
-    int internal_ctx_ref = wctx->internal_ctx_ref;
-    int user_ctx_ref = wctx->user_ctx_ref;
 
-    say_debug("Global watcher dispatch. L=%p cbref=%d internal_ctx_ref=%d user_ctx_ref=%d | type=%d state=%d path=%s", 
-             L, cbref, internal_ctx_ref, user_ctx_ref, type, state, path);
+    say_debug("Global watcher dispatch. cbref=%d internal_ctx_ref=%d user_ctx_ref=%d | type=%d state=%d path=%s", 
+             wctx->cbref, wctx->internal_ctx_ref, wctx->user_ctx_ref,
+             type, state, path);
 
-    /** push lua watcher_fn onto the stack. */
-    lua_rawgeti(L, LUA_REGISTRYINDEX, cbref);
-    /** push internal ctx onto the stack (it should be a zokeep object). */
-    lua_rawgeti(L, LUA_REGISTRYINDEX, internal_ctx_ref);
-    /** push type onto the stack. */
-    lua_pushinteger(L, type);
-    /** push state onto the stack. */
-    lua_pushinteger(L, state);
-    /** push path onto the stack. */
-    lua_pushstring(L, path);
-    /** push user ctx onto the stack. */
-    lua_rawgeti(L, LUA_REGISTRYINDEX, user_ctx_ref);
-    lua_call(L, 5, 0);
+    struct zk_watch_event event = {
+        .global_wctx = wctx,
+        .local_wctx = NULL,
+        .type = type,
+        .state = state,
+        .path = NULL,
+    };
+    wctx->refs++;
+    _zk_watch_queue_push(&wctx->handle->watch_queue, &event, path);
 }
 
 void
@@ -105,38 +329,31 @@ local_watcher_dispatch(zhandle_t *zh,
 {
     (void) zh;
     struct zk_local_wctx *wctx = (struct zk_local_wctx *) watcherctx;
-    lua_State *L = wctx->L;
-    int cbref = wctx->cbref;
-    int internal_ctx_ref = wctx->internal_ctx_ref;
-    int user_ctx_ref = wctx->user_ctx_ref;
 
-    /** push lua watcher_fn onto the stack. */
-    lua_rawgeti(L, LUA_REGISTRYINDEX, cbref);
-    /* push internal ctx onto the stack (it should be a zookeep object). */
-    lua_rawgeti(L, LUA_REGISTRYINDEX, internal_ctx_ref);
-    /** push type onto the stack. */
-    lua_pushinteger(L, type);
-    /** push state onto the stack. */
-    lua_pushinteger(L, state);
-    /** push path onto the stack. */
-    lua_pushstring(L, path);
-    /** push watcher context onto the stack. */
-    lua_rawgeti(L, LUA_REGISTRYINDEX, user_ctx_ref);
-    lua_call(L, 5, 0);
-    
-    _zk_local_wctx_free(L, wctx);
+    struct zk_watch_event event = {
+        .global_wctx = NULL,
+        .local_wctx = wctx,
+        .type = type,
+        .state = state,
+        .path = NULL,
+    };
+    _zk_watch_queue_push(&wctx->handle->watch_queue, &event, path);
 }
 
+/**
+ * Completion callbacks run inside zookeeper_process() in the process
+ * fiber. They never touch a Lua stack: the reply is copied into the
+ * request's zk_result and the waiting fiber builds the Lua values itself
+ * (see _zk_result_push()).
+ **/
 void
 _zk_void_cb(int rc,
             const void *data)
 {
     struct zk_data_result *cdata = (struct zk_data_result *) data;
-    lua_State *L = cdata->L;
     
-    lua_pushinteger(L, rc);
-    cdata->ret_count = 1;
-    fiber_cond_signal(cdata->cond);
+    cdata->result.kind = ZK_RESULT_VOID;
+    _zk_data_result_complete(cdata, rc);
 }
 
 void
@@ -147,18 +364,14 @@ _zk_data_cb(int rc,
             const void *data)
 {
     struct zk_data_result *cdata = (struct zk_data_result *) data;
-    lua_State *L = cdata->L;
+    struct zk_result *result = &cdata->result;
     
-    if (value == NULL) {
-        lua_pushnil(L);
-    } else {
-        lua_pushlstring(L, value, value_len);
+    result->kind = ZK_RESULT_DATA;
+    _zk_result_set_stat(result, stat);
+    if (_zk_result_set_value(result, value, value_len) != 0) {
+        rc = ZSYSTEMERROR;
     }
-    _zk_build_stat(L, stat);
-    lua_pushinteger(L, rc);
-    
-    cdata->ret_count = 3;
-    fiber_cond_signal(cdata->cond);
+    _zk_data_result_complete(cdata, rc);
 }
 
 void
@@ -167,14 +380,10 @@ _zk_stat_cb(int rc,
             const void *data)
 {
     struct zk_data_result *cdata = (struct zk_data_result *) data;
-    lua_State *L = cdata->L;
     
-    lua_pushboolean(L, stat != NULL);
-    _zk_build_stat(L, stat);
-    lua_pushinteger(L, rc);
-    
-    cdata->ret_count = 3;
-    fiber_cond_signal(cdata->cond);
+    cdata->result.kind = ZK_RESULT_STAT;
+    _zk_result_set_stat(&cdata->result, stat);
+    _zk_data_result_complete(cdata, rc);
 }
 
 void
@@ -183,13 +392,14 @@ _zk_string_cb(int rc,
               const void *data)
 {
     struct zk_data_result *cdata = (struct zk_data_result *) data;
-    lua_State *L = cdata->L;
-    
-    lua_pushstring(L, value);
-    lua_pushinteger(L, rc);
+    struct zk_result *result = &cdata->result;
     
-    cdata->ret_count = 2;
-    fiber_cond_signal(cdata->cond);
+    result->kind = ZK_RESULT_STRING;
+    if (_zk_result_set_value(result, value,
+                             value != NULL ? (int) strlen(value) : -1) != 0) {
+        rc = ZSYSTEMERROR;
+    }
+    _zk_data_result_complete(cdata, rc);
 }
 
 void
@@ -198,13 +408,13 @@ _zk_strings_cb(int rc,
                const void *data)
 {
     struct zk_data_result *cdata = (struct zk_data_result *) data;
-    lua_State *L = cdata->L;
-    
-    _zk_build_string_vector(L, strings);
-    lua_pushinteger(L, rc);
+    struct zk_result *result = &cdata->result;
     
-    cdata->ret_count = 2;
-    fiber_cond_signal(cdata->cond);
+    result->kind = ZK_RESULT_STRINGS;
+    if (_zk_result_set_strings(result, strings) != 0) {
+        rc = ZSYSTEMERROR;
+    }
+    _zk_data_result_complete(cdata, rc);
 }
 
 void
@@ -214,14 +424,14 @@ _zk_strings_stat_cb(int rc,
                     const void *data)
 {
     struct zk_data_result *cdata = (struct zk_data_result *) data;
-    lua_State *L = cdata->L;
+    struct zk_result *result = &cdata->result;
     
-    _zk_build_string_vector(L, strings);
-    _zk_build_stat(L, stat);
-    lua_pushinteger(L, rc);
-    
-    cdata->ret_count = 3;
-    fiber_cond_signal(cdata->cond);
+    result->kind = ZK_RESULT_STRINGS_STAT;
+    _zk_result_set_stat(result, stat);
+    if (_zk_result_set_strings(result, strings) != 0) {
+        rc = ZSYSTEMERROR;
+    }
+    _zk_data_result_complete(cdata, rc);
 }
 
 void
@@ -231,67 +441,252 @@ _zk_acl_cb(int rc,
            const void *data)
 {
     struct zk_data_result *cdata = (struct zk_data_result *) data;
-    lua_State *L = cdata->L;
+    struct zk_result *result = &cdata->result;
     
-    _zk_copy_acl_list(L, acl);
-    _zk_build_stat(L, stat);
-    lua_pushinteger(L, rc);
+    result->kind = ZK_RESULT_ACL;
+    _zk_result_set_stat(result, stat);
+    if (_zk_result_set_acl(result, acl) != 0) {
+        rc = ZSYSTEMERROR;
+    }
+    _zk_data_result_complete(cdata, rc);
+}
+
+void
+_zk_multi_cb(int rc,
+             const void *data)
+{
+    struct zk_data_result *cdata = (struct zk_data_result *) data;
     
-    cdata->ret_count = 3;
-    fiber_cond_signal(cdata->cond);
+    /* per-op results stay in cdata->multi until they are pushed */
+    cdata->result.kind = ZK_RESULT_MULTI;
+    _zk_data_result_complete(cdata, rc);
 }
 
+/***************** stat begin *****************/
+
+/**
+ * Stats are returned as a userdata holding the raw struct Stat; fields
+ * are converted on access only. zxids and the session id are 64-bit and
+ * come out as int64 cdata when a Lua number can not hold them exactly.
+ **/
 static int
 _zk_build_stat(lua_State *L,
                const struct Stat *stat)
 {
-    lua_newtable(L);
-    lua_pushstring(L, "czxid");
-    lua_pushnumber(L, stat ? stat->czxid : 0);
-    lua_settable(L, -3);
-    lua_pushstring(L, "mzxid");
-    lua_pushnumber(L, stat ? stat->mzxid : 0);
-    lua_settable(L, -3);
-    lua_pushstring(L, "ctime");
-    lua_pushnumber(L, stat ? stat->ctime : 0);
-    lua_settable(L, -3);
-    lua_pushstring(L, "mtime");
-    lua_pushnumber(L, stat ? stat->mtime : 0);
-    lua_settable(L, -3);
-    lua_pushstring(L, "version");
-    lua_pushnumber(L, stat ? stat->version : 0);
-    lua_settable(L, -3);
-    lua_pushstring(L, "cversion");
-    lua_pushnumber(L, stat ? stat->cversion : 0);
-    lua_settable(L, -3);
-    lua_pushstring(L, "aversion");
-    lua_pushnumber(L, stat ? stat->aversion : 0);
-    lua_settable(L, -3);
-    lua_pushstring(L, "ephemeralOwner");
-    lua_pushnumber(L, stat ? stat->ephemeralOwner : 0);
-    lua_settable(L, -3);
-    lua_pushstring(L, "dataLength");
-    lua_pushnumber(L, stat ? stat->dataLength : 0);
-    lua_settable(L, -3);
-    lua_pushstring(L, "numChildren");
-    lua_pushnumber(L, stat ? stat->numChildren : 0);
-    lua_settable(L, -3);
-    lua_pushstring(L, "pzxid");
-    lua_pushnumber(L, stat ? stat->pzxid : 0);
-    lua_settable(L, -3);
+    struct Stat *s = (struct Stat *) lua_newuserdata(L, sizeof(struct Stat));
+    luaL_getmetatable(L, ZOOKEEP_STAT_MT_NAME);
+    lua_setmetatable(L, -2);
+    
+    if (stat != NULL) {
+        *s = *stat;
+    } else {
+        memset(s, 0, sizeof(struct Stat));
+    }
+    return 1;
+}
+
+static const char *const zk_stat_fields[] = {
+    "czxid",
+    "mzxid",
+    "ctime",
+    "mtime",
+    "version",
+    "cversion",
+    "aversion",
+    "ephemeralOwner",
+    "dataLength",
+    "numChildren",
+    "pzxid",
+    NULL
+};
+
+/* push the field at index i of zk_stat_fields */
+static void
+_zk_push_stat_field(lua_State *L,
+                    const struct Stat *stat,
+                    int i)
+{
+    switch (i) {
+    case 0: luaL_pushint64(L, stat->czxid); break;
+    case 1: luaL_pushint64(L, stat->mzxid); break;
+    case 2: luaL_pushint64(L, stat->ctime); break;
+    case 3: luaL_pushint64(L, stat->mtime); break;
+    case 4: lua_pushinteger(L, stat->version); break;
+    case 5: lua_pushinteger(L, stat->cversion); break;
+    case 6: lua_pushinteger(L, stat->aversion); break;
+    case 7: luaL_pushint64(L, stat->ephemeralOwner); break;
+    case 8: lua_pushinteger(L, stat->dataLength); break;
+    case 9: lua_pushinteger(L, stat->numChildren); break;
+    case 10: luaL_pushint64(L, stat->pzxid); break;
+    default: lua_pushnil(L);
+    }
+}
+
+static int
+lua_zoo_stat_totable(lua_State *L)
+{
+    const struct Stat *stat = luaL_checkudata(L, 1, ZOOKEEP_STAT_MT_NAME);
+    
+    int i;
+    lua_createtable(L, 0, 11);
+    for (i = 0; zk_stat_fields[i] != NULL; ++i) {
+        _zk_push_stat_field(L, stat, i);
+        lua_setfield(L, -2, zk_stat_fields[i]);
+    }
+    return 1;
+}
+
+static int
+lua_zoo_stat_index(lua_State *L)
+{
+    const struct Stat *stat = luaL_checkudata(L, 1, ZOOKEEP_STAT_MT_NAME);
+    const char *key = luaL_checkstring(L, 2);
+    
+    int i;
+    for (i = 0; zk_stat_fields[i] != NULL; ++i) {
+        if (strcmp(key, zk_stat_fields[i]) == 0) {
+            _zk_push_stat_field(L, stat, i);
+            return 1;
+        }
+    }
+    if (strcmp(key, "totable") == 0) {
+        lua_pushcfunction(L, lua_zoo_stat_totable);
+        return 1;
+    }
+    lua_pushnil(L);
+    return 1;
+}
+
+static int
+lua_zoo_stat_eq(lua_State *L)
+{
+    const struct Stat *a = luaL_checkudata(L, 1, ZOOKEEP_STAT_MT_NAME);
+    const struct Stat *b = luaL_checkudata(L, 2, ZOOKEEP_STAT_MT_NAME);
+    
+    /* field by field: the padding of struct Stat is not copied */
+    lua_pushboolean(L, a->czxid == b->czxid
+                       && a->mzxid == b->mzxid
+                       && a->ctime == b->ctime
+                       && a->mtime == b->mtime
+                       && a->version == b->version
+                       && a->cversion == b->cversion
+                       && a->aversion == b->aversion
+                       && a->ephemeralOwner == b->ephemeralOwner
+                       && a->dataLength == b->dataLength
+                       && a->numChildren == b->numChildren
+                       && a->pzxid == b->pzxid);
+    return 1;
+}
+
+static int
+lua_zoo_stat_tostring(lua_State *L)
+{
+    const struct Stat *stat = luaL_checkudata(L, 1, ZOOKEEP_STAT_MT_NAME);
+    
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "ZookeeperStat [czxid=%lld, mzxid=%lld, pzxid=%lld, "
+             "version=%d, cversion=%d, dataLength=%d, numChildren=%d]",
+             (long long) stat->czxid, (long long) stat->mzxid,
+             (long long) stat->pzxid, stat->version, stat->cversion,
+             stat->dataLength, stat->numChildren);
+    lua_pushstring(L, buf);
+    return 1;
+}
+
+/***************** stat end *****************/
+
+/***************** buffer begin *****************/
+
+/**
+ * Values read with the buffer option are returned as a userdata
+ * referring to the reply memory: no Lua string is made, so a large
+ * value is neither copied again nor hashed. buffer:ptr() gives a
+ * `const char *` for msgpack.decode() and the like, valid as long as
+ * the buffer object is alive.
+ **/
+
+static uint32_t CTID_CONST_CHAR_PTR;
+
+static int
+_zk_build_buffer(lua_State *L,
+                 struct zk_buffer *buffer)
+{
+    struct zk_buffer **b = (struct zk_buffer **) lua_newuserdata(
+        L, sizeof(struct zk_buffer *));
+    buffer->refs++;
+    *b = buffer;
+    luaL_getmetatable(L, ZOOKEEP_BUFFER_MT_NAME);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static inline struct zk_buffer *
+_zk_check_buffer(lua_State *L, int index)
+{
+    struct zk_buffer **b = luaL_checkudata(L, index, ZOOKEEP_BUFFER_MT_NAME);
+    return *b;
+}
+
+static int
+lua_zoo_buffer_size(lua_State *L)
+{
+    lua_pushnumber(L, _zk_check_buffer(L, 1)->size);
     return 1;
 }
 
+static int
+lua_zoo_buffer_ptr(lua_State *L)
+{
+    struct zk_buffer *buffer = _zk_check_buffer(L, 1);
+    const char **ptr = (const char **) luaL_pushcdata(L, CTID_CONST_CHAR_PTR);
+    *ptr = buffer->data;
+    return 1;
+}
+
+/** a Lua string copy of the value **/
+static int
+lua_zoo_buffer_value(lua_State *L)
+{
+    struct zk_buffer *buffer = _zk_check_buffer(L, 1);
+    lua_pushlstring(L, buffer->data, buffer->size);
+    return 1;
+}
+
+static int
+lua_zoo_buffer_tostring(lua_State *L)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "ZookeeperBuffer [size=%zu]",
+             _zk_check_buffer(L, 1)->size);
+    lua_pushstring(L, buf);
+    return 1;
+}
+
+static int
+lua_zoo_buffer_gc(lua_State *L)
+{
+    struct zk_buffer **b = luaL_checkudata(L, 1, ZOOKEEP_BUFFER_MT_NAME);
+    _zk_buffer_unref(*b);
+    *b = NULL;
+    return 0;
+}
+
+/***************** buffer end *****************/
+
 static int
 _zk_build_string_vector(lua_State *L,
-                        const struct String_vector *sv)
+                        const char *buf,
+                        int count)
 {
     int i;
-    if (sv != NULL) {
-        lua_newtable(L);
-        for (i = 0; i < sv->count; ++i) {
-            lua_pushstring(L, sv->data[i]);
+    if (count >= 0) {
+        lua_createtable(L, count, 0);
+        for (i = 0; i < count; ++i) {
+            size_t len = strlen(buf);
+            lua_pushlstring(L, buf, len);
             lua_rawseti(L, -2, i + 1);
+            buf += len + 1;
         }
     } else {
         lua_pushnil(L);
@@ -511,783 +906,3445 @@ lua_zoo_acl_eq(lua_State *L)
 
 /***************** ACL end *****************/
 
-static struct zk_global_wctx *
-_zk_global_wctx_init(lua_State *L,
-                     int zhref,
-                     int cbref,
-                     int internal_ctx_ref,
-                     int user_ctx_ref)
-{
-    struct zk_global_wctx *wctx = (struct zk_global_wctx *)malloc(
-        sizeof(struct zk_global_wctx));
-    if (wctx == NULL) {
-        luaL_error(L, "zookeep: out of memory");
-    }
+/***************** pool begin *****************/
 
-    say_debug("Setting global watcher. L=%p cbref=%d internal_ctx_ref=%d user_ctx_ref=%d", 
-             L, cbref, internal_ctx_ref, user_ctx_ref);
-    wctx->L = L;
-    wctx->zhref = zhref;
-    wctx->cbref = cbref;
-    wctx->internal_ctx_ref= internal_ctx_ref;
-    wctx->user_ctx_ref = user_ctx_ref;
-    return wctx;
-}
+#define ZK_POOL_DEFAULT_SIZE 1024
+#define ZK_POOL_MAX_BUF_SIZE (64 * 1024)
+
+/**
+ * Completion and watcher contexts are recycled through free lists, so a
+ * request costs no malloc() or fiber_cond_new() in the steady state. The
+ * lists are shared by all handles: a future may outlive its handle. Lua
+ * only runs in the TX thread, so no locking is needed.
+ **/
+static struct zk_pool {
+    struct zk_data_result *results;
+    struct zk_local_wctx *wctxs;
+    int results_count;
+    int wctxs_count;
+    int max_size; /* per list */
+    
+    /* context allocations and reuses since start */
+    uint64_t allocs;
+    uint64_t reuses;
+} zk_pool = {
+    .max_size = ZK_POOL_DEFAULT_SIZE,
+};
 
 static void
-_zk_global_wctx_free(lua_State *L,
-                     struct zk_global_wctx *wctx)
+_zk_pool_trim(int max_size)
 {
-    if (wctx == NULL) {
-        return;
+    while (zk_pool.results_count > max_size) {
+        struct zk_data_result *cdata = zk_pool.results;
+        zk_pool.results = cdata->next;
+        zk_pool.results_count--;
+        free(cdata->result.buf);
+        fiber_cond_delete(cdata->cond);
+        free(cdata);
+    }
+    while (zk_pool.wctxs_count > max_size) {
+        struct zk_local_wctx *wctx = zk_pool.wctxs;
+        zk_pool.wctxs = wctx->next;
+        zk_pool.wctxs_count--;
+        free(wctx);
     }
-    luaL_unref(L, LUA_REGISTRYINDEX, wctx->zhref);
-    luaL_unref(L, LUA_REGISTRYINDEX, wctx->cbref);
-    luaL_unref(L, LUA_REGISTRYINDEX, wctx->internal_ctx_ref);
-    luaL_unref(L, LUA_REGISTRYINDEX, wctx->user_ctx_ref);
-    free(wctx);
-    return;
 }
 
-static struct zk_local_wctx *
-_zk_local_wctx_init(lua_State *L,
-                    int zhref,
-                    int cbref,
-                    int internal_ctx_ref,
-                    int user_ctx_ref)
+static int
+lua_zoo_set_pool_size(lua_State *L)
 {
-    struct zk_local_wctx *wctx =
-        (struct zk_local_wctx *) malloc(sizeof(struct zk_local_wctx));
-    if (wctx == NULL) {
-        luaL_error(L, "zookeep: out of memory");
+    int max_size = luaL_checkint(L, 1);
+    if (max_size < 0) {
+        return luaL_error(L, "pool size must not be negative");
     }
-    wctx->L = L;
-    wctx->zhref = zhref;
-    wctx->cbref = cbref;
-    wctx->internal_ctx_ref = internal_ctx_ref;
-    wctx->user_ctx_ref = user_ctx_ref;
-    return wctx;
+    zk_pool.max_size = max_size;
+    _zk_pool_trim(max_size);
+    return 0;
 }
 
-static void
-_zk_local_wctx_free(lua_State *L,
-                    struct zk_local_wctx *wctx)
+static int
+lua_zoo_pool_stats(lua_State *L)
 {
-    if (wctx == NULL) {
-        return;
+    lua_newtable(L);
+    lua_pushnumber(L, zk_pool.allocs);
+    lua_setfield(L, -2, "allocs");
+    lua_pushnumber(L, zk_pool.reuses);
+    lua_setfield(L, -2, "reuses");
+    lua_pushinteger(L, zk_pool.results_count);
+    lua_setfield(L, -2, "free_results");
+    lua_pushinteger(L, zk_pool.wctxs_count);
+    lua_setfield(L, -2, "free_watchers");
+    lua_pushinteger(L, zk_pool.max_size);
+    lua_setfield(L, -2, "max_size");
+    return 1;
+}
+
+/***************** pool end *****************/
+
+/***************** stats begin *****************/
+
+static const char *zk_op_names[ZK_OP_COUNT] = {
+    [ZK_OP_CREATE] = "create",
+    [ZK_OP_DELETE] = "delete",
+    [ZK_OP_EXISTS] = "exists",
+    [ZK_OP_WEXISTS] = "wexists",
+    [ZK_OP_GET] = "get",
+    [ZK_OP_WGET] = "wget",
+    [ZK_OP_SET] = "set",
+    [ZK_OP_GET_CHILDREN] = "get_children",
+    [ZK_OP_WGET_CHILDREN] = "wget_children",
+    [ZK_OP_GET_CHILDREN2] = "get_children2",
+    [ZK_OP_WGET_CHILDREN2] = "wget_children2",
+    [ZK_OP_SYNC] = "sync",
+    [ZK_OP_GET_ACL] = "get_acl",
+    [ZK_OP_SET_ACL] = "set_acl",
+    [ZK_OP_MULTI] = "multi",
+    [ZK_OP_ADD_AUTH] = "add_auth",
+};
+
+/** the state counted in state_time[index]; these are not constants **/
+static int
+_zk_stats_state(int index)
+{
+    switch (index) {
+        case 0:
+            return ZOO_EXPIRED_SESSION_STATE;
+        case 1:
+            return ZOO_AUTH_FAILED_STATE;
+        case 2:
+            return ZOO_CONNECTING_STATE;
+        case 3:
+            return ZOO_ASSOCIATING_STATE;
+        case 4:
+            return ZOO_CONNECTED_STATE;
+        case 5:
+            return ZOO_READONLY_STATE;
+        default:
+            return ZOO_NOTCONNECTED_STATE;
     }
-    luaL_unref(L, LUA_REGISTRYINDEX, wctx->zhref);
-    luaL_unref(L, LUA_REGISTRYINDEX, wctx->cbref);
-    luaL_unref(L, LUA_REGISTRYINDEX, wctx->internal_ctx_ref);
-    luaL_unref(L, LUA_REGISTRYINDEX, wctx->user_ctx_ref);
-    free(wctx);
-    return;
 }
 
-/**
- * initialize C clientid_t struct from lua table.
- **/
-static clientid_t *
-_zk_clientid_init(lua_State *L,
-                  int index)
+static int
+_zk_stats_rc_index(int rc)
 {
-    size_t passwd_len = 0;
-    const char *clientid_passwd = NULL;
-    clientid_t *clientid = NULL;
-    clientid = (clientid_t *) malloc(sizeof(clientid_t));
-    if (clientid == NULL) {
-        luaL_error(L, "zookeep: out of memory");
+    if (rc <= 0 && rc > -16) {
+        return -rc;
+    }
+    if (rc <= -100 && rc > -100 - (ZK_STATS_RC_COUNT - 16)) {
+        return 16 - 100 - rc;
     }
+    return -1;
+}
 
-    luaL_checktype(L, index, LUA_TTABLE);
-    lua_getfield(L, index, "client_id");
-    clientid->client_id =  luaL_checkint(L, -1);
-    lua_pop(L, 1);
-    
-    lua_getfield(L, index, "passwd");
-    clientid_passwd = luaL_checklstring(L, -1, &passwd_len);
-    lua_pop(L, 1);
-    
-    memset(clientid->passwd, 0, 16);
-    memcpy(clientid->passwd, clientid_passwd, passwd_len);
+static int
+_zk_stats_rc_code(int index)
+{
+    if (index < 16) {
+        return -index;
+    }
+    return 16 - 100 - index;
+}
 
-    return clientid;
+static int
+_zk_latency_bucket(uint64_t us)
+{
+    if (us < ZK_LATENCY_LINEAR) {
+        return (int) us;
+    }
+    if (us >= (1ULL << ZK_LATENCY_MAX_BITS)) {
+        return ZK_LATENCY_BUCKETS - 1;
+    }
+    int exp = 63 - __builtin_clzll(us);
+    int sub = (int) (us >> (exp - ZK_LATENCY_SUB_BITS))
+              & ((1 << ZK_LATENCY_SUB_BITS) - 1);
+    return ZK_LATENCY_LINEAR
+           + (exp - ZK_LATENCY_SUB_BITS - 1) * (1 << ZK_LATENCY_SUB_BITS)
+           + sub;
 }
 
-static void
-_zk_clientid_free(clientid_t **clientid)
+/** the smallest latency (in us) that does not fit into bucket **/
+static uint64_t
+_zk_latency_bucket_end(int bucket)
 {
-    if (*clientid != NULL) {
-        free(*clientid);
-        *clientid = NULL;
+    if (bucket + 1 < ZK_LATENCY_LINEAR) {
+        return bucket + 1;
     }
+    int offset = bucket + 1 - ZK_LATENCY_LINEAR;
+    int exp = offset / (1 << ZK_LATENCY_SUB_BITS) + ZK_LATENCY_SUB_BITS + 1;
+    int sub = offset % (1 << ZK_LATENCY_SUB_BITS);
+    return ((uint64_t) (1 << ZK_LATENCY_SUB_BITS) + sub)
+           << (exp - ZK_LATENCY_SUB_BITS);
 }
 
-static int
-_zoo_handle_reinit(struct lua_zoo_handle *handle) 
+static void
+_zk_stats_set_state(struct zk_handle_stats *stats,
+                    int state)
 {
-    if (handle == NULL) {
-        return 0;
+    double now = clock_monotonic();
+    int i;
+    for (i = 0; i < ZK_STATS_STATE_COUNT; ++i) {
+        if (_zk_stats_state(i) == stats->state) {
+            stats->state_time[i] += now - stats->state_since;
+            break;
+        }
+    }
+    /* a fresh handle is in state 0 until it starts connecting */
+    if (state == 0) {
+        state = ZOO_NOTCONNECTED_STATE;
     }
     
-    if (handle->zh != NULL) {
-        zookeeper_close(handle->zh);
-        handle->zh = NULL;
+    if (stats->state == ZOO_CONNECTED_STATE && state != ZOO_CONNECTED_STATE) {
+        stats->disconnected_since = now;
+    } else if (state == ZOO_CONNECTED_STATE && stats->disconnected_since > 0) {
+        double outage = now - stats->disconnected_since;
+        stats->outages++;
+        stats->outage_time += outage;
+        stats->outage_last = outage;
+        if (outage > stats->outage_max) {
+            stats->outage_max = outage;
+        }
+        stats->disconnected_since = 0;
     }
+    stats->state = state;
+    stats->state_since = now;
+}
 
-    handle->zh = zookeeper_init(handle->host, /* host */
-                                NULL, /* watcher */
-                                handle->recv_timeout, /* recv_timeout */
-                                handle->client_id, /* clientid */
-                                NULL, /* context */
-                                handle->flags /* flags */);
-    handle->prev_state = ZOO_NOTCONNECTED_STATE;
-    if (handle->zh == NULL) {
-        return errno;
+static void
+_zk_stats_push_latency(lua_State *L,
+                       const struct zk_op_stats *op)
+{
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    static const char *quantile_names[] = {"p50", "p90", "p99", "p999"};
+    
+    lua_createtable(L, 0, 8);
+    lua_pushnumber(L, op->completed);
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, op->latency_sum / 1e6);
+    lua_setfield(L, -2, "sum");
+    lua_pushnumber(L, op->latency_max / 1e6);
+    lua_setfield(L, -2, "max");
+    
+    /* upper bound of the bucket holding the quantile */
+    int q = 0;
+    int bucket = 0;
+    uint64_t seen = 0;
+    for (q = 0; q < 4; ++q) {
+        uint64_t rank = (uint64_t) (quantiles[q] * op->completed + 0.5);
+        if (rank == 0) {
+            rank = 1;
+        }
+        while (bucket < ZK_LATENCY_BUCKETS - 1
+               && seen + op->latency[bucket] < rank) {
+            seen += op->latency[bucket];
+            bucket++;
+        }
+        uint64_t us = _zk_latency_bucket_end(bucket) - 1;
+        if (us > op->latency_max) {
+            us = op->latency_max;
+        }
+        lua_pushnumber(L, op->completed > 0 ? us / 1e6 : 0);
+        lua_setfield(L, -2, quantile_names[q]);
     }
-
-    if (handle->global_wctx != NULL) {
-        zoo_set_watcher(handle->zh, watcher_dispatch);
-        zoo_set_context(handle->zh, (void *) handle->global_wctx);
+    
+    /* cumulative counts at every power of two microseconds */
+    lua_createtable(L, ZK_LATENCY_MAX_BITS, 0);
+    int k;
+    seen = 0;
+    bucket = 0;
+    for (k = 0; k < ZK_LATENCY_MAX_BITS; ++k) {
+        uint64_t le = 1ULL << k;
+        while (bucket < ZK_LATENCY_BUCKETS
+               && _zk_latency_bucket_end(bucket) <= le) {
+            seen += op->latency[bucket];
+            bucket++;
+        }
+        lua_createtable(L, 0, 2);
+        lua_pushnumber(L, le / 1e6);
+        lua_setfield(L, -2, "le");
+        lua_pushnumber(L, seen);
+        lua_setfield(L, -2, "count");
+        lua_rawseti(L, -2, k + 1);
     }
-    return 0;
+    lua_setfield(L, -2, "buckets");
 }
 
 /**
- * initialize a zookeeper handle.
+ * counters of a handle. Only request types used at least once are listed;
+ * result codes and states are keyed by their numeric values.
  **/
 static int
-lua_zoo_init(lua_State *L)
+lua_zoo_stats(lua_State *L)
 {
-    int top = lua_gettop(L);
-    const char *host = NULL;
-    size_t host_len = 0;
-    int recv_timeout = 0;
-    double reconnect_timeout = 1;
-    clientid_t *clientid = NULL;
-    int flags = 0;
-    int err;
-
-    struct lua_zoo_handle *handle = (struct lua_zoo_handle *) lua_newuserdata(
-        L, sizeof(struct lua_zoo_handle));
-        
-    luaL_getmetatable(L, ZOOKEEP_MT_NAME);
-    lua_setmetatable(L, -2);
-
-    host = luaL_checklstring(L, 1, &host_len);
-    recv_timeout = luaL_checkint(L, 2);
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle(L, 1);
+    const struct zk_handle_stats *stats = &handle->stats;
     
-    if (top >= 3 && !lua_isnil(L, 3)) {
-        luaL_checktype(L, 3, LUA_TTABLE);
-        clientid = _zk_clientid_init(L, 3);
-    }
+    lua_createtable(L, 0, 3);
     
-    if (top >= 4 && !lua_isnil(L, 4)) {
-        flags = luaL_checkint(L, 4);
+    lua_newtable(L);
+    int i;
+    for (i = 0; i < ZK_OP_COUNT; ++i) {
+        const struct zk_op_stats *op = &stats->ops[i];
+        if (op->issued == 0) {
+            continue;
+        }
+        lua_createtable(L, 0, 5);
+        lua_pushnumber(L, op->issued);
+        lua_setfield(L, -2, "issued");
+        lua_pushnumber(L, op->completed);
+        lua_setfield(L, -2, "completed");
+        lua_pushnumber(L, op->issued - op->completed);
+        lua_setfield(L, -2, "inflight");
+        
+        lua_newtable(L);
+        int j;
+        for (j = 0; j < ZK_STATS_RC_COUNT; ++j) {
+            if (op->rcs[j] > 0) {
+                lua_pushnumber(L, op->rcs[j]);
+                lua_rawseti(L, -2, _zk_stats_rc_code(j));
+            }
+        }
+        lua_setfield(L, -2, "rcs");
+        
+        _zk_stats_push_latency(L, op);
+        lua_setfield(L, -2, "latency");
+        lua_setfield(L, -2, zk_op_names[i]);
     }
+    lua_setfield(L, -2, "ops");
     
-    if (top >= 5 && !lua_isnil(L, 5)) {
-        reconnect_timeout = luaL_checknumber(L, 5);
-    }
+    lua_pushnumber(L, stats->reconnects);
+    lua_setfield(L, -2, "reconnects");
+    lua_pushnumber(L, stats->reconnect_attempts);
+    lua_setfield(L, -2, "reconnect_attempts");
+    lua_pushnumber(L, stats->reconnect_wait);
+    lua_setfield(L, -2, "reconnect_wait");
     
-    zoo_set_log_stream(stdout);
-    handle->zh = NULL;
-    handle->global_wctx = NULL;
-    handle->connected_cond = NULL;
-    handle->reconnect_timeout = reconnect_timeout;
-    handle->client_id = clientid;
-    handle->flags = flags;
-    handle->recv_timeout = recv_timeout;
-    handle->host = strdup(host);
-
-    err = _zoo_handle_reinit(handle);
-    if (err != 0) {
-        return luaL_error(L, strerror(err));
+    double now = clock_monotonic();
+    /* the current outage is counted as it goes */
+    double current = stats->disconnected_since > 0
+                     ? now - stats->disconnected_since : 0;
+    lua_createtable(L, 0, 5);
+    lua_pushnumber(L, stats->outages);
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, stats->outage_time + current);
+    lua_setfield(L, -2, "time");
+    lua_pushnumber(L, stats->outage_last);
+    lua_setfield(L, -2, "last");
+    lua_pushnumber(L, current > stats->outage_max
+                      ? current : stats->outage_max);
+    lua_setfield(L, -2, "max");
+    lua_pushnumber(L, current);
+    lua_setfield(L, -2, "current");
+    lua_setfield(L, -2, "outages");
+    
+    lua_newtable(L);
+    for (i = 0; i < ZK_STATS_STATE_COUNT; ++i) {
+        double seconds = stats->state_time[i];
+        if (_zk_stats_state(i) == stats->state) {
+            seconds += now - stats->state_since;
+        }
+        lua_pushnumber(L, seconds);
+        lua_rawseti(L, -2, _zk_stats_state(i));
     }
+    lua_setfield(L, -2, "state_time");
     return 1;
 }
 
-static int
-lua_zoo_close(lua_State *L)
+/***************** stats end *****************/
+
+/***************** trace begin *****************/
+
+/**
+ * Ring of the most recently completed requests. It is empty and costs a
+ * single branch per request until zookeeper.set_trace_size() enables it.
+ * Paths are stored as hashes only, so enabling it on a busy instance does
+ * not copy any strings.
+ **/
+static struct zk_trace {
+    struct zk_trace_event *events;
+    int capacity; /* 0 if tracing is disabled */
+    int head; /* next slot to write */
+    int count;
+    uint64_t total; /* events recorded since enabled */
+} zk_trace;
+
+/** 32-bit FNV-1a **/
+static uint32_t
+_zk_trace_hash(const char *path)
 {
-    int ret = 0;
-    struct lua_zoo_handle *handle = luaL_checkudata(L, 1, ZOOKEEP_MT_NAME);
-    if (handle == NULL) {
+    uint32_t hash = 2166136261u;
+    if (path == NULL) {
         return 0;
     }
-    
-    if (handle->zh != NULL) {
-        ret = zookeeper_close(handle->zh);
-        handle->zh = NULL;
+    for (; *path != '\0'; ++path) {
+        hash ^= (unsigned char) *path;
+        hash *= 16777619u;
     }
-    
-    if (handle->global_wctx != NULL) {
-        _zk_global_wctx_free(L, handle->global_wctx);
-        handle->global_wctx = NULL;
+    return hash;
+}
+
+static void
+_zk_trace_record(enum zk_op op,
+                 uint32_t path_hash,
+                 double latency,
+                 int rc)
+{
+    /* tracing may have been disabled while the request was in flight */
+    if (zk_trace.capacity == 0) {
+        return;
     }
     
-    if (handle->connected_cond != NULL) {
-        fiber_cond_delete(handle->connected_cond);
-        handle->connected_cond = NULL;
+    struct zk_trace_event *event = &zk_trace.events[zk_trace.head];
+    event->op = op;
+    event->path_hash = path_hash;
+    event->latency = latency;
+    event->rc = rc;
+    
+    zk_trace.head = (zk_trace.head + 1) % zk_trace.capacity;
+    if (zk_trace.count < zk_trace.capacity) {
+        zk_trace.count++;
     }
+    zk_trace.total++;
+}
 
-    if (handle->client_id != NULL) {
-        _zk_clientid_free(&handle->client_id);
+static int
+lua_zoo_set_trace_size(lua_State *L)
+{
+    int capacity = luaL_checkint(L, 1);
+    if (capacity < 0) {
+        return luaL_error(L, "trace size must not be negative");
+    }
+    
+    struct zk_trace_event *events = NULL;
+    if (capacity > 0) {
+        events = (struct zk_trace_event *) calloc(
+            capacity, sizeof(struct zk_trace_event));
+        if (events == NULL) {
+            return luaL_error(L, "zookeep: out of memory");
+        }
     }
+    free(zk_trace.events);
+    zk_trace.events = events;
+    zk_trace.capacity = capacity;
+    zk_trace.head = 0;
+    zk_trace.count = 0;
+    zk_trace.total = 0;
+    return 0;
+}
 
-    if (handle->host != NULL) {
-        free(handle->host);
-        handle->host = NULL;
+/**
+ * returns the recorded events, oldest first, and the number of events
+ * recorded since tracing was enabled (including overwritten ones).
+ **/
+static int
+lua_zoo_trace_dump(lua_State *L)
+{
+    lua_createtable(L, zk_trace.count, 0);
+    int first = zk_trace.head - zk_trace.count;
+    if (first < 0) {
+        first += zk_trace.capacity;
     }
     
-    lua_pushinteger(L, ret);
-    return 1;
+    int i;
+    for (i = 0; i < zk_trace.count; ++i) {
+        const struct zk_trace_event *event =
+            &zk_trace.events[(first + i) % zk_trace.capacity];
+        lua_createtable(L, 0, 4);
+        lua_pushstring(L, zk_op_names[event->op]);
+        lua_setfield(L, -2, "op");
+        lua_pushnumber(L, event->path_hash);
+        lua_setfield(L, -2, "path_hash");
+        lua_pushnumber(L, event->latency);
+        lua_setfield(L, -2, "latency");
+        lua_pushinteger(L, event->rc);
+        lua_setfield(L, -2, "rc");
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_pushnumber(L, zk_trace.total);
+    return 2;
 }
 
+/***************** trace end *****************/
+
 /**
- * return clientid_t of the current connection.
+ * account a request about to be sent. Every request must be finished
+ * with _zk_op_end(), whether it fails to be sent or completes.
  **/
-static int
-lua_zoo_client_id(lua_State *L)
+static inline void
+_zk_op_begin(struct zk_data_result *cdata,
+             enum zk_op op,
+             const char *path)
 {
-    struct lua_zoo_handle *handle = _zk_check_zoo_handle(L, 1);
+    cdata->op = op;
+    cdata->start = clock_monotonic();
+    cdata->traced = zk_trace.capacity > 0;
+    if (cdata->traced) {
+        cdata->path_hash = _zk_trace_hash(path);
+    }
+    cdata->handle->stats.ops[op].issued++;
+}
+
+static void
+_zk_op_end(struct zk_data_result *cdata,
+           int rc)
+{
+    double latency = clock_monotonic() - cdata->start;
+    uint64_t us = latency > 0 ? (uint64_t) (latency * 1e6) : 0;
     
-    const clientid_t *clientid = zoo_client_id(handle->zh);
-    lua_newtable(L);
-    lua_pushstring(L, "client_id");
-    lua_pushnumber(L, clientid->client_id);
-    lua_settable(L, -3);
-    lua_pushstring(L, "passwd");
-    lua_pushstring(L, clientid->passwd);
-    lua_settable(L, -3);
-    return 1;
+    struct zk_op_stats *op = &cdata->handle->stats.ops[cdata->op];
+    op->completed++;
+    int rc_index = _zk_stats_rc_index(rc);
+    if (rc_index >= 0) {
+        op->rcs[rc_index]++;
+    }
+    op->latency_sum += us;
+    if (us > op->latency_max) {
+        op->latency_max = us;
+    }
+    op->latency[_zk_latency_bucket(us)]++;
+    
+    if (cdata->traced) {
+        _zk_trace_record(cdata->op, cdata->path_hash, latency, rc);
+    }
 }
 
-static int
-lua_zoo_process(lua_State *L)
+/***************** log begin *****************/
+
+#if ZOO_MAJOR_VERSION > 3 || (ZOO_MAJOR_VERSION == 3 && ZOO_MINOR_VERSION >= 5)
+#  define ZK_HAVE_LOG_CALLBACK 1
+#endif
+
+#define ZK_LOG_LINE_MAX 1024
+
+/**
+ * pass a message of the client library to the tarantool logger. Messages
+ * look like "<time>:<pid>(0x<tid>):ZOO_<LEVEL>@<func>@<line>: <text>",
+ * the level is taken from there. Long messages are truncated.
+ **/
+static void
+_zk_log_message(const char *message,
+                size_t len)
 {
-    struct lua_zoo_handle *handle = _zk_check_zoo_handle(L, 1);
+    char line[ZK_LOG_LINE_MAX];
     
-    int fd = -1;
-    int interest = 0;
-    int coio_events = 0;
-    int zoo_events = 0;
-    int rc = ZOK;
-    double timeout = 0;
-    struct timeval tv;
-    int state = 0;
-    int reconnect = 0;
-    int err = 0;
-        
-    while (true) {
-        fd = -1;
-        interest = 0;
-        coio_events = 0;
-        zoo_events = 0;
-        timeout = 0;
-        reconnect = 0;
-        err = 0;
+    while (len > 0 && (message[len - 1] == '\n' || message[len - 1] == '\r')) {
+        len--;
+    }
+    if (len == 0) {
+        return;
+    }
+    if (len >= sizeof(line)) {
+        len = sizeof(line) - 1;
+    }
+    memcpy(line, message, len);
+    line[len] = '\0';
+    
+    if (strstr(line, ":ZOO_ERROR@") != NULL) {
+        say_error("zookeeper: %s", line);
+    } else if (strstr(line, ":ZOO_WARN@") != NULL) {
+        say_warn("zookeeper: %s", line);
+    } else if (strstr(line, ":ZOO_INFO@") != NULL) {
+        say_info("zookeeper: %s", line);
+    } else {
+        say_debug("zookeeper: %s", line);
+    }
+}
 
-        if (handle->zh == NULL) {
-            reconnect = 1;
-        } else {
-            rc = zookeeper_interest(handle->zh, &fd, &interest, &tv);
-            say_info("zookeep: handle: %p; zookeeper_interest rc = %d", handle, rc);
-            if (rc != ZOK) {
-                say_crit(
-                    "zookeep: error while receiving zookeeper interest. rc = %d; fd = %d; state = %d",
-                    rc, fd, zoo_state(handle->zh));
-                break;
-            }
-            
-            if (fd != -1) {
-                if (interest & ZOOKEEPER_READ) {
-                    coio_events |= COIO_READ;
-                } else {
-                    coio_events &= ~COIO_READ;
-                }
-                if (interest & ZOOKEEPER_WRITE) {
-                    coio_events |= COIO_WRITE;
-                } else {
-                    coio_events &= ~COIO_WRITE;
-                }
-                
-                timeout = (double)(tv.tv_sec + (double) tv.tv_usec / 1000000.0);
-                coio_events = coio_wait(fd, coio_events, timeout);
-                
-                if (fiber_is_cancelled()) {
-                    break;
-                }
-                
-                if (coio_events == 0) {
-                    // timeout
-                    continue;
-                }
-                
-                zoo_events = 0;
-                if (coio_events & COIO_READ) {
-                    zoo_events |= ZOOKEEPER_READ;
-                }
-                if (coio_events & COIO_WRITE) {
-                    zoo_events |= ZOOKEEPER_WRITE;
-                }
-                rc = zookeeper_process(handle->zh, zoo_events);
-                
-                state = zoo_state(handle->zh);
-                if (state != handle->prev_state) {
-                    if (state == ZOO_CONNECTED_STATE
-                            && handle->connected_cond != NULL) {
-                        fiber_cond_broadcast(handle->connected_cond);
-                    }
-                    handle->prev_state = state;
-                }
-            } else {
-                reconnect = 1;
-            }
-        }
+#if defined(ZK_HAVE_LOG_CALLBACK)
 
-        if (reconnect) {
-            err = _zoo_handle_reinit(handle);
-            if (err != 0) {
-                say_error(
-                    "zookeep: recreate handle failed: %d/%s", err, strerror(err));
-            }
-            say_warn(
-                    "zookeep: reconnecting in %.3fs", handle->reconnect_timeout);
-            fiber_sleep(handle->reconnect_timeout);
-            continue;
+static void
+_zk_log_callback(const char *message)
+{
+    _zk_log_message(message, strlen(message));
+}
+
+static void
+_zk_log_init(void)
+{
+    /* handles get _zk_log_callback in zookeeper_init2() */
+}
+
+#elif defined(__GLIBC__)
+
+/**
+ * older clients only write to a FILE *: give them a line buffered stream
+ * whose every flushed line goes to _zk_log_message().
+ **/
+static ssize_t
+_zk_log_write(void *cookie,
+              const char *buf,
+              size_t size)
+{
+    (void) cookie;
+    size_t start = 0;
+    size_t i;
+    for (i = 0; i < size; ++i) {
+        if (buf[i] == '\n') {
+            _zk_log_message(buf + start, i - start);
+            start = i + 1;
         }
     }
-    say_debug("zookeep: finished processing");
-    return 0;
+    if (start < size) {
+        _zk_log_message(buf + start, size - start);
+    }
+    return size;
 }
 
-static int
-lua_zoo_state(lua_State *L)
+static void
+_zk_log_init(void)
 {
-    int ret = 0;
-    struct lua_zoo_handle *handle = _zk_check_zoo_handle(L, 1);
+    static FILE *stream = NULL;
+    if (stream != NULL) {
+        return;
+    }
     
-    ret = zoo_state(handle->zh);
-    lua_pushinteger(L, ret);
-    return 1;
+    cookie_io_functions_t io = {
+        .read = NULL,
+        .write = _zk_log_write,
+        .seek = NULL,
+        .close = NULL,
+    };
+    stream = fopencookie(NULL, "w", io);
+    if (stream == NULL) {
+        return;
+    }
+    setvbuf(stream, NULL, _IOLBF, ZK_LOG_LINE_MAX);
+    zoo_set_log_stream(stream);
 }
 
-static int
-lua_zoo_wait_connected(lua_State *L)
+#else
+
+static void
+_zk_log_init(void)
 {
-    struct lua_zoo_handle *handle = _zk_check_zoo_handle(L, 1);
-    
-    double timeout = -1;
-    if (!lua_isnil(L, 2)) {
-        timeout = luaL_checknumber(L, 2);
+    /* the client library keeps logging to stderr */
+}
+
+#endif
+
+/***************** log end *****************/
+
+static struct zk_global_wctx *
+_zk_global_wctx_init(lua_State *L,
+                     struct lua_zoo_handle *handle,
+                     int zhref,
+                     int cbref,
+                     int internal_ctx_ref,
+                     int user_ctx_ref)
+{
+    struct zk_global_wctx *wctx = (struct zk_global_wctx *)malloc(
+        sizeof(struct zk_global_wctx));
+    if (wctx == NULL) {
+        luaL_error(L, "zookeep: out of memory");
     }
-    
-    if (zoo_state(handle->zh) == ZOO_CONNECTED_STATE) {
-        return 0;
+
+    say_debug("Setting global watcher. cbref=%d internal_ctx_ref=%d user_ctx_ref=%d", 
+             cbref, internal_ctx_ref, user_ctx_ref);
+    wctx->handle = handle;
+    wctx->refs = 1;
+    wctx->zhref = zhref;
+    wctx->cbref = cbref;
+    wctx->internal_ctx_ref= internal_ctx_ref;
+    wctx->user_ctx_ref = user_ctx_ref;
+    return wctx;
+}
+
+/**
+ * drop a reference to the global watcher context; the context is freed
+ * once neither the handle nor any queued event refers to it.
+ **/
+static void
+_zk_global_wctx_unref(lua_State *L,
+                      struct zk_global_wctx *wctx)
+{
+    if (wctx == NULL) {
+        return;
     }
-    
-    if (handle->connected_cond == NULL) {
-        handle->connected_cond = fiber_cond_new();
+    if (--wctx->refs > 0) {
+        return;
     }
-    int ret;
-    if (timeout < 0) {
-        ret = fiber_cond_wait(handle->connected_cond);
-        if (ret == 0) {
-            // wakeup
-            return 0;
-        }
-        return luaL_error(L, "unexpected error");
+    luaL_unref(L, LUA_REGISTRYINDEX, wctx->zhref);
+    luaL_unref(L, LUA_REGISTRYINDEX, wctx->cbref);
+    luaL_unref(L, LUA_REGISTRYINDEX, wctx->internal_ctx_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, wctx->user_ctx_ref);
+    free(wctx);
+    return;
+}
+
+static struct zk_local_wctx *
+_zk_local_wctx_init(lua_State *L,
+                    struct lua_zoo_handle *handle,
+                    int zhref,
+                    int cbref,
+                    int internal_ctx_ref,
+                    int user_ctx_ref)
+{
+    struct zk_local_wctx *wctx = zk_pool.wctxs;
+    if (wctx != NULL) {
+        zk_pool.wctxs = wctx->next;
+        zk_pool.wctxs_count--;
+        zk_pool.reuses++;
     } else {
-        ret = fiber_cond_wait_timeout(handle->connected_cond, timeout);
-        if (ret == 0) {
-            // wakeup
-            return 0;
-        } else if (ret == -1) {
-            return luaL_error(L, "timeout");
+        wctx = (struct zk_local_wctx *) malloc(sizeof(struct zk_local_wctx));
+        if (wctx == NULL) {
+            luaL_error(L, "zookeep: out of memory");
         }
-        
-        return luaL_error(L, "unexpected error");
+        zk_pool.allocs++;
     }
+    wctx->next = NULL;
+    wctx->handle = handle;
+    wctx->zhref = zhref;
+    wctx->cbref = cbref;
+    wctx->internal_ctx_ref = internal_ctx_ref;
+    wctx->user_ctx_ref = user_ctx_ref;
+    return wctx;
 }
 
-static int
-lua_zookeep_set_watcher(lua_State *L)
+static void
+_zk_local_wctx_free(lua_State *L,
+                    struct zk_local_wctx *wctx)
 {
-    int top = lua_gettop(L);
-    struct zk_global_wctx *wctx;
-    int zhref = 0;
-    int cbref = 0;
-    int internal_ctx_ref = 0;
-    int user_ctx_ref = 0;
-    int has_user_ctx = 0;
-    
-    struct lua_zoo_handle *handle = _zk_check_zoo_handle(L, 1);
-    if (handle->global_wctx != NULL) {
-        _zk_global_wctx_free(L,handle->global_wctx);
-        handle->global_wctx = NULL;
-    }
-    if (top < 2 || lua_isnil(L, 2)) { /* lua watcher function */
-        /* remove watcher */
-        zoo_set_watcher(handle->zh, NULL);
-        zoo_set_context(handle->zh, NULL);
-        return 0;
-    }
-    luaL_checktype(L, 2, LUA_TFUNCTION);
-    luaL_checktype(L, 3, LUA_TTABLE);  /* internal zookeep context */
-    if (top > 3 && !lua_isnil(L, 4)) {
-        has_user_ctx = 1; /* user's context */
+    if (wctx == NULL) {
+        return;
     }
+    luaL_unref(L, LUA_REGISTRYINDEX, wctx->zhref);
+    luaL_unref(L, LUA_REGISTRYINDEX, wctx->cbref);
+    luaL_unref(L, LUA_REGISTRYINDEX, wctx->internal_ctx_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, wctx->user_ctx_ref);
     
-    lua_pushvalue(L, 1);
-    zhref = luaL_ref(L, LUA_REGISTRYINDEX);
-    
-    lua_pushvalue(L, 2);
-    cbref = luaL_ref(L, LUA_REGISTRYINDEX);
-    
-    lua_pushvalue(L, 3);
-    internal_ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    
-    if (has_user_ctx) {
-        lua_pushvalue(L, 4);
-        user_ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    if (zk_pool.wctxs_count < zk_pool.max_size) {
+        wctx->next = zk_pool.wctxs;
+        zk_pool.wctxs = wctx;
+        zk_pool.wctxs_count++;
+        return;
     }
-    
-    wctx = _zk_global_wctx_init(L, zhref, cbref,
-                                internal_ctx_ref, user_ctx_ref);
-    handle->global_wctx = wctx;
-    
-    zoo_set_watcher(handle->zh, watcher_dispatch);
-    zoo_set_context(handle->zh, (void *) wctx);
+    free(wctx);
+}
+
+/***************** watch queue begin *****************/
+
+#define ZK_WATCH_QUEUE_DEFAULT_SIZE 1024
+
+static int
+_zk_watch_queue_init(struct zk_watch_queue *queue,
+                     int capacity)
+{
+    queue->events = (struct zk_watch_event *) calloc(
+        capacity, sizeof(struct zk_watch_event));
+    if (queue->events == NULL) {
+        return -1;
+    }
+    queue->capacity = capacity;
+    queue->limit = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    queue->closed = false;
+    queue->not_empty = fiber_cond_new();
     return 0;
 }
 
+/** doubles the ring, moving the events to its start **/
 static int
-lua_zoo_set_log_level(lua_State *L)
+_zk_watch_queue_grow(struct zk_watch_queue *queue)
 {
-    int level = luaL_checkint(L, -1);
-    switch(level) {
-        case ZOO_LOG_LEVEL_ERROR:
-            zoo_set_debug_level(ZOO_LOG_LEVEL_ERROR);
-            break;
-        case ZOO_LOG_LEVEL_WARN:
-            zoo_set_debug_level(ZOO_LOG_LEVEL_WARN);
-            break;
-        case ZOO_LOG_LEVEL_INFO:
-            zoo_set_debug_level(ZOO_LOG_LEVEL_INFO);
-            break;
-        case ZOO_LOG_LEVEL_DEBUG:
-            zoo_set_debug_level(ZOO_LOG_LEVEL_DEBUG);
-            break;
-        default:
-            return luaL_error(L, "unsupported log level specified");
+    int capacity = queue->capacity * 2;
+    struct zk_watch_event *events = (struct zk_watch_event *) calloc(
+        capacity, sizeof(struct zk_watch_event));
+    if (events == NULL) {
+        return -1;
+    }
+    int i;
+    for (i = 0; i < queue->count; ++i) {
+        events[i] = queue->events[(queue->head + i) % queue->capacity];
     }
+    free(queue->events);
+    queue->events = events;
+    queue->capacity = capacity;
+    queue->head = 0;
     return 0;
 }
 
-static struct zk_data_result *
-_zk_data_result_init(lua_State *L)
+/**
+ * release the contexts an event holds. One-shot local watchers stay
+ * registered on session events, so their context survives those unless
+ * the session is gone for good.
+ **/
+static void
+_zk_watch_event_destroy(lua_State *L,
+                        struct zk_watch_event *event)
 {
-    struct zk_data_result *cdata = NULL;
-    cdata = (struct zk_data_result *) malloc(sizeof(struct zk_data_result));
-    if (cdata == NULL) {
-        luaL_error(L, "zookeep: out of memory");
-        return NULL;
+    free(event->path);
+    event->path = NULL;
+    
+    if (event->global_wctx != NULL) {
+        _zk_global_wctx_unref(L, event->global_wctx);
+    } else if (event->persistent_wctx != NULL) {
+        _zk_persistent_wctx_unref(L, event->persistent_wctx);
+    } else if (event->type != ZOO_SESSION_EVENT
+               || event->state == ZOO_EXPIRED_SESSION_STATE
+               || event->state == ZOO_AUTH_FAILED_STATE) {
+        _zk_local_wctx_free(L, event->local_wctx);
     }
-    cdata->L = L;
-    cdata->cond = fiber_cond_new();
-    return cdata;
 }
 
 static void
-_zk_data_result_free(struct zk_data_result *cdata)
+_zk_watch_queue_push(struct zk_watch_queue *queue,
+                     struct zk_watch_event *event,
+                     const char *path)
 {
-    if (cdata == NULL) {
+    /**
+     * called from inside zookeeper_process(): waiting here would stop
+     * the replies a worker in a sync request waits for, so grow instead
+     **/
+    if (!queue->closed && queue->count == queue->capacity) {
+        if (_zk_watch_queue_grow(queue) == 0) {
+            say_warn("zookeep: %d watch events queued, workers are behind",
+                     queue->count);
+        }
+    }
+    
+    if (queue->closed || queue->count == queue->capacity
+            || (event->path = strdup(path)) == NULL) {
+        say_warn("zookeep: dropping watch event type=%d state=%d path=%s",
+                 event->type, event->state, path);
+        _zk_watch_event_destroy(luaT_state(), event);
         return;
     }
     
-    fiber_cond_delete(cdata->cond);
-    free(cdata);
+    int tail = (queue->head + queue->count) % queue->capacity;
+    queue->events[tail] = *event;
+    queue->count++;
+    fiber_cond_signal(queue->not_empty);
+}
+
+static void
+_zk_watch_queue_close(lua_State *L,
+                      struct zk_watch_queue *queue)
+{
+    if (queue->closed || queue->events == NULL) {
+        return;
+    }
+    queue->closed = true;
+    
+    while (queue->count > 0) {
+        _zk_watch_event_destroy(L, &queue->events[queue->head]);
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+    }
+    free(queue->events);
+    queue->events = NULL;
+    
+    /* waiters notice the closed flag; the cond is deleted on gc */
+    fiber_cond_broadcast(queue->not_empty);
+}
+
+static void
+_zk_watch_event_call(lua_State *L,
+                     struct zk_watch_event *event)
+{
+    int cbref, internal_ctx_ref, user_ctx_ref;
+    if (event->global_wctx != NULL) {
+        cbref = event->global_wctx->cbref;
+        internal_ctx_ref = event->global_wctx->internal_ctx_ref;
+        user_ctx_ref = event->global_wctx->user_ctx_ref;
+    } else if (event->persistent_wctx != NULL) {
+        if (event->persistent_wctx->removed) {
+            return;
+        }
+        cbref = event->persistent_wctx->cbref;
+        internal_ctx_ref = event->persistent_wctx->internal_ctx_ref;
+        user_ctx_ref = event->persistent_wctx->user_ctx_ref;
+    } else {
+        cbref = event->local_wctx->cbref;
+        internal_ctx_ref = event->local_wctx->internal_ctx_ref;
+        user_ctx_ref = event->local_wctx->user_ctx_ref;
+    }
+    
+    /** push lua watcher_fn onto the stack. */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cbref);
+    /** push internal ctx onto the stack (it should be a zookeep object). */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, internal_ctx_ref);
+    /** push type onto the stack. */
+    lua_pushinteger(L, event->type);
+    /** push state onto the stack. */
+    lua_pushinteger(L, event->state);
+    /** push path onto the stack. */
+    lua_pushstring(L, event->path);
+    /** push user ctx onto the stack. */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, user_ctx_ref);
+    if (lua_pcall(L, 5, 0, 0) != 0) {
+        say_error("zookeep: watcher failed: %s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+/**
+ * watch dispatch loop: runs queued watcher callbacks until the fiber is
+ * cancelled or the handle is closed.
+ **/
+static int
+lua_zoo_dispatch(lua_State *L)
+{
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle(L, 1);
+    struct zk_watch_queue *queue = &handle->watch_queue;
+    
+    while (!fiber_is_cancelled() && !queue->closed) {
+        if (queue->count == 0) {
+            fiber_cond_wait(queue->not_empty);
+            continue;
+        }
+        
+        struct zk_watch_event event = queue->events[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        
+        _zk_watch_event_call(L, &event);
+        _zk_watch_event_destroy(L, &event);
+    }
+    say_debug("zookeep: finished dispatching");
+    return 0;
+}
+
+/***************** watch queue end *****************/
+
+/***************** persistent watch begin *****************/
+
+/**
+ * ZooKeeper 3.6 servers have persistent watches (addWatch), but the C
+ * client has no binding for them. They are emulated: every one-shot
+ * watch a persistent watch owns is set again by the watcher itself, in
+ * the process fiber, before the event is queued.
+ *
+ * A persistent watch sets data and child watches on its path. A
+ * recursive one also sets them on every node of the subtree, finding
+ * new nodes from child events; those are turned into CREATED events for
+ * the new nodes, child events themselves are not delivered, like on the
+ * server.
+ **/
+
+#if ZOO_MAJOR_VERSION > 3 || (ZOO_MAJOR_VERSION == 3 && ZOO_MINOR_VERSION >= 5)
+#  define ZK_HAVE_REMOVE_WATCHES 1
+#endif
+
+#define ZK_PATH_SET_MIN_CAPACITY 16
+
+#define ZK_ARM_DATA 0x1
+#define ZK_ARM_CHILDREN 0x2
+
+/** a pending request setting watches on a path **/
+struct zk_arm_ctx {
+    struct zk_persistent_wctx *wctx;
+    bool notify; /* report nodes found under path as created */
+    char path[];
+};
+
+static struct zk_watched_path **
+_zk_path_set_lookup(struct zk_path_set *set,
+                    const char *path)
+{
+    uint32_t bucket = _zk_trace_hash(path) & (set->capacity - 1);
+    struct zk_watched_path **item = &set->buckets[bucket];
+    while (*item != NULL && strcmp((*item)->path, path) != 0) {
+        item = &(*item)->next;
+    }
+    return item;
+}
+
+static int
+_zk_path_set_grow(struct zk_path_set *set)
+{
+    int capacity = set->capacity == 0
+                   ? ZK_PATH_SET_MIN_CAPACITY : set->capacity * 2;
+    struct zk_watched_path **buckets = (struct zk_watched_path **) calloc(
+        capacity, sizeof(struct zk_watched_path *));
+    if (buckets == NULL) {
+        return -1;
+    }
+    int i;
+    for (i = 0; i < set->capacity; ++i) {
+        struct zk_watched_path *item = set->buckets[i];
+        while (item != NULL) {
+            struct zk_watched_path *next = item->next;
+            uint32_t bucket = _zk_trace_hash(item->path) & (capacity - 1);
+            item->next = buckets[bucket];
+            buckets[bucket] = item;
+            item = next;
+        }
+    }
+    free(set->buckets);
+    set->buckets = buckets;
+    set->capacity = capacity;
+    return 0;
+}
+
+/** 1 if path was added, 0 if it is there already, -1 on no memory **/
+static int
+_zk_path_set_add(struct zk_path_set *set,
+                 const char *path)
+{
+    if (set->count >= set->capacity && _zk_path_set_grow(set) != 0) {
+        return -1;
+    }
+    struct zk_watched_path **item = _zk_path_set_lookup(set, path);
+    if (*item != NULL) {
+        return 0;
+    }
+    struct zk_watched_path *added = (struct zk_watched_path *) malloc(
+        sizeof(struct zk_watched_path));
+    if (added == NULL || (added->path = strdup(path)) == NULL) {
+        free(added);
+        return -1;
+    }
+    added->next = NULL;
+    *item = added;
+    set->count++;
+    return 1;
+}
+
+static void
+_zk_path_set_remove(struct zk_path_set *set,
+                    const char *path)
+{
+    if (set->count == 0) {
+        return;
+    }
+    struct zk_watched_path **item = _zk_path_set_lookup(set, path);
+    struct zk_watched_path *removed = *item;
+    if (removed == NULL) {
+        return;
+    }
+    *item = removed->next;
+    free(removed->path);
+    free(removed);
+    set->count--;
+}
+
+static void
+_zk_path_set_clear(struct zk_path_set *set)
+{
+    int i;
+    for (i = 0; i < set->capacity; ++i) {
+        while (set->buckets[i] != NULL) {
+            struct zk_watched_path *item = set->buckets[i];
+            set->buckets[i] = item->next;
+            free(item->path);
+            free(item);
+        }
+    }
+    set->count = 0;
+}
+
+static void
+_zk_path_set_free(struct zk_path_set *set)
+{
+    _zk_path_set_clear(set);
+    free(set->buckets);
+    set->buckets = NULL;
+    set->capacity = 0;
+}
+
+static void
+_zk_persistent_wctx_release_refs(lua_State *L,
+                                 struct zk_persistent_wctx *wctx)
+{
+    luaL_unref(L, LUA_REGISTRYINDEX, wctx->zhref);
+    luaL_unref(L, LUA_REGISTRYINDEX, wctx->cbref);
+    luaL_unref(L, LUA_REGISTRYINDEX, wctx->internal_ctx_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, wctx->user_ctx_ref);
+    wctx->zhref = LUA_NOREF;
+    wctx->cbref = LUA_NOREF;
+    wctx->internal_ctx_ref = LUA_NOREF;
+    wctx->user_ctx_ref = LUA_NOREF;
+}
+
+static void
+_zk_persistent_wctx_unref(lua_State *L,
+                          struct zk_persistent_wctx *wctx)
+{
+    if (--wctx->refs > 0) {
+        return;
+    }
+    _zk_persistent_wctx_release_refs(L, wctx);
+    _zk_path_set_free(&wctx->armed);
+    free(wctx->path);
+    free(wctx);
+}
+
+void
+persistent_watcher_dispatch(zhandle_t *zh,
+                            int type,
+                            int state,
+                            const char *path,
+                            void *watcherctx);
+
+static void
+_zk_persistent_exists_cb(int rc,
+                         const struct Stat *stat,
+                         const void *data);
+
+static void
+_zk_persistent_children_cb(int rc,
+                           const struct String_vector *strings,
+                           const void *data);
+
+static struct zk_arm_ctx *
+_zk_arm_ctx_new(struct zk_persistent_wctx *wctx,
+                const char *path,
+                bool notify)
+{
+    size_t len = strlen(path);
+    struct zk_arm_ctx *arm = (struct zk_arm_ctx *) malloc(
+        sizeof(struct zk_arm_ctx) + len + 1);
+    if (arm == NULL) {
+        return NULL;
+    }
+    memcpy(arm->path, path, len + 1);
+    arm->notify = notify;
+    arm->wctx = wctx;
+    wctx->refs++;
+    return arm;
+}
+
+static void
+_zk_arm_ctx_free(struct zk_arm_ctx *arm)
+{
+    _zk_persistent_wctx_unref(luaT_state(), arm->wctx);
+    free(arm);
+}
+
+/** send the requests setting the watches again on path **/
+static void
+_zk_persistent_arm(struct zk_persistent_wctx *wctx,
+                   const char *path,
+                   int what,
+                   bool notify)
+{
+    zhandle_t *zh = wctx->handle->zh;
+    if (wctx->removed || zh == NULL) {
+        return;
+    }
+    
+    int rc = ZOK;
+    struct zk_arm_ctx *arm = NULL;
+    if (what & ZK_ARM_DATA) {
+        arm = _zk_arm_ctx_new(wctx, path, notify);
+        rc = arm == NULL ? ZSYSTEMERROR
+                         : zoo_awexists(zh, path,
+                                        persistent_watcher_dispatch, wctx,
+                                        _zk_persistent_exists_cb, arm);
+        if (rc != ZOK && arm != NULL) {
+            _zk_arm_ctx_free(arm);
+        }
+    }
+    if (rc == ZOK && (what & ZK_ARM_CHILDREN)) {
+        arm = _zk_arm_ctx_new(wctx, path, notify);
+        rc = arm == NULL ? ZSYSTEMERROR
+                         : zoo_awget_children(zh, path,
+                                              persistent_watcher_dispatch,
+                                              wctx,
+                                              _zk_persistent_children_cb,
+                                              arm);
+        if (rc != ZOK && arm != NULL) {
+            _zk_arm_ctx_free(arm);
+        }
+    }
+    if (rc != ZOK) {
+        say_warn("zookeep: can not watch %s: %d", path, rc);
+        wctx->stale = true;
+    }
+}
+
+/** a failed request leaves path unwatched until the watches are reset **/
+static void
+_zk_persistent_arm_failed(struct zk_arm_ctx *arm,
+                          int rc)
+{
+    if (rc == ZCLOSING || arm->wctx->removed) {
+        return;
+    }
+    say_warn("zookeep: can not watch %s: %d", arm->path, rc);
+    arm->wctx->stale = true;
+}
+
+static void
+_zk_persistent_exists_cb(int rc,
+                         const struct Stat *stat,
+                         const void *data)
+{
+    (void) stat;
+    struct zk_arm_ctx *arm = (struct zk_arm_ctx *) data;
+    /* the watch is set on a missing node as well */
+    if (rc != ZOK && rc != ZNONODE) {
+        _zk_persistent_arm_failed(arm, rc);
+    }
+    _zk_arm_ctx_free(arm);
+}
+
+static void
+_zk_persistent_push_event(struct zk_persistent_wctx *wctx,
+                          int type,
+                          int state,
+                          const char *path)
+{
+    struct zk_watch_event event = {
+        .global_wctx = NULL,
+        .local_wctx = NULL,
+        .persistent_wctx = wctx,
+        .type = type,
+        .state = state,
+        .path = NULL,
+    };
+    wctx->refs++;
+    _zk_watch_queue_push(&wctx->handle->watch_queue, &event, path);
+}
+
+static void
+_zk_persistent_children_cb(int rc,
+                           const struct String_vector *strings,
+                           const void *data)
+{
+    struct zk_arm_ctx *arm = (struct zk_arm_ctx *) data;
+    struct zk_persistent_wctx *wctx = arm->wctx;
+    if (rc != ZOK) {
+        /* a missing node is watched by its data watch */
+        if (rc != ZNONODE) {
+            _zk_persistent_arm_failed(arm, rc);
+        }
+        _zk_arm_ctx_free(arm);
+        return;
+    }
+    if (wctx->mode != ZK_WATCH_PERSISTENT_RECURSIVE || wctx->removed) {
+        _zk_arm_ctx_free(arm);
+        return;
+    }
+    
+    /* watch the children not watched yet */
+    size_t parent_len = strlen(arm->path);
+    if (parent_len == 1) {
+        parent_len = 0; /* the root */
+    }
+    int i;
+    for (i = 0; i < strings->count; ++i) {
+        size_t len = parent_len + strlen(strings->data[i]) + 2;
+        char *path = (char *) malloc(len);
+        if (path == NULL) {
+            _zk_persistent_arm_failed(arm, ZSYSTEMERROR);
+            break;
+        }
+        snprintf(path, len, "%.*s/%s",
+                 (int) parent_len, arm->path, strings->data[i]);
+        
+        int added = _zk_path_set_add(&wctx->armed, path);
+        if (added < 0) {
+            _zk_persistent_arm_failed(arm, ZSYSTEMERROR);
+        } else if (added > 0) {
+            if (arm->notify) {
+                _zk_persistent_push_event(wctx, ZOO_CREATED_EVENT,
+                                          zoo_state(wctx->handle->zh), path);
+            }
+            _zk_persistent_arm(wctx, path, ZK_ARM_DATA | ZK_ARM_CHILDREN,
+                               arm->notify);
+        }
+        free(path);
+    }
+    _zk_arm_ctx_free(arm);
+}
+
+/**
+ * watcher of every watch a persistent watch sets. Runs inside
+ * zookeeper_process(); the fired watch is sent again before the event
+ * is queued, but it is only set once the server gets it: a change of
+ * the node's value within that round trip fires nothing, and a child
+ * created and deleted within it is never seen. Every event costs one
+ * request to set the watch again, every new node two.
+ **/
+void
+persistent_watcher_dispatch(zhandle_t *zh,
+                            int type,
+                            int state,
+                            const char *path,
+                            void *watcherctx)
+{
+    (void) zh;
+    struct zk_persistent_wctx *wctx = (struct zk_persistent_wctx *) watcherctx;
+    if (wctx->removed) {
+        return;
+    }
+    if (type == ZOO_SESSION_EVENT) {
+        _zk_persistent_push_event(wctx, type, state, path);
+        return;
+    }
+    
+    bool recursive = wctx->mode == ZK_WATCH_PERSISTENT_RECURSIVE;
+    bool root = strcmp(path, wctx->path) == 0;
+    if (type == ZOO_CHILD_EVENT) {
+        _zk_persistent_arm(wctx, path, ZK_ARM_CHILDREN, true);
+    } else if (type == ZOO_CHANGED_EVENT) {
+        _zk_persistent_arm(wctx, path, ZK_ARM_DATA, false);
+    } else if (type == ZOO_CREATED_EVENT) {
+        _zk_persistent_arm(wctx, path, ZK_ARM_DATA | ZK_ARM_CHILDREN, true);
+    } else if (type == ZOO_DELETED_EVENT) {
+        if (root) {
+            /* an exists watch on the missing node reports its creation */
+            _zk_persistent_arm(wctx, path, ZK_ARM_DATA, false);
+        } else {
+            /* the parent's child watch reports it if created again */
+            _zk_path_set_remove(&wctx->armed, path);
+        }
+    }
+    
+    if (recursive && type == ZOO_CHILD_EVENT) {
+        return;
+    }
+    _zk_persistent_push_event(wctx, type, state, path);
+}
+
+/** set all the watches from scratch **/
+static void
+_zk_persistent_reset(struct zk_persistent_wctx *wctx)
+{
+    wctx->stale = false;
+    _zk_path_set_clear(&wctx->armed);
+    if (_zk_path_set_add(&wctx->armed, wctx->path) < 0) {
+        wctx->stale = true;
+        return;
+    }
+    _zk_persistent_arm(wctx, wctx->path, ZK_ARM_DATA | ZK_ARM_CHILDREN, false);
+}
+
+/**
+ * called once connected: a new session has no watches at all, a failed
+ * request may have left some paths unwatched.
+ **/
+static void
+_zk_persistent_rearm(struct lua_zoo_handle *handle)
+{
+    struct zk_persistent_wctx *wctx;
+    for (wctx = handle->persistent_wctxs; wctx != NULL; wctx = wctx->next) {
+        if (!wctx->removed && (handle->rearm_watches || wctx->stale)) {
+            _zk_persistent_reset(wctx);
+        }
+    }
+    handle->rearm_watches = false;
+}
+
+static void
+_zk_persistent_remove(lua_State *L,
+                      struct zk_persistent_wctx *wctx)
+{
+    wctx->removed = true;
+#ifdef ZK_HAVE_REMOVE_WATCHES
+    /* local: the server watches may be shared with other watchers */
+    zhandle_t *zh = wctx->handle->zh;
+    int i;
+    for (i = 0; zh != NULL && i < wctx->armed.capacity; ++i) {
+        struct zk_watched_path *item;
+        for (item = wctx->armed.buckets[i]; item != NULL; item = item->next) {
+            zoo_aremove_watches(zh, item->path, ZWATCHTYPE_ANY,
+                                persistent_watcher_dispatch, wctx,
+                                1, NULL, NULL);
+        }
+    }
+#endif
+    _zk_path_set_free(&wctx->armed);
+    /* queued events are dropped; the context itself lives until close */
+    _zk_persistent_wctx_release_refs(L, wctx);
+}
+
+static void
+_zk_persistent_close(lua_State *L,
+                     struct lua_zoo_handle *handle)
+{
+    while (handle->persistent_wctxs != NULL) {
+        struct zk_persistent_wctx *wctx = handle->persistent_wctxs;
+        handle->persistent_wctxs = wctx->next;
+        if (!wctx->removed) {
+            _zk_persistent_remove(L, wctx);
+        }
+        _zk_persistent_wctx_unref(L, wctx);
+    }
+}
+
+/**
+ * add a persistent watch:
+ * add_watch(handle, path, mode, watcher_fn, internal_ctx, user_ctx).
+ * The watches are being set when it returns.
+ **/
+static int
+lua_zoo_add_watch(lua_State *L)
+{
+    int top = lua_gettop(L);
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
+    const char *path = luaL_checkstring(L, 2);
+    int mode = luaL_checkint(L, 3);
+    luaL_checktype(L, 4, LUA_TFUNCTION); /* lua watcher function */
+    luaL_checktype(L, 5, LUA_TTABLE);  /* internal zookeep context */
+    if (mode != ZK_WATCH_PERSISTENT && mode != ZK_WATCH_PERSISTENT_RECURSIVE) {
+        return luaL_error(L, "unknown watch mode: %d", mode);
+    }
+    
+    struct zk_persistent_wctx *wctx = (struct zk_persistent_wctx *) calloc(
+        1, sizeof(struct zk_persistent_wctx));
+    if (wctx == NULL || (wctx->path = strdup(path)) == NULL) {
+        free(wctx);
+        return luaL_error(L, "zookeep: out of memory");
+    }
+    
+    wctx->handle = handle;
+    wctx->refs = 1;
+    wctx->mode = mode;
+    lua_pushvalue(L, 1);
+    wctx->zhref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, 4);
+    wctx->cbref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, 5);
+    wctx->internal_ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    if (top > 5 && !lua_isnil(L, 6)) {
+        lua_pushvalue(L, 6);
+        wctx->user_ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    } else {
+        wctx->user_ctx_ref = LUA_NOREF;
+    }
+    
+    wctx->next = handle->persistent_wctxs;
+    handle->persistent_wctxs = wctx;
+    _zk_persistent_reset(wctx);
+    return 0;
+}
+
+/**
+ * remove the persistent watches on path: remove_watches(handle, path,
+ * watcher_fn). All of them unless watcher_fn is given. Returns how many
+ * were removed.
+ **/
+static int
+lua_zoo_remove_watches(lua_State *L)
+{
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle(L, 1);
+    const char *path = luaL_checkstring(L, 2);
+    bool any = lua_isnoneornil(L, 3);
+    if (!any) {
+        luaL_checktype(L, 3, LUA_TFUNCTION);
+    }
+    
+    int removed = 0;
+    struct zk_persistent_wctx *wctx;
+    for (wctx = handle->persistent_wctxs; wctx != NULL; wctx = wctx->next) {
+        if (wctx->removed || strcmp(wctx->path, path) != 0) {
+            continue;
+        }
+        if (!any) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, wctx->cbref);
+            bool same = lua_rawequal(L, -1, 3);
+            lua_pop(L, 1);
+            if (!same) {
+                continue;
+            }
+        }
+        _zk_persistent_remove(L, wctx);
+        removed++;
+    }
+    lua_pushinteger(L, removed);
+    return 1;
+}
+
+/***************** persistent watch end *****************/
+
+/**
+ * initialize C clientid_t struct from lua table.
+ **/
+static clientid_t *
+_zk_clientid_init(lua_State *L,
+                  int index)
+{
+    size_t passwd_len = 0;
+    const char *clientid_passwd = NULL;
+    clientid_t *clientid = NULL;
+    clientid = (clientid_t *) malloc(sizeof(clientid_t));
+    if (clientid == NULL) {
+        luaL_error(L, "zookeep: out of memory");
+    }
+
+    luaL_checktype(L, index, LUA_TTABLE);
+    lua_getfield(L, index, "client_id");
+    clientid->client_id =  luaL_checkint(L, -1);
+    lua_pop(L, 1);
+    
+    lua_getfield(L, index, "passwd");
+    clientid_passwd = luaL_checklstring(L, -1, &passwd_len);
+    lua_pop(L, 1);
+    
+    memset(clientid->passwd, 0, 16);
+    memcpy(clientid->passwd, clientid_passwd, passwd_len);
+
+    return clientid;
+}
+
+static void
+_zk_clientid_free(clientid_t **clientid)
+{
+    if (*clientid != NULL) {
+        free(*clientid);
+        *clientid = NULL;
+    }
+}
+
+/***************** backoff begin *****************/
+
+/** xorshift64*; the jitter does not need a better generator **/
+static double
+_zk_random(void)
+{
+    static uint64_t seed = 0;
+    if (seed == 0) {
+        seed = (uint64_t) (clock_realtime() * 1e6)
+               ^ ((uint64_t) getpid() << 32);
+        if (seed == 0) {
+            seed = 1;
+        }
+    }
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return ((seed * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+static void
+_zk_backoff_reset(struct zk_backoff *b)
+{
+    b->ceiling = b->initial;
+    b->prev = b->initial;
+}
+
+static void
+_zk_backoff_init(struct zk_backoff *b,
+                 double initial)
+{
+    b->initial = initial;
+    b->max = initial > ZK_BACKOFF_DEFAULT_MAX
+             ? initial : ZK_BACKOFF_DEFAULT_MAX;
+    b->multiplier = ZK_BACKOFF_DEFAULT_MULTIPLIER;
+    b->jitter = ZK_JITTER_FULL;
+    _zk_backoff_reset(b);
+}
+
+/** the delay before the next connection attempt **/
+static double
+_zk_backoff_next(struct zk_backoff *b)
+{
+    double delay = b->ceiling;
+    switch (b->jitter) {
+    case ZK_JITTER_NONE:
+        break;
+    case ZK_JITTER_FULL:
+        delay = _zk_random() * b->ceiling;
+        break;
+    case ZK_JITTER_DECORRELATED:
+        delay = b->prev * b->multiplier;
+        if (delay > b->max) {
+            delay = b->max;
+        }
+        delay = b->initial + _zk_random() * (delay - b->initial);
+        break;
+    }
+    
+    b->prev = delay;
+    b->ceiling *= b->multiplier;
+    if (b->ceiling > b->max) {
+        b->ceiling = b->max;
+    }
+    return delay;
+}
+
+static const char *zk_jitter_names[] = {"none", "full", "decorrelated", NULL};
+
+/**
+ * set the delays between failed connection attempts:
+ * handle:set_reconnect_backoff(initial, max, multiplier, jitter).
+ * Nil arguments keep their current values.
+ **/
+static int
+lua_zoo_set_reconnect_backoff(lua_State *L)
+{
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle(L, 1);
+    struct zk_backoff b = handle->backoff;
+    
+    if (!lua_isnoneornil(L, 2)) {
+        b.initial = luaL_checknumber(L, 2);
+    }
+    if (!lua_isnoneornil(L, 3)) {
+        b.max = luaL_checknumber(L, 3);
+    }
+    if (!lua_isnoneornil(L, 4)) {
+        b.multiplier = luaL_checknumber(L, 4);
+    }
+    if (!lua_isnoneornil(L, 5)) {
+        b.jitter = luaL_checkoption(L, 5, NULL, zk_jitter_names);
+    }
+    
+    if (!(b.initial >= 0)) {
+        return luaL_error(L, "initial must not be negative");
+    }
+    if (!(b.max >= b.initial)) {
+        return luaL_error(L, "max must not be less than initial");
+    }
+    if (!(b.multiplier >= 1)) {
+        return luaL_error(L, "multiplier must be at least 1");
+    }
+    
+    handle->backoff = b;
+    _zk_backoff_reset(&handle->backoff);
+    return 0;
+}
+
+/***************** backoff end *****************/
+
+/** the session can not be resumed: expired or rejected by auth **/
+static bool
+_zk_session_is_lost(zhandle_t *zh)
+{
+    int state = zoo_state(zh);
+    return state == ZOO_EXPIRED_SESSION_STATE
+           || state == ZOO_AUTH_FAILED_STATE;
+}
+
+static void
+_zk_track_state(struct lua_zoo_handle *handle)
+{
+    int state = zoo_state(handle->zh);
+    if (state == handle->prev_state) {
+        return;
+    }
+    if (state == ZOO_CONNECTED_STATE) {
+        _zk_backoff_reset(&handle->backoff);
+        _zk_persistent_rearm(handle);
+        if (handle->connected_cond != NULL) {
+            fiber_cond_broadcast(handle->connected_cond);
+        }
+    }
+    handle->prev_state = state;
+    _zk_stats_set_state(&handle->stats, state);
+}
+
+/**
+ * (re)create the client handle. It starts a new session unless
+ * handle->client_id is set: closing a live handle ends its session, so
+ * this is only done once the session is lost.
+ **/
+static int
+_zoo_handle_reinit(struct lua_zoo_handle *handle) 
+{
+    if (handle == NULL) {
+        return 0;
+    }
+    
+    if (handle->zh != NULL) {
+        zookeeper_close(handle->zh);
+        handle->zh = NULL;
+    }
+
+#ifdef ZK_HAVE_LOG_CALLBACK
+    handle->zh = zookeeper_init2(handle->host, /* host */
+                                 NULL, /* watcher */
+                                 handle->recv_timeout, /* recv_timeout */
+                                 handle->client_id, /* clientid */
+                                 NULL, /* context */
+                                 handle->flags, /* flags */
+                                 _zk_log_callback /* log_callback */);
+#else
+    handle->zh = zookeeper_init(handle->host, /* host */
+                                NULL, /* watcher */
+                                handle->recv_timeout, /* recv_timeout */
+                                handle->client_id, /* clientid */
+                                NULL, /* context */
+                                handle->flags /* flags */);
+#endif
+    handle->prev_state = ZOO_NOTCONNECTED_STATE;
+    _zk_stats_set_state(&handle->stats, ZOO_NOTCONNECTED_STATE);
+    if (handle->zh == NULL) {
+        return errno;
+    }
+
+    if (handle->global_wctx != NULL) {
+        zoo_set_watcher(handle->zh, watcher_dispatch);
+        zoo_set_context(handle->zh, (void *) handle->global_wctx);
+    }
+    return 0;
+}
+
+/**
+ * initialize a zookeeper handle.
+ **/
+static int
+lua_zoo_init(lua_State *L)
+{
+    int top = lua_gettop(L);
+    const char *host = NULL;
+    size_t host_len = 0;
+    int recv_timeout = 0;
+    double reconnect_timeout = 1;
+    int watch_queue_size = ZK_WATCH_QUEUE_DEFAULT_SIZE;
+    double op_timeout = -1;
+    clientid_t *clientid = NULL;
+    int flags = 0;
+    int err;
+
+    struct lua_zoo_handle *handle = (struct lua_zoo_handle *) lua_newuserdata(
+        L, sizeof(struct lua_zoo_handle));
+    /* the handle may be collected before it is fully initialized */
+    memset(handle, 0, sizeof(struct lua_zoo_handle));
+        
+    luaL_getmetatable(L, ZOOKEEP_MT_NAME);
+    lua_setmetatable(L, -2);
+
+    host = luaL_checklstring(L, 1, &host_len);
+    recv_timeout = luaL_checkint(L, 2);
+    
+    if (top >= 3 && !lua_isnil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        clientid = _zk_clientid_init(L, 3);
+    }
+    
+    if (top >= 4 && !lua_isnil(L, 4)) {
+        flags = luaL_checkint(L, 4);
+    }
+    
+    if (top >= 5 && !lua_isnil(L, 5)) {
+        reconnect_timeout = luaL_checknumber(L, 5);
+        if (!(reconnect_timeout >= 0)) {
+            return luaL_error(L, "reconnect_timeout must not be negative");
+        }
+    }
+    
+    if (top >= 6 && !lua_isnil(L, 6)) {
+        watch_queue_size = luaL_checkint(L, 6);
+        if (watch_queue_size <= 0) {
+            return luaL_error(L, "watch_queue_size must be positive");
+        }
+    }
+    
+    if (top >= 7 && !lua_isnil(L, 7)) {
+        op_timeout = luaL_checknumber(L, 7);
+    }
+    
+    _zk_log_init();
+    handle->zh = NULL;
+    handle->global_wctx = NULL;
+    handle->persistent_wctxs = NULL;
+    handle->rearm_watches = false;
+    handle->connected_cond = NULL;
+    handle->process_fiber = NULL;
+    handle->process_waiting = false;
+    _zk_backoff_init(&handle->backoff, reconnect_timeout);
+    handle->op_timeout = op_timeout;
+    handle->client_id = clientid;
+    handle->flags = flags;
+    handle->recv_timeout = recv_timeout;
+    handle->host = strdup(host);
+    handle->stats.state = ZOO_NOTCONNECTED_STATE;
+    handle->stats.state_since = clock_monotonic();
+    if (_zk_watch_queue_init(&handle->watch_queue, watch_queue_size) != 0) {
+        return luaL_error(L, "zookeep: out of memory");
+    }
+
+    err = _zoo_handle_reinit(handle);
+    if (err != 0) {
+        return luaL_error(L, strerror(err));
+    }
+    return 1;
+}
+
+static int
+lua_zoo_close(lua_State *L)
+{
+    int ret = 0;
+    struct lua_zoo_handle *handle = luaL_checkudata(L, 1, ZOOKEEP_MT_NAME);
+    if (handle == NULL) {
+        return 0;
+    }
+    
+    if (handle->zh != NULL) {
+        ret = zookeeper_close(handle->zh);
+        handle->zh = NULL;
+    }
+    
+    _zk_watch_queue_close(L, &handle->watch_queue);
+    _zk_persistent_close(L, handle);
+    
+    if (handle->global_wctx != NULL) {
+        _zk_global_wctx_unref(L, handle->global_wctx);
+        handle->global_wctx = NULL;
+    }
+    
+    if (handle->connected_cond != NULL) {
+        fiber_cond_delete(handle->connected_cond);
+        handle->connected_cond = NULL;
+    }
+
+    if (handle->client_id != NULL) {
+        _zk_clientid_free(&handle->client_id);
+    }
+
+    if (handle->host != NULL) {
+        free(handle->host);
+        handle->host = NULL;
+    }
+    
+    lua_pushinteger(L, ret);
+    return 1;
+}
+
+static int
+lua_zoo_gc(lua_State *L)
+{
+    struct lua_zoo_handle *handle = luaL_checkudata(L, 1, ZOOKEEP_MT_NAME);
+    lua_zoo_close(L);
+    
+    /* nobody can be waiting on these: waiters hold a ref to the handle */
+    struct zk_watch_queue *queue = &handle->watch_queue;
+    if (queue->not_empty != NULL) {
+        fiber_cond_delete(queue->not_empty);
+        queue->not_empty = NULL;
+    }
+    return 0;
+}
+
+/**
+ * return clientid_t of the current connection.
+ **/
+static int
+lua_zoo_client_id(lua_State *L)
+{
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle(L, 1);
+    
+    const clientid_t *clientid = zoo_client_id(handle->zh);
+    lua_newtable(L);
+    lua_pushstring(L, "client_id");
+    lua_pushnumber(L, clientid->client_id);
+    lua_settable(L, -3);
+    lua_pushstring(L, "passwd");
+    lua_pushstring(L, clientid->passwd);
+    lua_settable(L, -3);
+    return 1;
+}
+
+static int
+lua_zoo_process(lua_State *L)
+{
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle(L, 1);
+    
+    int fd = -1;
+    int interest = 0;
+    int coio_events = 0;
+    int zoo_events = 0;
+    int rc = ZOK;
+    double timeout = 0;
+    struct timeval tv;
+    int reconnect = 0;
+    int retry = 0;
+    int err = 0;
+    
+    handle->process_fiber = fiber_self();
+    handle->process_waiting = false;
+        
+    while (true) {
+        fd = -1;
+        interest = 0;
+        coio_events = 0;
+        zoo_events = 0;
+        timeout = 0;
+        reconnect = 0;
+        retry = 0;
+        err = 0;
+
+        if (handle->zh == NULL) {
+            reconnect = 1;
+        } else if (_zk_session_is_lost(handle->zh)) {
+            /* the only case a new session is needed */
+            say_warn("zookeep: session lost (state = %d), starting a new one",
+                     zoo_state(handle->zh));
+            _zk_clientid_free(&handle->client_id);
+            handle->rearm_watches = true;
+            reconnect = 1;
+        } else {
+            rc = zookeeper_interest(handle->zh, &fd, &interest, &tv);
+            if (rc != ZOK || fd == -1) {
+                /*
+                 * the connection is down. The library connects again on
+                 * a later zookeeper_interest() call and resumes the same
+                 * session, watches and ephemeral nodes included.
+                 */
+                say_warn("zookeep: connection lost (rc = %d; state = %d)",
+                         rc, zoo_state(handle->zh));
+                _zk_track_state(handle);
+                retry = 1;
+            }
+        }
+        
+        if (fd != -1 && !retry) {
+            if (interest & ZOOKEEPER_READ) {
+                coio_events |= COIO_READ;
+            } else {
+                coio_events &= ~COIO_READ;
+            }
+            if (interest & ZOOKEEPER_WRITE) {
+                coio_events |= COIO_WRITE;
+            } else {
+                coio_events &= ~COIO_WRITE;
+            }
+            
+            timeout = (double)(tv.tv_sec + (double) tv.tv_usec / 1000000.0);
+            handle->process_waiting = true;
+            coio_events = coio_wait(fd, coio_events, timeout);
+            handle->process_waiting = false;
+            
+            if (fiber_is_cancelled()) {
+                break;
+            }
+            
+            if (coio_events == 0) {
+                // timeout
+                continue;
+            }
+            
+            zoo_events = 0;
+            if (coio_events & COIO_READ) {
+                zoo_events |= ZOOKEEPER_READ;
+            }
+            if (coio_events & COIO_WRITE) {
+                zoo_events |= ZOOKEEPER_WRITE;
+            }
+            rc = zookeeper_process(handle->zh, zoo_events);
+            _zk_track_state(handle);
+            if (handle->watch_queue.count >= handle->watch_queue.limit) {
+                /**
+                 * back-pressure: let the workers run before reading
+                 * more. Only a yield, as a worker may be waiting for a
+                 * reply this loop has to read.
+                 **/
+                fiber_sleep(0);
+                if (fiber_is_cancelled()) {
+                    break;
+                }
+            }
+            continue;
+        }
+
+        if (reconnect) {
+            handle->stats.reconnects++;
+            err = _zoo_handle_reinit(handle);
+            if (err == 0) {
+                continue;
+            }
+            say_error(
+                "zookeep: recreate handle failed: %d/%s", err, strerror(err));
+        }
+        
+        double delay = _zk_backoff_next(&handle->backoff);
+        handle->stats.reconnect_attempts++;
+        handle->stats.reconnect_wait += delay;
+        say_warn("zookeep: reconnecting in %.3fs", delay);
+        fiber_sleep(delay);
+        if (fiber_is_cancelled()) {
+            break;
+        }
+    }
+    handle->process_fiber = NULL;
+    handle->process_waiting = false;
+    say_debug("zookeep: finished processing");
+    return 0;
+}
+
+static int
+lua_zoo_state(lua_State *L)
+{
+    int ret = 0;
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle(L, 1);
+    
+    ret = zoo_state(handle->zh);
+    lua_pushinteger(L, ret);
+    return 1;
+}
+
+/** number of watch events waiting for a worker **/
+static int
+lua_zoo_watch_backlog(lua_State *L)
+{
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle(L, 1);
+    lua_pushinteger(L, handle->watch_queue.count);
+    return 1;
+}
+
+static int
+lua_zoo_wait_connected(lua_State *L)
+{
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle(L, 1);
+    
+    double timeout = -1;
+    if (!lua_isnil(L, 2)) {
+        timeout = luaL_checknumber(L, 2);
+    }
+    
+    if (zoo_state(handle->zh) == ZOO_CONNECTED_STATE) {
+        return 0;
+    }
+    
+    if (handle->connected_cond == NULL) {
+        handle->connected_cond = fiber_cond_new();
+    }
+    int ret;
+    if (timeout < 0) {
+        ret = fiber_cond_wait(handle->connected_cond);
+        if (ret == 0) {
+            // wakeup
+            return 0;
+        }
+        return luaL_error(L, "unexpected error");
+    } else {
+        ret = fiber_cond_wait_timeout(handle->connected_cond, timeout);
+        if (ret == 0) {
+            // wakeup
+            return 0;
+        } else if (ret == -1) {
+            return luaL_error(L, "timeout");
+        }
+        
+        return luaL_error(L, "unexpected error");
+    }
+}
+
+static int
+lua_zookeep_set_watcher(lua_State *L)
+{
+    int top = lua_gettop(L);
+    struct zk_global_wctx *wctx;
+    int zhref = 0;
+    int cbref = 0;
+    int internal_ctx_ref = 0;
+    int user_ctx_ref = 0;
+    int has_user_ctx = 0;
+    
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle(L, 1);
+    if (handle->global_wctx != NULL) {
+        _zk_global_wctx_unref(L, handle->global_wctx);
+        handle->global_wctx = NULL;
+    }
+    if (top < 2 || lua_isnil(L, 2)) { /* lua watcher function */
+        /* remove watcher */
+        zoo_set_watcher(handle->zh, NULL);
+        zoo_set_context(handle->zh, NULL);
+        return 0;
+    }
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    luaL_checktype(L, 3, LUA_TTABLE);  /* internal zookeep context */
+    if (top > 3 && !lua_isnil(L, 4)) {
+        has_user_ctx = 1; /* user's context */
+    }
+    
+    lua_pushvalue(L, 1);
+    zhref = luaL_ref(L, LUA_REGISTRYINDEX);
+    
+    lua_pushvalue(L, 2);
+    cbref = luaL_ref(L, LUA_REGISTRYINDEX);
+    
+    lua_pushvalue(L, 3);
+    internal_ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    
+    if (has_user_ctx) {
+        lua_pushvalue(L, 4);
+        user_ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    
+    wctx = _zk_global_wctx_init(L, handle, zhref, cbref,
+                                internal_ctx_ref, user_ctx_ref);
+    handle->global_wctx = wctx;
+    
+    zoo_set_watcher(handle->zh, watcher_dispatch);
+    zoo_set_context(handle->zh, (void *) wctx);
+    return 0;
+}
+
+static int
+lua_zoo_set_log_level(lua_State *L)
+{
+    int level = luaL_checkint(L, -1);
+    switch(level) {
+        case ZOO_LOG_LEVEL_ERROR:
+            zoo_set_debug_level(ZOO_LOG_LEVEL_ERROR);
+            break;
+        case ZOO_LOG_LEVEL_WARN:
+            zoo_set_debug_level(ZOO_LOG_LEVEL_WARN);
+            break;
+        case ZOO_LOG_LEVEL_INFO:
+            zoo_set_debug_level(ZOO_LOG_LEVEL_INFO);
+            break;
+        case ZOO_LOG_LEVEL_DEBUG:
+            zoo_set_debug_level(ZOO_LOG_LEVEL_DEBUG);
+            break;
+        default:
+            return luaL_error(L, "unsupported log level specified");
+    }
+    return 0;
+}
+
+/**
+ * timeout of a request: the argument at index if given, the handle's
+ * op_timeout otherwise. Negative means no timeout.
+ **/
+static double
+_zk_check_op_timeout(lua_State *L,
+                     int index,
+                     struct lua_zoo_handle *handle)
+{
+    if (lua_isnoneornil(L, index)) {
+        return handle->op_timeout;
+    }
+    return luaL_checknumber(L, index);
+}
+
+/**
+ * allocate a completion context for a request. The reply is stored in
+ * the context until the waiting fiber (or a future) collects it, so any
+ * number of requests may be in flight at once.
+ **/
+static struct zk_data_result *
+_zk_data_result_init(lua_State *L,
+                     struct lua_zoo_handle *handle,
+                     bool async,
+                     double timeout)
+{
+    struct zk_data_result *cdata = zk_pool.results;
+    if (cdata != NULL) {
+        zk_pool.results = cdata->next;
+        zk_pool.results_count--;
+        zk_pool.reuses++;
+    } else {
+        cdata = (struct zk_data_result *) malloc(sizeof(struct zk_data_result));
+        if (cdata == NULL) {
+            luaL_error(L, "zookeep: out of memory");
+            return NULL;
+        }
+        memset(&cdata->result, 0, sizeof(cdata->result));
+        cdata->cond = fiber_cond_new();
+        zk_pool.allocs++;
+    }
+    cdata->next = NULL;
+    cdata->handle = handle;
+    cdata->timeout = timeout;
+    cdata->async = async;
+    cdata->completed = false;
+    cdata->abandoned = false;
+    cdata->multi = NULL;
+    cdata->result.want_buffer = false;
+    cdata->wctx = NULL;
+    cdata->wctx_on_nonode = false;
+    cdata->batch = NULL;
+    cdata->batch_index = 0;
+    
+    /* keep the reply buffer of a recycled context */
+    char *buf = cdata->result.buf;
+    size_t buf_size = cdata->result.buf_size;
+    memset(&cdata->result, 0, sizeof(cdata->result));
+    cdata->result.buf = buf;
+    cdata->result.buf_size = buf_size;
+    return cdata;
+}
+
+static void
+_zk_data_result_free(struct zk_data_result *cdata)
+{
+    if (cdata == NULL) {
+        return;
+    }
+    
+    _zk_multi_ctx_free(cdata->multi);
+    cdata->multi = NULL;
+    _zk_buffer_unref(cdata->result.value_buf);
+    cdata->result.value_buf = NULL;
+    
+    if (zk_pool.results_count < zk_pool.max_size) {
+        /* do not let one big reply pin its buffer forever */
+        if (cdata->result.buf_size > ZK_POOL_MAX_BUF_SIZE) {
+            free(cdata->result.buf);
+            cdata->result.buf = NULL;
+            cdata->result.buf_size = 0;
+        }
+        cdata->next = zk_pool.results;
+        zk_pool.results = cdata;
+        zk_pool.results_count++;
+        return;
+    }
+    free(cdata->result.buf);
+    fiber_cond_delete(cdata->cond);
+    free(cdata);
+}
+
+/**
+ * the client only keeps a one-shot watcher if the request succeeded
+ * (or, for exists, found no node); otherwise it will never fire and
+ * its context has to be released here.
+ **/
+static void
+_zk_data_result_release_wctx(struct zk_data_result *cdata,
+                             int rc)
+{
+    if (cdata->wctx == NULL) {
+        return;
+    }
+    if (rc != ZOK && !(rc == ZNONODE && cdata->wctx_on_nonode)) {
+        _zk_local_wctx_free(luaT_state(), cdata->wctx);
+    }
+    cdata->wctx = NULL;
+}
+
+static void
+_zk_data_result_complete(struct zk_data_result *cdata,
+                         int rc)
+{
+    _zk_data_result_release_wctx(cdata, rc);
+    _zk_op_end(cdata, rc);
+    cdata->result.rc = rc;
+    cdata->completed = true;
+    
+    if (cdata->batch != NULL) {
+        _zk_batch_complete(cdata);
+        return;
+    }
+    
+    if (cdata->abandoned) {
+        /* nobody is going to collect the results */
+        _zk_data_result_free(cdata);
+        return;
+    }
+    fiber_cond_broadcast(cdata->cond);
+}
+
+/**
+ * wait for a request to complete, for at most timeout seconds unless it
+ * is negative. Returns ZOK, ZOPERATIONTIMEOUT or ZSYSTEMERROR if the
+ * fiber was cancelled.
+ **/
+static int
+_zk_data_result_wait(struct zk_data_result *cdata,
+                     double timeout)
+{
+    double deadline = fiber_time() + timeout;
+    while (!cdata->completed) {
+        if (timeout < 0) {
+            fiber_cond_wait(cdata->cond);
+        } else {
+            double remaining = deadline - fiber_time();
+            if (remaining <= 0) {
+                return ZOPERATIONTIMEOUT;
+            }
+            fiber_cond_wait_timeout(cdata->cond, remaining);
+        }
+        if (!cdata->completed && fiber_is_cancelled()) {
+            return ZSYSTEMERROR;
+        }
+    }
+    return ZOK;
+}
+
+/**
+ * pushes {code = rc, message = zerror(rc)}: callers tell errors apart
+ * by the code, tostring() gives the message.
+ **/
+static void
+_zk_push_error(lua_State *L,
+               int rc)
+{
+    lua_createtable(L, 0, 2);
+    lua_pushinteger(L, rc);
+    lua_setfield(L, -2, "code");
+    lua_pushstring(L, zerror(rc));
+    lua_setfield(L, -2, "message");
+    luaL_getmetatable(L, ZOOKEEP_ERROR_MT_NAME);
+    lua_setmetatable(L, -2);
+}
+
+static int
+_zk_wait_error(lua_State *L,
+               int rc)
+{
+    if (rc == ZOPERATIONTIMEOUT) {
+        _zk_push_error(L, rc);
+        return lua_error(L);
+    }
+    return luaL_error(L, "fiber is cancelled");
+}
+
+/**
+ * make the process fiber recompute its interest, so that a freshly
+ * queued request is flushed without waiting for the next ping.
+ **/
+static inline void
+_zk_process_wakeup(struct lua_zoo_handle *handle)
+{
+    if (handle != NULL && handle->process_waiting) {
+        fiber_wakeup(handle->process_fiber);
+    }
+}
+
+static int
+_zk_push_future(lua_State *L,
+                struct zk_data_result *cdata)
+{
+    struct zk_future *future =
+        (struct zk_future *) lua_newuserdata(L, sizeof(struct zk_future));
+    luaL_getmetatable(L, ZOOKEEP_FUTURE_MT_NAME);
+    lua_setmetatable(L, -2);
+    
+    future->cdata = cdata;
+    return 1;
+}
+
+/** raises the error of a request that could not be sent **/
+static void
+_zk_operation_failed(lua_State *L,
+                     struct zk_data_result *cdata,
+                     int ret)
+{
+    _zk_op_end(cdata, ret);
+    /* the watcher was never registered */
+    _zk_data_result_release_wctx(cdata, ret);
+    _zk_data_result_free(cdata);
+    luaL_error(L, zerror(ret));
+}
+
+/** wait for the reply to a sync request; raises on errors **/
+static void
+_zk_operation_wait(lua_State *L,
+                   struct zk_data_result *cdata,
+                   int ret)
+{
+    if (ret != ZOK) {
+        _zk_operation_failed(L, cdata, ret);
+    }
+    _zk_process_wakeup(cdata->handle);
+    
+    ret = _zk_data_result_wait(cdata, cdata->timeout);
+    if (ret != ZOK) {
+        /* the callback may still come: let it free the context */
+        cdata->abandoned = true;
+        _zk_wait_error(L, ret);
+    }
+}
+
+static int
+_zk_handle_operation_result(lua_State *L,
+                            struct zk_data_result *cdata,
+                            int ret)
+{
+    if (cdata == NULL) {
+        return 0;
+    }
+    
+    if (cdata->async) {
+        if (ret != ZOK) {
+            _zk_operation_failed(L, cdata, ret);
+        }
+        _zk_process_wakeup(cdata->handle);
+        return _zk_push_future(L, cdata);
+    }
+    
+    _zk_operation_wait(L, cdata, ret);
+    int ret_count = _zk_result_push(L, cdata);
+    _zk_data_result_free(cdata);
+    return ret_count;
+}
+
+/***************** future begin *****************/
+
+static inline struct zk_future *
+_zk_check_future(lua_State *L, int index)
+{
+    struct zk_future *future = luaL_checkudata(L, index,
+                                               ZOOKEEP_FUTURE_MT_NAME);
+    if (future->cdata != NULL) {
+        return future;
+    }
+    
+    luaL_error(L, "invalid zookeeper future.");
+    return NULL;
+}
+
+/**
+ * wait for an async request to complete and return its results.
+ * The values are built anew on every call, so wait() may be called more
+ * than once.
+ **/
+static int
+lua_zoo_future_wait(lua_State *L)
+{
+    struct zk_future *future = _zk_check_future(L, 1);
+    struct zk_data_result *cdata = future->cdata;
+    
+    double timeout = -1;
+    if (!lua_isnoneornil(L, 2)) {
+        timeout = luaL_checknumber(L, 2);
+    }
+    
+    int rc = _zk_data_result_wait(cdata, timeout);
+    if (rc != ZOK) {
+        return _zk_wait_error(L, rc);
+    }
+    
+    return _zk_result_push(L, cdata);
+}
+
+static int
+lua_zoo_future_is_ready(lua_State *L)
+{
+    struct zk_future *future = _zk_check_future(L, 1);
+    lua_pushboolean(L, future->cdata->completed);
+    return 1;
+}
+
+static int
+lua_zoo_future_gc(lua_State *L)
+{
+    struct zk_future *future = luaL_checkudata(L, 1, ZOOKEEP_FUTURE_MT_NAME);
+    struct zk_data_result *cdata = future->cdata;
+    if (cdata == NULL) {
+        return 0;
+    }
+    future->cdata = NULL;
+    
+    if (cdata->completed) {
+        _zk_data_result_free(cdata);
+    } else {
+        /* freed by _zk_data_result_complete() */
+        cdata->abandoned = true;
+    }
+    return 0;
+}
+
+static int
+lua_zoo_future_tostring(lua_State *L)
+{
+    struct zk_future *future = luaL_checkudata(L, 1, ZOOKEEP_FUTURE_MT_NAME);
+    lua_pushfstring(L, "ZookeeperFuture [%s]",
+                    future->cdata == NULL ? "invalid" :
+                    future->cdata->completed ? "ready" : "pending");
+    return 1;
+}
+
+/***************** future end *****************/
+
+static int
+_zk_parse_watch_flag(lua_State *L, int index) {
+    if (lua_isnil(L, index)) {
+        return 0;
+    }
+    
+    if (lua_isboolean(L, index)) {
+        return lua_toboolean(L, index);
+    }
+    
+    return luaL_error(L, "watch must either a nil or boolean");
+}
+
+static int
+lua_zoo_add_auth(lua_State *L)
+{
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle(L, 1);
+    
+    size_t cert_len = 0;
+    const char *scheme = NULL;
+    const char *cert = NULL;
+    
+    scheme = luaL_checkstring(L, 2);
+    cert = luaL_checklstring(L, 3, &cert_len);
+
+    double timeout = _zk_check_op_timeout(L, 4, handle);
+    struct zk_data_result *cdata = _zk_data_result_init(L, handle, false,
+                                                        timeout);
+    _zk_op_begin(cdata, ZK_OP_ADD_AUTH, scheme);
+    int ret = zoo_add_auth(handle->zh,
+                           scheme,
+                           cert,
+                           cert_len,
+                           _zk_void_cb,
+                           cdata);
+    return _zk_handle_operation_result(L, cdata, ret);
+}
+
+static int
+lua_zoo_deterministic_conn_order(lua_State *L)
+{
+    int value = 0;
+   
+    if (!lua_isnil(L, 1) && lua_isboolean(L, 1)) {
+        value = lua_toboolean(L, 1);
+    } else {
+        return luaL_error(L, "invalid argument: boolean is required");
+    }
+    
+    zoo_deterministic_conn_order(value);
+    return 0;
+}
+
+/** error(rc): the error object raised by the driver for rc **/
+static int
+lua_zoo_error(lua_State *L)
+{
+    _zk_push_error(L, luaL_checkint(L, 1));
+    return 1;
+}
+
+/** error_code(err): the code of a driver error object, nil otherwise **/
+static int
+lua_zoo_error_code(lua_State *L)
+{
+    if (!lua_istable(L, 1) || !lua_getmetatable(L, 1)) {
+        lua_pushnil(L);
+        return 1;
+    }
+    luaL_getmetatable(L, ZOOKEEP_ERROR_MT_NAME);
+    bool is_error = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    if (!is_error) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_getfield(L, 1, "code");
+    return 1;
+}
+
+static int
+lua_zoo_error_tostring(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "message");
+    return 1;
+}
+
+static int
+lua_zoo_zerror(lua_State *L)
+{
+    int code = luaL_checkint(L, -1);
+    const char *errstr = zerror(code);
+    lua_pushstring(L, errstr);
+    return 1;
+}
+
+static int
+_zoo_create(lua_State *L,
+            bool async)
+{
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
+    
+    const char *path = NULL;
+    size_t path_len = 0;
+    
+    const char *value = NULL;
+    size_t value_len = 0;
+    
+    struct ACL_vector *zoo_acl;
+    int flags = 0;
+
+    path = luaL_checklstring(L, 2, &path_len);
+    if (!lua_isnil(L, 3)) {
+        value = luaL_checklstring(L, 3, &value_len);
+    }
+    zoo_acl = _zk_check_zoo_acl(L, 4);
+    if (!lua_isnil(L, 5)) {
+        flags = luaL_checkint(L, 5);
+    }
+    
+    double timeout = _zk_check_op_timeout(L, 6, handle);
+    struct zk_data_result *cdata = _zk_data_result_init(L, handle, async,
+                                                        timeout);
+    _zk_op_begin(cdata, ZK_OP_CREATE, path);
+    int ret = zoo_acreate(handle->zh,
+                          path,
+                          value,
+                          value_len,
+                          zoo_acl,
+                          flags,
+                          _zk_string_cb,
+                          cdata);
+    return _zk_handle_operation_result(L, cdata, ret);
+}
+
+static int
+lua_zoo_create(lua_State *L)
+{
+    return _zoo_create(L, false);
+}
+
+static int
+lua_zoo_create_async(lua_State *L)
+{
+    return _zoo_create(L, true);
+}
+
+static int
+_zoo_delete(lua_State *L,
+            bool async)
+{
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
+    
+    const char *path = NULL;
+    size_t path_len = 0;
+    int version = -1;
+
+    path = luaL_checklstring(L, 2, &path_len);
+    if (!lua_isnil(L, 3)) {
+        version = luaL_checkint(L, 3);
+    }
+    
+    double timeout = _zk_check_op_timeout(L, 4, handle);
+    struct zk_data_result *cdata = _zk_data_result_init(L, handle, async,
+                                                        timeout);
+    _zk_op_begin(cdata, ZK_OP_DELETE, path);
+    int ret = zoo_adelete(handle->zh,
+                          path,
+                          version,
+                          _zk_void_cb,
+                          cdata);
+    return _zk_handle_operation_result(L, cdata, ret);
+}
+
+static int
+lua_zoo_delete(lua_State *L)
+{
+    return _zoo_delete(L, false);
+}
+
+static int
+lua_zoo_delete_async(lua_State *L)
+{
+    return _zoo_delete(L, true);
+}
+
+static int
+_zoo_exists(lua_State *L,
+            bool async)
+{
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
+    
+    const char *path = NULL;
+    size_t path_len = 0;
+    int watch = 0;
+
+    path = luaL_checklstring(L, 2, &path_len);
+    watch = _zk_parse_watch_flag(L, 3);
+    
+    double timeout = _zk_check_op_timeout(L, 4, handle);
+    struct zk_data_result *cdata = _zk_data_result_init(L, handle, async,
+                                                        timeout);
+    _zk_op_begin(cdata, ZK_OP_EXISTS, path);
+    int ret = zoo_aexists(handle->zh,
+                          path,
+                          watch,
+                          _zk_stat_cb,
+                          cdata);
+    return _zk_handle_operation_result(L, cdata, ret);
+}
+
+static int
+lua_zoo_exists(lua_State *L)
+{
+    return _zoo_exists(L, false);
+}
+
+static int
+lua_zoo_exists_async(lua_State *L)
+{
+    return _zoo_exists(L, true);
+}
+
+
+static int
+_zoo_get(lua_State *L,
+         bool async)
+{
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
+    
+    const char *path = NULL;
+    size_t path_len = 0;
+    int watch = 0;
+
+    path = luaL_checklstring(L, 2, &path_len);
+    watch = _zk_parse_watch_flag(L, 3);
+    
+    double timeout = _zk_check_op_timeout(L, 4, handle);
+    bool want_buffer = lua_toboolean(L, 5);
+    struct zk_data_result *cdata = _zk_data_result_init(L, handle, async,
+                                                        timeout);
+    cdata->result.want_buffer = want_buffer;
+    _zk_op_begin(cdata, ZK_OP_GET, path);
+    int ret = zoo_aget(handle->zh,
+                       path,
+                       watch,
+                       _zk_data_cb,
+                       cdata);
+    return _zk_handle_operation_result(L, cdata, ret);
+}
+
+static int
+lua_zoo_get(lua_State *L)
+{
+    return _zoo_get(L, false);
+}
+
+static int
+lua_zoo_get_async(lua_State *L)
+{
+    return _zoo_get(L, true);
+}
+
+static int
+_zoo_set(lua_State *L,
+         bool async)
+{
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
+    
+    const char *path = NULL;
+    size_t path_len = 0;
+    
+    const char *value = NULL;
+    size_t value_len = 0;
+    
+    int version = -1;
+
+    path = luaL_checklstring(L, 2, &path_len);
+    value = luaL_checklstring(L, 3, &value_len);
+    
+    if (!lua_isnil(L, 4)) {
+        version = luaL_checkint(L, 4);
+    }
+    
+    double timeout = _zk_check_op_timeout(L, 5, handle);
+    struct zk_data_result *cdata = _zk_data_result_init(L, handle, async,
+                                                        timeout);
+    _zk_op_begin(cdata, ZK_OP_SET, path);
+    int ret = zoo_aset(handle->zh,
+                       path,
+                       value,
+                       value_len,
+                       version,
+                       _zk_stat_cb,
+                       cdata);
+    return _zk_handle_operation_result(L, cdata, ret);
+}
+
+static int
+lua_zoo_set(lua_State *L)
+{
+    return _zoo_set(L, false);
+}
+
+static int
+lua_zoo_set_async(lua_State *L)
+{
+    return _zoo_set(L, true);
+}
+
+static int
+_zoo_get_children(lua_State *L,
+                  bool async)
+{
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
+    
+    const char *path = NULL;
+    size_t path_len = 0;
+    int watch = 0;
+
+    path = luaL_checklstring(L, 2, &path_len);
+    watch = _zk_parse_watch_flag(L, 3);
+    
+    double timeout = _zk_check_op_timeout(L, 4, handle);
+    struct zk_data_result *cdata = _zk_data_result_init(L, handle, async,
+                                                        timeout);
+    _zk_op_begin(cdata, ZK_OP_GET_CHILDREN, path);
+    int ret = zoo_aget_children(handle->zh,
+                                path,
+                                watch,
+                                _zk_strings_cb,
+                                cdata);
+    return _zk_handle_operation_result(L, cdata, ret);
+}
+
+static int
+lua_zoo_get_children(lua_State *L)
+{
+    return _zoo_get_children(L, false);
+}
+
+static int
+lua_zoo_get_children_async(lua_State *L)
+{
+    return _zoo_get_children(L, true);
+}
+
+static int
+_zoo_get_children2(lua_State *L,
+                   bool async)
+{
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
+    
+    const char *path = NULL;
+    size_t path_len = 0;
+    int watch = 0;
+
+    path = luaL_checklstring(L, 2, &path_len);
+    watch = _zk_parse_watch_flag(L, 3);
+    
+    double timeout = _zk_check_op_timeout(L, 4, handle);
+    struct zk_data_result *cdata = _zk_data_result_init(L, handle, async,
+                                                        timeout);
+    _zk_op_begin(cdata, ZK_OP_GET_CHILDREN2, path);
+    int ret = zoo_aget_children2(handle->zh,
+                                 path,
+                                 watch,
+                                 _zk_strings_stat_cb,
+                                 cdata);
+    return _zk_handle_operation_result(L, cdata, ret);
+}
+
+static int
+lua_zoo_get_children2(lua_State *L)
+{
+    return _zoo_get_children2(L, false);
+}
+
+static int
+lua_zoo_get_children2_async(lua_State *L)
+{
+    return _zoo_get_children2(L, true);
+}
+
+/***************** children cursor begin *****************/
+
+/**
+ * Very wide nodes: the names stay in the reply buffer on the C side,
+ * filtered and sorted there, and Lua takes them a batch at a time, so it
+ * never holds the full list.
+ **/
+
+static int
+_zk_name_cmp(const void *a,
+             const void *b)
+{
+    return strcmp(*(const char *const *) a, *(const char *const *) b);
+}
+
+static inline struct zk_children_cursor *
+_zk_check_cursor(lua_State *L, int index)
+{
+    return (struct zk_children_cursor *) luaL_checkudata(
+        L, index, ZOOKEEP_CURSOR_MT_NAME);
+}
+
+/** pushes an empty cursor **/
+static struct zk_children_cursor *
+_zk_new_cursor(lua_State *L)
+{
+    struct zk_children_cursor *cursor = (struct zk_children_cursor *)
+        lua_newuserdata(L, sizeof(struct zk_children_cursor));
+    memset(cursor, 0, sizeof(struct zk_children_cursor));
+    luaL_getmetatable(L, ZOOKEEP_CURSOR_MT_NAME);
+    lua_setmetatable(L, -2);
+    return cursor;
+}
+
+/**
+ * takes the names from result: the buffer now belongs to the cursor.
+ * Never raises, the caller still holds the request; -1 if out of memory.
+ **/
+static int
+_zk_fill_cursor(struct zk_children_cursor *cursor,
+                struct zk_result *result,
+                const char *prefix,
+                bool sorted)
+{
+    if (result->strings_count <= 0) {
+        return 0;
+    }
+    cursor->names = (const char **) malloc(
+        result->strings_count * sizeof(const char *));
+    if (cursor->names == NULL) {
+        return -1;
+    }
+    cursor->buf = result->buf;
+    result->buf = NULL;
+    result->buf_size = 0;
+    
+    size_t prefix_len = prefix != NULL ? strlen(prefix) : 0;
+    const char *name = cursor->buf;
+    int i;
+    for (i = 0; i < result->strings_count; ++i) {
+        if (strncmp(name, prefix != NULL ? prefix : "", prefix_len) == 0) {
+            cursor->names[cursor->count++] = name;
+        }
+        name += strlen(name) + 1;
+    }
+    if (sorted) {
+        qsort(cursor->names, cursor->count, sizeof(const char *),
+              _zk_name_cmp);
+    }
+    return 0;
+}
+
+/**
+ * children_cursor(handle, path, prefix, sorted, timeout): a cursor over
+ * the children of path and the return code; nil and the code on errors.
+ **/
+static int
+lua_zoo_children_cursor(lua_State *L)
+{
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
+    const char *path = luaL_checkstring(L, 2);
+    const char *prefix = luaL_optstring(L, 3, NULL);
+    bool sorted = lua_toboolean(L, 4);
+    double timeout = _zk_check_op_timeout(L, 5, handle);
+    
+    /* created first: nothing may raise while the reply is held */
+    struct zk_children_cursor *cursor = _zk_new_cursor(L);
+    
+    struct zk_data_result *cdata = _zk_data_result_init(L, handle, false,
+                                                        timeout);
+    _zk_op_begin(cdata, ZK_OP_GET_CHILDREN, path);
+    int ret = zoo_aget_children(handle->zh,
+                                path,
+                                0,
+                                _zk_strings_cb,
+                                cdata);
+    _zk_operation_wait(L, cdata, ret);
+    
+    int rc = cdata->result.rc;
+    if (rc == ZOK
+            && _zk_fill_cursor(cursor, &cdata->result, prefix, sorted) != 0) {
+        _zk_data_result_free(cdata);
+        return luaL_error(L, "zookeep: out of memory");
+    }
+    if (rc != ZOK) {
+        lua_pushnil(L);
+    }
+    _zk_data_result_free(cdata);
+    lua_pushinteger(L, rc);
+    return 2;
+}
+
+/** the next batch of at most n names, nil once all are taken **/
+static int
+lua_zoo_cursor_next(lua_State *L)
+{
+    struct zk_children_cursor *cursor = _zk_check_cursor(L, 1);
+    int n = luaL_checkint(L, 2);
+    if (n <= 0) {
+        return luaL_error(L, "batch size must be positive");
+    }
+    
+    int left = cursor->count - cursor->pos;
+    if (left <= 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+    if (n > left) {
+        n = left;
+    }
+    lua_createtable(L, n, 0);
+    int i;
+    for (i = 0; i < n; ++i) {
+        lua_pushstring(L, cursor->names[cursor->pos++]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+static int
+lua_zoo_cursor_count(lua_State *L)
+{
+    lua_pushinteger(L, _zk_check_cursor(L, 1)->count);
+    return 1;
+}
+
+static int
+lua_zoo_cursor_gc(lua_State *L)
+{
+    struct zk_children_cursor *cursor = _zk_check_cursor(L, 1);
+    free(cursor->names);
+    free(cursor->buf);
+    cursor->names = NULL;
+    cursor->buf = NULL;
+    cursor->count = 0;
+    return 0;
+}
+
+/***************** children cursor end *****************/
+
+/***************** sequence children begin *****************/
+
+/**
+ * Lock, queue and election recipes order the children of a directory by
+ * the 10-digit counter ZooKeeper appends to sequential nodes. Parsing and
+ * ordering them here spares the recipes a table of strings and a Lua sort
+ * on every event.
+ **/
+
+#define ZK_SEQUENCE_DIGITS 10
+
+struct zk_seq_entry {
+    const char *name;
+    int64_t seq;
+};
+
+/** the sequence suffix of name, or -1 if it has none **/
+static int64_t
+_zk_parse_sequence(const char *name, size_t len)
+{
+    if (len < ZK_SEQUENCE_DIGITS) {
+        return -1;
+    }
+    const char *p = name + len - ZK_SEQUENCE_DIGITS;
+    int64_t seq = 0;
+    int i;
+    for (i = 0; i < ZK_SEQUENCE_DIGITS; ++i) {
+        if (p[i] < '0' || p[i] > '9') {
+            return -1;
+        }
+        seq = seq * 10 + (p[i] - '0');
+    }
+    return seq;
+}
+
+static int
+_zk_seq_entry_cmp(const void *a,
+                  const void *b)
+{
+    const struct zk_seq_entry *ea = (const struct zk_seq_entry *) a;
+    const struct zk_seq_entry *eb = (const struct zk_seq_entry *) b;
+    if (ea->seq != eb->seq) {
+        return ea->seq < eb->seq ? -1 : 1;
+    }
+    return strcmp(ea->name, eb->name);
+}
+
+static inline bool
+_zk_seq_less(int64_t seq_a, const char *name_a,
+             int64_t seq_b, const char *name_b)
+{
+    return seq_a < seq_b || (seq_a == seq_b && strcmp(name_a, name_b) < 0);
 }
 
+/**
+ * the sequential names with prefix, ordered by their counters, into
+ * *entries_out (NULL if there are none). Returns their number, or -1
+ * if out of memory. Touches no Lua state.
+ **/
 static int
-_zk_handle_operation_result(lua_State *L,
-                            struct zk_data_result *cdata,
-                            int ret)
+_zk_sequence_sorted(const struct zk_result *result,
+                    const char *prefix,
+                    struct zk_seq_entry **entries_out)
 {
-    if (cdata == NULL) {
-        return 0;
+    size_t prefix_len = prefix != NULL ? strlen(prefix) : 0;
+    int count = result->strings_count > 0 ? result->strings_count : 0;
+    struct zk_seq_entry *entries = NULL;
+    *entries_out = NULL;
+    if (count > 0) {
+        entries = (struct zk_seq_entry *) malloc(
+            count * sizeof(struct zk_seq_entry));
+        if (entries == NULL) {
+            return -1;
+        }
     }
     
-    if (ret != ZOK) {
-        _zk_data_result_free(cdata);
-        return luaL_error(L, zerror(ret));
+    int n = 0;
+    const char *name = result->buf;
+    int i;
+    for (i = 0; i < count; ++i) {
+        size_t len = strlen(name);
+        if (prefix_len == 0 || strncmp(name, prefix, prefix_len) == 0) {
+            int64_t seq = _zk_parse_sequence(name, len);
+            if (seq >= 0) {
+                entries[n].name = name;
+                entries[n].seq = seq;
+                ++n;
+            }
+        }
+        name += len + 1;
     }
-    
-    ret = fiber_cond_wait(cdata->cond);
-    int ret_count = cdata->ret_count;
-    
-    _zk_data_result_free(cdata);
-    if (ret == 0) {
-        // wakeup
-        return ret_count;
+    if (n > 1) {
+        qsort(entries, n, sizeof(struct zk_seq_entry), _zk_seq_entry_cmp);
     }
-    return luaL_error(L, "unexpected error");
+    *entries_out = entries;
+    return n;
 }
 
-static int
-_zk_parse_watch_flag(lua_State *L, int index) {
-    if (lua_isnil(L, index)) {
-        return 0;
-    }
-    
-    if (lua_isboolean(L, index)) {
-        return lua_toboolean(L, index);
+/** the sequential child starting with tag, NULL if there is none **/
+static const char *
+_zk_find_sequence_node(const struct zk_result *result,
+                       const char *tag)
+{
+    size_t tag_len = strlen(tag);
+    const char *name = result->buf;
+    int i;
+    for (i = 0; i < result->strings_count; ++i) {
+        size_t len = strlen(name);
+        if (strncmp(name, tag, tag_len) == 0 &&
+            _zk_parse_sequence(name, len) >= 0) {
+            return name;
+        }
+        name += len + 1;
     }
-    
-    return luaL_error(L, "watch must either a nil or boolean");
+    return NULL;
 }
 
-static int
-lua_zoo_add_auth(lua_State *L)
+/**
+ * the first sequential name with prefix and the one right before node
+ * into *first_out and *pred_out; one pass, no sorting. Returns false if
+ * node is not a child. Touches no Lua state.
+ **/
+static bool
+_zk_sequence_position(const struct zk_result *result,
+                      const char *prefix,
+                      const char *node,
+                      const char **first_out,
+                      const char **pred_out)
 {
-    struct lua_zoo_handle *handle = _zk_check_zoo_handle(L, 1);
+    size_t prefix_len = prefix != NULL ? strlen(prefix) : 0;
+    int64_t node_seq = _zk_parse_sequence(node, strlen(node));
+    const char *first = NULL;
+    int64_t first_seq = -1;
+    const char *pred = NULL;
+    int64_t pred_seq = -1;
+    bool found = false;
     
-    size_t cert_len = 0;
-    const char *scheme = NULL;
-    const char *cert = NULL;
+    const char *name = result->buf;
+    int i;
+    for (i = 0; i < result->strings_count; ++i) {
+        size_t len = strlen(name);
+        const char *cur = name;
+        name += len + 1;
+        if (prefix_len != 0 && strncmp(cur, prefix, prefix_len) != 0) {
+            continue;
+        }
+        int64_t seq = _zk_parse_sequence(cur, len);
+        if (seq < 0) {
+            continue;
+        }
+        if (strcmp(cur, node) == 0) {
+            found = true;
+        }
+        if (first == NULL || _zk_seq_less(seq, cur, first_seq, first)) {
+            first = cur;
+            first_seq = seq;
+        }
+        if (_zk_seq_less(seq, cur, node_seq, node) &&
+            (pred == NULL || _zk_seq_less(pred_seq, pred, seq, cur))) {
+            pred = cur;
+            pred_seq = seq;
+        }
+    }
     
-    scheme = luaL_checkstring(L, 2);
-    cert = luaL_checklstring(L, 3, &cert_len);
-
-    struct zk_data_result *cdata = _zk_data_result_init(L);
-    int ret = zoo_add_auth(handle->zh,
-                           scheme,
-                           cert,
-                           cert_len,
-                           _zk_void_cb,
-                           cdata);
-    return _zk_handle_operation_result(L, cdata, ret);
+    *first_out = first;
+    *pred_out = pred;
+    return found;
 }
 
-static int
-lua_zoo_deterministic_conn_order(lua_State *L)
+/** what sequence_children returns, computed while holding the request **/
+struct zk_seq_reply {
+    int rc;
+    bool position;
+    struct zk_seq_entry *entries;
+    int n;
+    const char *first;
+    const char *pred;
+    const char *node;
+};
+
+static inline void
+_zk_push_optstring(lua_State *L, const char *s)
 {
-    int value = 0;
-   
-    if (!lua_isnil(L, 1) && lua_isboolean(L, 1)) {
-        value = lua_toboolean(L, 1);
+    if (s != NULL) {
+        lua_pushstring(L, s);
     } else {
-        return luaL_error(L, "invalid argument: boolean is required");
+        lua_pushnil(L);
     }
-    
-    zoo_deterministic_conn_order(value);
-    return 0;
 }
 
+/**
+ * pushes a zk_seq_reply. Runs under lua_pcall: the names point into the
+ * request's buffer, which must be freed even if pushing raises.
+ **/
 static int
-lua_zoo_zerror(lua_State *L)
+_zk_sequence_push_cb(lua_State *L)
 {
-    int code = luaL_checkint(L, -1);
-    const char *errstr = zerror(code);
-    lua_pushstring(L, errstr);
-    return 1;
+    const struct zk_seq_reply *reply =
+        (const struct zk_seq_reply *) lua_touserdata(L, 1);
+    lua_pop(L, 1);
+    
+    bool ok = reply->rc == ZOK;
+    if (!reply->position) {
+        if (ok) {
+            lua_createtable(L, reply->n, 0);
+            int i;
+            for (i = 0; i < reply->n; ++i) {
+                lua_pushstring(L, reply->entries[i].name);
+                lua_rawseti(L, -2, i + 1);
+            }
+        } else {
+            lua_pushnil(L);
+        }
+        lua_pushinteger(L, reply->rc);
+        return 2;
+    }
+    /* set only if the children were read, even when node is gone */
+    _zk_push_optstring(L, reply->first);
+    _zk_push_optstring(L, reply->pred);
+    lua_pushinteger(L, reply->rc);
+    _zk_push_optstring(L, ok ? reply->node : NULL);
+    return 4;
 }
 
+/**
+ * sequence_children(handle, path, prefix, node, timeout, node_is_tag).
+ * Without node: the sequential children with prefix in counter order and
+ * the return code. With node: the first of them, the one preceding node
+ * (nil if node is first), the return code, ZNONODE if node is gone, and
+ * the name of node. If node_is_tag, node is the child starting with it:
+ * this finds a node whose create reply was lost.
+ **/
 static int
-lua_zoo_create(lua_State *L)
+lua_zoo_sequence_children(lua_State *L)
 {
     struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
+    const char *path = luaL_checkstring(L, 2);
+    const char *prefix = luaL_optstring(L, 3, NULL);
+    const char *node = luaL_optstring(L, 4, NULL);
+    double timeout = _zk_check_op_timeout(L, 5, handle);
+    bool node_is_tag = lua_toboolean(L, 6);
     
-    const char *path = NULL;
-    size_t path_len = 0;
+    /* allocated before the request is taken, see _zk_sequence_push_cb */
+    lua_pushcfunction(L, _zk_sequence_push_cb);
     
-    const char *value = NULL;
-    size_t value_len = 0;
+    struct zk_data_result *cdata = _zk_data_result_init(L, handle, false,
+                                                        timeout);
+    _zk_op_begin(cdata, ZK_OP_GET_CHILDREN, path);
+    int ret = zoo_aget_children(handle->zh,
+                                path,
+                                0,
+                                _zk_strings_cb,
+                                cdata);
+    _zk_operation_wait(L, cdata, ret);
     
-    struct ACL_vector *zoo_acl;
-    int flags = 0;
-
-    path = luaL_checklstring(L, 2, &path_len);
-    if (!lua_isnil(L, 3)) {
-        value = luaL_checklstring(L, 3, &value_len);
+    int rc = cdata->result.rc;
+    bool position = node != NULL;
+    if (rc == ZOK && position && node_is_tag) {
+        node = _zk_find_sequence_node(&cdata->result, node);
+        if (node == NULL) {
+            rc = ZNONODE;
+        }
     }
-    zoo_acl = _zk_check_zoo_acl(L, 4);
-    if (!lua_isnil(L, 5)) {
-        flags = luaL_checkint(L, 5);
+    struct zk_seq_reply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.rc = rc;
+    reply.position = position;
+    reply.node = node;
+    if (rc == ZOK && !position) {
+        reply.n = _zk_sequence_sorted(&cdata->result, prefix,
+                                      &reply.entries);
+        if (reply.n < 0) {
+            _zk_data_result_free(cdata);
+            return luaL_error(L, "zookeep: out of memory");
+        }
+    } else if (rc == ZOK) {
+        if (!_zk_sequence_position(&cdata->result, prefix, node,
+                                   &reply.first, &reply.pred)) {
+            reply.rc = ZNONODE;
+        }
     }
     
-    struct zk_data_result *cdata = _zk_data_result_init(L);
-    int ret = zoo_acreate(handle->zh,
-                          path,
-                          value,
-                          value_len,
-                          zoo_acl,
-                          flags,
-                          _zk_string_cb,
-                          cdata);
-    return _zk_handle_operation_result(L, cdata, ret);
+    int nret = position ? 4 : 2;
+    lua_pushlightuserdata(L, &reply);
+    int err = lua_pcall(L, 1, nret, 0);
+    free(reply.entries);
+    _zk_data_result_free(cdata);
+    if (err != 0) {
+        return lua_error(L);
+    }
+    return nret;
 }
 
+/***************** sequence children end *****************/
+
 static int
-lua_zoo_delete(lua_State *L)
+_zoo_sync(lua_State *L,
+          bool async)
 {
     struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
     
     const char *path = NULL;
     size_t path_len = 0;
-    int version = -1;
 
     path = luaL_checklstring(L, 2, &path_len);
-    if (!lua_isnil(L, 3)) {
-        version = luaL_checkint(L, 3);
-    }
     
-    struct zk_data_result *cdata = _zk_data_result_init(L);
-    int ret = zoo_adelete(handle->zh,
-                          path,
-                          version,
-                          _zk_void_cb,
-                          cdata);
+    double timeout = _zk_check_op_timeout(L, 3, handle);
+    struct zk_data_result *cdata = _zk_data_result_init(L, handle, async,
+                                                        timeout);
+    _zk_op_begin(cdata, ZK_OP_SYNC, path);
+    int ret = zoo_async(handle->zh,
+                        path,
+                        _zk_string_cb,
+                        cdata);
     return _zk_handle_operation_result(L, cdata, ret);
 }
 
 static int
-lua_zoo_exists(lua_State *L)
+lua_zoo_sync(lua_State *L)
 {
-    struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
-    
-    const char *path = NULL;
-    size_t path_len = 0;
-    int watch = 0;
-
-    path = luaL_checklstring(L, 2, &path_len);
-    watch = _zk_parse_watch_flag(L, 3);
-    
-    struct zk_data_result *cdata = _zk_data_result_init(L);
-    int ret = zoo_aexists(handle->zh,
-                          path,
-                          watch,
-                          _zk_stat_cb,
-                          cdata);
-    return _zk_handle_operation_result(L, cdata, ret);
+    return _zoo_sync(L, false);
 }
 
-
 static int
-lua_zoo_get(lua_State *L)
+lua_zoo_sync_async(lua_State *L)
 {
-    struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
-    
-    const char *path = NULL;
-    size_t path_len = 0;
-    int watch = 0;
-
-    path = luaL_checklstring(L, 2, &path_len);
-    watch = _zk_parse_watch_flag(L, 3);
-    
-    struct zk_data_result *cdata = _zk_data_result_init(L);
-    int ret = zoo_aget(handle->zh,
-                       path,
-                       watch,
-                       _zk_data_cb,
-                       cdata);
-    return _zk_handle_operation_result(L, cdata, ret);
+    return _zoo_sync(L, true);
 }
 
 static int
-lua_zoo_set(lua_State *L)
+_zoo_wexists(lua_State *L,
+             bool async)
 {
+    int top = lua_gettop(L);
     struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
     
     const char *path = NULL;
     size_t path_len = 0;
-    
-    const char *value = NULL;
-    size_t value_len = 0;
-    
-    int version = -1;
+    int zhref = 0;
+    int cbref = 0;
+    int internal_ctx_ref = 0;
+    int user_ctx_ref = 0;
+    int has_user_ctx = 0;
+    struct zk_local_wctx *wctx;
 
+    /* check arguments */
     path = luaL_checklstring(L, 2, &path_len);
-    value = luaL_checklstring(L, 3, &value_len);
-    
-    if (!lua_isnil(L, 4)) {
-        version = luaL_checkint(L, 4);
+    luaL_checktype(L, 3, LUA_TFUNCTION); /* lua watcher function */
+    luaL_checktype(L, 4, LUA_TTABLE);  /* internal zookeep context */
+    if (top > 4 && !lua_isnil(L, 5)) {
+        has_user_ctx = 1; /* user's context */
     }
+    double timeout = _zk_check_op_timeout(L, 6, handle);
     
-    struct zk_data_result *cdata = _zk_data_result_init(L);
-    int ret = zoo_aset(handle->zh,
-                       path,
-                       value,
-                       value_len,
-                       version,
-                       _zk_stat_cb,
-                       cdata);
-    return _zk_handle_operation_result(L, cdata, ret);
-}
-
-static int
-lua_zoo_get_children(lua_State *L)
-{
-    struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
+    /* saving references to context objects */
+    lua_pushvalue(L, 1);
+    zhref = luaL_ref(L, LUA_REGISTRYINDEX);
     
-    const char *path = NULL;
-    size_t path_len = 0;
-    int watch = 0;
-
-    path = luaL_checklstring(L, 2, &path_len);
-    watch = _zk_parse_watch_flag(L, 3);
+    lua_pushvalue(L, 3);
+    cbref = luaL_ref(L, LUA_REGISTRYINDEX);
     
-    struct zk_data_result *cdata = _zk_data_result_init(L);
-    int ret = zoo_aget_children(handle->zh,
-                                path,
-                                watch,
-                                _zk_strings_cb,
-                                cdata);
+    lua_pushvalue(L, 4);
+    internal_ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    
+    if (has_user_ctx) {
+        lua_pushvalue(L, 5);
+        user_ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    wctx = _zk_local_wctx_init(L, handle, zhref, cbref,
+                               internal_ctx_ref, user_ctx_ref);
+    
+    /* make request */
+    struct zk_data_result *cdata = _zk_data_result_init(L, handle, async,
+                                                        timeout);
+    _zk_op_begin(cdata, ZK_OP_WEXISTS, path);
+    cdata->wctx = wctx;
+    cdata->wctx_on_nonode = true;
+    int ret = zoo_awexists(handle->zh,
+                           path,
+                           local_watcher_dispatch,
+                           (void *) wctx,
+                           _zk_stat_cb,
+                           cdata);
     return _zk_handle_operation_result(L, cdata, ret);
 }
 
 static int
-lua_zoo_get_children2(lua_State *L)
+lua_zoo_wexists(lua_State *L)
 {
-    struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
-    
-    const char *path = NULL;
-    size_t path_len = 0;
-    int watch = 0;
-
-    path = luaL_checklstring(L, 2, &path_len);
-    watch = _zk_parse_watch_flag(L, 3);
-    
-    struct zk_data_result *cdata = _zk_data_result_init(L);
-    int ret = zoo_aget_children2(handle->zh,
-                                 path,
-                                 watch,
-                                 _zk_strings_stat_cb,
-                                 cdata);
-    return _zk_handle_operation_result(L, cdata, ret);
+    return _zoo_wexists(L, false);
 }
 
 static int
-lua_zoo_sync(lua_State *L)
+lua_zoo_wexists_async(lua_State *L)
+{
+    return _zoo_wexists(L, true);
+}
+
+static int
+_zoo_wget(lua_State *L,
+          bool async)
 {
+    int top = lua_gettop(L);
     struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
     
     const char *path = NULL;
     size_t path_len = 0;
+    int zhref = 0;
+    int cbref = 0;
+    int internal_ctx_ref = 0;
+    int user_ctx_ref = 0;
+    int has_user_ctx = 0;
+    struct zk_local_wctx *wctx;
 
-    path = luaL_checklstring(L, 2, &path_len);
+    /* check arguments */
+    path = luaL_checklstring(L, 2, &path_len); /* path */
+    luaL_checktype(L, 3, LUA_TFUNCTION); /* lua watcher function */
+    luaL_checktype(L, 4, LUA_TTABLE);  /* internal zookeep context */
+    if (top > 4 && !lua_isnil(L, 5)) {
+        has_user_ctx = 1; /* user's context */
+    }
+    double timeout = _zk_check_op_timeout(L, 6, handle);
     
-    struct zk_data_result *cdata = _zk_data_result_init(L);
-    int ret = zoo_async(handle->zh,
+    /* saving references to context objects */
+    lua_pushvalue(L, 1);
+    zhref = luaL_ref(L, LUA_REGISTRYINDEX);
+    
+    lua_pushvalue(L, 3);
+    cbref = luaL_ref(L, LUA_REGISTRYINDEX);
+    
+    lua_pushvalue(L, 4);
+    internal_ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    
+    if (has_user_ctx) {
+        lua_pushvalue(L, 5);
+        user_ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    wctx = _zk_local_wctx_init(L, handle, zhref, cbref,
+                               internal_ctx_ref, user_ctx_ref);
+    
+    /* make request */
+    struct zk_data_result *cdata = _zk_data_result_init(L, handle, async,
+                                                        timeout);
+    _zk_op_begin(cdata, ZK_OP_WGET, path);
+    cdata->wctx = wctx;
+    int ret = zoo_awget(handle->zh,
                         path,
-                        _zk_string_cb,
+                        local_watcher_dispatch,
+                        (void *) wctx,
+                        _zk_data_cb,
                         cdata);
     return _zk_handle_operation_result(L, cdata, ret);
 }
 
 static int
-lua_zoo_wexists(lua_State *L)
+lua_zoo_wget(lua_State *L)
+{
+    return _zoo_wget(L, false);
+}
+
+static int
+lua_zoo_wget_async(lua_State *L)
+{
+    return _zoo_wget(L, true);
+}
+
+static int
+_zoo_wget_children(lua_State *L,
+                   bool async)
 {
     int top = lua_gettop(L);
     struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
@@ -1302,12 +4359,13 @@ lua_zoo_wexists(lua_State *L)
     struct zk_local_wctx *wctx;
 
     /* check arguments */
-    path = luaL_checklstring(L, 2, &path_len);
+    path = luaL_checklstring(L, 2, &path_len); /* path */
     luaL_checktype(L, 3, LUA_TFUNCTION); /* lua watcher function */
     luaL_checktype(L, 4, LUA_TTABLE);  /* internal zookeep context */
     if (top > 4 && !lua_isnil(L, 5)) {
         has_user_ctx = 1; /* user's context */
     }
+    double timeout = _zk_check_op_timeout(L, 6, handle);
     
     /* saving references to context objects */
     lua_pushvalue(L, 1);
@@ -1323,22 +4381,38 @@ lua_zoo_wexists(lua_State *L)
         lua_pushvalue(L, 5);
         user_ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     }
-    wctx = _zk_local_wctx_init(L, zhref, cbref,
+    wctx = _zk_local_wctx_init(L, handle, zhref, cbref,
                                internal_ctx_ref, user_ctx_ref);
     
     /* make request */
-    struct zk_data_result *cdata = _zk_data_result_init(L);
-    int ret = zoo_awexists(handle->zh,
-                           path,
-                           local_watcher_dispatch,
-                           (void *) wctx,
-                           _zk_stat_cb,
-                           cdata);
+    struct zk_data_result *cdata = _zk_data_result_init(L, handle, async,
+                                                        timeout);
+    _zk_op_begin(cdata, ZK_OP_WGET_CHILDREN, path);
+    cdata->wctx = wctx;
+    int ret = zoo_awget_children(handle->zh,
+                                 path,
+                                 local_watcher_dispatch,
+                                 (void *) wctx,
+                                 _zk_strings_cb,
+                                 cdata);
     return _zk_handle_operation_result(L, cdata, ret);
 }
 
 static int
-lua_zoo_wget(lua_State *L)
+lua_zoo_wget_children(lua_State *L)
+{
+    return _zoo_wget_children(L, false);
+}
+
+static int
+lua_zoo_wget_children_async(lua_State *L)
+{
+    return _zoo_wget_children(L, true);
+}
+
+static int
+_zoo_wget_children2(lua_State *L,
+                    bool async)
 {
     int top = lua_gettop(L);
     struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
@@ -1359,6 +4433,7 @@ lua_zoo_wget(lua_State *L)
     if (top > 4 && !lua_isnil(L, 5)) {
         has_user_ctx = 1; /* user's context */
     }
+    double timeout = _zk_check_op_timeout(L, 6, handle);
     
     /* saving references to context objects */
     lua_pushvalue(L, 1);
@@ -1374,166 +4449,713 @@ lua_zoo_wget(lua_State *L)
         lua_pushvalue(L, 5);
         user_ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     }
-    wctx = _zk_local_wctx_init(L, zhref, cbref,
+    wctx = _zk_local_wctx_init(L, handle, zhref, cbref,
                                internal_ctx_ref, user_ctx_ref);
     
     /* make request */
-    struct zk_data_result *cdata = _zk_data_result_init(L);
-    int ret = zoo_awget(handle->zh,
-                        path,
-                        local_watcher_dispatch,
-                        (void *) wctx,
-                        _zk_data_cb,
-                        cdata);
+    struct zk_data_result *cdata = _zk_data_result_init(L, handle, async,
+                                                        timeout);
+    _zk_op_begin(cdata, ZK_OP_WGET_CHILDREN2, path);
+    cdata->wctx = wctx;
+    int ret = zoo_awget_children2(handle->zh,
+                                  path,
+                                  local_watcher_dispatch,
+                                  (void *) wctx,
+                                  _zk_strings_stat_cb,
+                                  cdata);
+    return _zk_handle_operation_result(L, cdata, ret);
+}
+
+static int
+lua_zoo_wget_children2(lua_State *L)
+{
+    return _zoo_wget_children2(L, false);
+}
+
+static int
+lua_zoo_wget_children2_async(lua_State *L)
+{
+    return _zoo_wget_children2(L, true);
+}
+
+static int
+_zoo_get_acl(lua_State *L,
+             bool async)
+{
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
+    
+    const char *path = NULL;
+    size_t path_len = 0;
+
+    path = luaL_checklstring(L, 2, &path_len);
+    
+    double timeout = _zk_check_op_timeout(L, 3, handle);
+    struct zk_data_result *cdata = _zk_data_result_init(L, handle, async,
+                                                        timeout);
+    _zk_op_begin(cdata, ZK_OP_GET_ACL, path);
+    int ret = zoo_aget_acl(handle->zh,
+                           path,
+                           _zk_acl_cb,
+                           cdata);
+    return _zk_handle_operation_result(L, cdata, ret);
+}
+
+static int
+lua_zoo_get_acl(lua_State *L)
+{
+    return _zoo_get_acl(L, false);
+}
+
+static int
+lua_zoo_get_acl_async(lua_State *L)
+{
+    return _zoo_get_acl(L, true);
+}
+
+static int
+_zoo_set_acl(lua_State *L,
+             bool async)
+{
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
+    
+    const char *path = NULL;
+    size_t path_len = 0;
+    int version = -1;
+    struct ACL_vector *zoo_acl;
+    
+    path = luaL_checklstring(L, 2, &path_len);
+    if (!lua_isnil(L, 3)) {
+        version = luaL_checkint(L, 3);
+    }
+    zoo_acl = _zk_check_zoo_acl(L, 4);
+    
+    double timeout = _zk_check_op_timeout(L, 5, handle);
+    struct zk_data_result *cdata = _zk_data_result_init(L, handle, async,
+                                                        timeout);
+    _zk_op_begin(cdata, ZK_OP_SET_ACL, path);
+    int ret = zoo_aset_acl(handle->zh,
+                           path,
+                           version,
+                           zoo_acl,
+                           _zk_void_cb,
+                           cdata);
     return _zk_handle_operation_result(L, cdata, ret);
 }
 
-static int
-lua_zoo_wget_children(lua_State *L)
-{
-    int top = lua_gettop(L);
-    struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
-    
-    const char *path = NULL;
-    size_t path_len = 0;
-    int zhref = 0;
-    int cbref = 0;
-    int internal_ctx_ref = 0;
-    int user_ctx_ref = 0;
-    int has_user_ctx = 0;
-    struct zk_local_wctx *wctx;
+static int
+lua_zoo_set_acl(lua_State *L)
+{
+    return _zoo_set_acl(L, false);
+}
+
+static int
+lua_zoo_set_acl_async(lua_State *L)
+{
+    return _zoo_set_acl(L, true);
+}
+
+/***************** get_many begin *****************/
+
+#define ZK_GET_MANY_DEFAULT_INFLIGHT 1000
+
+static struct zk_batch *
+_zk_batch_new(struct lua_zoo_handle *handle,
+              int count)
+{
+    struct zk_batch *batch = (struct zk_batch *) malloc(sizeof(struct zk_batch));
+    if (batch == NULL) {
+        return NULL;
+    }
+    batch->items = (struct zk_data_result *) calloc(
+        count, sizeof(struct zk_data_result));
+    batch->done = (int *) calloc(count, sizeof(int));
+    if (batch->items == NULL || batch->done == NULL) {
+        free(batch->items);
+        free(batch->done);
+        free(batch);
+        return NULL;
+    }
+    
+    batch->count = count;
+    batch->done_count = 0;
+    batch->inflight = 0;
+    batch->abandoned = false;
+    batch->cond = fiber_cond_new();
+    
+    int i;
+    for (i = 0; i < count; ++i) {
+        struct zk_data_result *item = &batch->items[i];
+        item->handle = handle;
+        item->timeout = -1;
+        item->batch = batch;
+        item->batch_index = i + 1;
+    }
+    return batch;
+}
+
+static void
+_zk_batch_free(struct zk_batch *batch)
+{
+    int i;
+    for (i = 0; i < batch->count; ++i) {
+        free(batch->items[i].result.buf);
+    }
+    fiber_cond_delete(batch->cond);
+    free(batch->done);
+    free(batch->items);
+    free(batch);
+}
+
+/**
+ * pack value, stat and rc from the top of the stack into
+ * results[keys[index]].
+ **/
+static void
+_zk_batch_store(lua_State *L,
+                int results_index,
+                int keys_index,
+                int index)
+{
+    lua_createtable(L, 0, 3);
+    lua_insert(L, -4);
+    lua_setfield(L, -4, "rc");
+    lua_setfield(L, -3, "stat");
+    lua_setfield(L, -2, "value");
+    
+    lua_rawgeti(L, keys_index, index);
+    lua_insert(L, -2);
+    lua_rawset(L, results_index);
+}
+
+static void
+_zk_batch_complete(struct zk_data_result *cdata)
+{
+    struct zk_batch *batch = cdata->batch;
+    
+    batch->done[batch->done_count++] = cdata->batch_index;
+    batch->inflight--;
+    if (batch->abandoned) {
+        if (batch->inflight == 0) {
+            _zk_batch_free(batch);
+        }
+        return;
+    }
+    fiber_cond_signal(batch->cond);
+}
+
+/* move the replies received so far into the results table */
+static void
+_zk_batch_collect(lua_State *L,
+                  struct zk_batch *batch,
+                  int results_index,
+                  int keys_index)
+{
+    int i;
+    for (i = 0; i < batch->done_count; ++i) {
+        int index = batch->done[i];
+        struct zk_data_result *item = &batch->items[index - 1];
+        
+        _zk_result_push(L, item);
+        _zk_batch_store(L, results_index, keys_index, index);
+        
+        /* the value is in Lua now, keep the memory low */
+        free(item->result.buf);
+        item->result.buf = NULL;
+        item->result.buf_size = 0;
+    }
+    batch->done_count = 0;
+}
+
+static int
+_zk_batch_collect_cb(lua_State *L)
+{
+    struct zk_batch *batch = (struct zk_batch *) lua_touserdata(L, 3);
+    _zk_batch_collect(L, batch, 1, 2);
+    return 0;
+}
+
+/* give the batch up: it is freed now or by the last completion */
+static void
+_zk_batch_abandon(struct zk_batch *batch)
+{
+    if (batch->inflight == 0) {
+        _zk_batch_free(batch);
+    } else {
+        batch->abandoned = true;
+    }
+}
+
+/**
+ * collect under a protected call, the function is at collect_index.
+ * pushing the results may run out of memory; the batch must not leak
+ * then, nor be left for completions to write into unowned.
+ **/
+static void
+_zk_batch_collect_safe(lua_State *L,
+                       struct zk_batch *batch,
+                       int collect_index,
+                       int results_index,
+                       int keys_index)
+{
+    lua_pushvalue(L, collect_index);
+    lua_pushvalue(L, results_index);
+    lua_pushvalue(L, keys_index);
+    lua_pushlightuserdata(L, batch);
+    if (lua_pcall(L, 3, 0, 0) != 0) {
+        _zk_batch_abandon(batch);
+        lua_error(L);
+    }
+}
+
+/**
+ * fetch data and stat of many nodes, keeping up to max_inflight
+ * requests in flight at once.
+ **/
+static int
+lua_zoo_get_many(lua_State *L)
+{
+    struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
+    
+    int max_inflight = ZK_GET_MANY_DEFAULT_INFLIGHT;
+    int watch = 0;
+    int count = 0;
+    int i;
+    
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if (!lua_isnoneornil(L, 3)) {
+        max_inflight = luaL_checkint(L, 3);
+        if (max_inflight <= 0) {
+            return luaL_error(L, "max_inflight must be positive");
+        }
+    }
+    watch = _zk_parse_watch_flag(L, 4);
+    double timeout = _zk_check_op_timeout(L, 5, handle);
+    double deadline = fiber_time() + timeout;
+    
+    count = lua_objlen(L, 2);
+    for (i = 1; i <= count; ++i) {
+        lua_rawgeti(L, 2, i);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            return luaL_error(L, "get_many: path #%d must be a string", i);
+        }
+        lua_pop(L, 1);
+    }
+    
+    lua_settop(L, 5);
+    lua_createtable(L, 0, count);
+    int results_index = lua_gettop(L);
+    if (count == 0) {
+        return 1;
+    }
+    lua_pushcfunction(L, _zk_batch_collect_cb);
+    int collect_index = lua_gettop(L);
+    lua_checkstack(L, 8);
+    
+    struct zk_batch *batch = _zk_batch_new(handle, count);
+    if (batch == NULL) {
+        return luaL_error(L, "zookeep: out of memory");
+    }
+    
+    int next = 0;
+    while (true) {
+        while (next < count && batch->inflight < max_inflight) {
+            lua_rawgeti(L, 2, next + 1);
+            _zk_op_begin(&batch->items[next], ZK_OP_GET, lua_tostring(L, -1));
+            int ret = zoo_aget(handle->zh,
+                               lua_tostring(L, -1),
+                               watch,
+                               _zk_data_cb,
+                               &batch->items[next]);
+            lua_pop(L, 1);
+            
+            if (ret == ZOK) {
+                batch->inflight++;
+            } else {
+                /* collected with the replies, nothing may raise here */
+                struct zk_data_result *item = &batch->items[next];
+                _zk_op_end(item, ret);
+                item->result.kind = ZK_RESULT_DATA;
+                item->result.rc = ret;
+                _zk_result_set_stat(&item->result, NULL);
+                _zk_result_set_value(&item->result, NULL, -1);
+                batch->done[batch->done_count++] = next + 1;
+            }
+            next++;
+        }
+        
+        _zk_batch_collect_safe(L, batch, collect_index, results_index, 2);
+        if (batch->inflight == 0) {
+            break;
+        }
+        _zk_process_wakeup(handle);
+        
+        int rc = ZOK;
+        if (timeout < 0) {
+            fiber_cond_wait(batch->cond);
+        } else if (deadline - fiber_time() > 0) {
+            fiber_cond_wait_timeout(batch->cond, deadline - fiber_time());
+        } else {
+            rc = ZOPERATIONTIMEOUT;
+        }
+        if (rc == ZOK && fiber_is_cancelled()) {
+            rc = ZSYSTEMERROR;
+        }
+        
+        if (rc == ZSYSTEMERROR) {
+            _zk_batch_abandon(batch);
+            return _zk_wait_error(L, rc);
+        }
+        if (rc == ZOPERATIONTIMEOUT) {
+            _zk_batch_collect_safe(L, batch, collect_index, results_index, 2);
+            _zk_batch_abandon(batch);
+            
+            /* late replies are dropped, the paths without one time out */
+            for (i = 1; i <= count; ++i) {
+                lua_rawgeti(L, 2, i);
+                lua_rawget(L, results_index);
+                bool missing = lua_isnil(L, -1);
+                lua_pop(L, 1);
+                if (missing) {
+                    lua_pushnil(L);
+                    _zk_build_stat(L, NULL);
+                    lua_pushinteger(L, ZOPERATIONTIMEOUT);
+                    _zk_batch_store(L, results_index, 2, i);
+                }
+            }
+            lua_pushvalue(L, results_index);
+            return 1;
+        }
+    }
+    
+    _zk_batch_free(batch);
+    lua_pushvalue(L, results_index);
+    return 1;
+}
+
+/***************** get_many end *****************/
 
-    /* check arguments */
-    path = luaL_checklstring(L, 2, &path_len); /* path */
-    luaL_checktype(L, 3, LUA_TFUNCTION); /* lua watcher function */
-    luaL_checktype(L, 4, LUA_TTABLE);  /* internal zookeep context */
-    if (top > 4 && !lua_isnil(L, 5)) {
-        has_user_ctx = 1; /* user's context */
+/***************** multi begin *****************/
+
+static enum zk_multi_op
+_zk_parse_multi_op(lua_State *L,
+                   int index,
+                   int op_index)
+{
+    if (!lua_istable(L, index)) {
+        luaL_error(L, "multi: op #%d must be a table", op_index);
     }
     
-    /* saving references to context objects */
-    lua_pushvalue(L, 1);
-    zhref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_getfield(L, index, "path");
+    if (!lua_isstring(L, -1)) {
+        luaL_error(L, "multi: op #%d: path must be a string", op_index);
+    }
+    lua_pop(L, 1);
     
-    lua_pushvalue(L, 3);
-    cbref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_getfield(L, index, "version");
+    if (!lua_isnil(L, -1) && !lua_isnumber(L, -1)) {
+        luaL_error(L, "multi: op #%d: version must be a number", op_index);
+    }
+    lua_pop(L, 1);
     
-    lua_pushvalue(L, 4);
-    internal_ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_getfield(L, index, "value");
+    if (!lua_isnil(L, -1) && !lua_isstring(L, -1)) {
+        luaL_error(L, "multi: op #%d: value must be a string", op_index);
+    }
+    lua_pop(L, 1);
     
-    if (has_user_ctx) {
-        lua_pushvalue(L, 5);
-        user_ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_getfield(L, index, "op");
+    const char *op = lua_tostring(L, -1);
+    enum zk_multi_op kind;
+    if (op == NULL) {
+        return luaL_error(L, "multi: op #%d: op must be a string", op_index);
+    } else if (strcmp(op, "create") == 0) {
+        kind = ZK_MULTI_OP_CREATE;
+    } else if (strcmp(op, "delete") == 0) {
+        kind = ZK_MULTI_OP_DELETE;
+    } else if (strcmp(op, "set") == 0) {
+        kind = ZK_MULTI_OP_SET;
+    } else if (strcmp(op, "check") == 0) {
+        kind = ZK_MULTI_OP_CHECK;
+    } else {
+        return luaL_error(L, "multi: op #%d: unknown op '%s'", op_index, op);
     }
-    wctx = _zk_local_wctx_init(L, zhref, cbref,
-                               internal_ctx_ref, user_ctx_ref);
+    lua_pop(L, 1);
     
-    /* make request */
-    struct zk_data_result *cdata = _zk_data_result_init(L);
-    int ret = zoo_awget_children(handle->zh,
-                                 path,
-                                 local_watcher_dispatch,
-                                 (void *) wctx,
-                                 _zk_strings_cb,
-                                 cdata);
-    return _zk_handle_operation_result(L, cdata, ret);
+    if (kind == ZK_MULTI_OP_CREATE) {
+        lua_getfield(L, index, "acl");
+        if (!lua_isnil(L, -1)) {
+            _zk_check_zoo_acl(L, lua_gettop(L));
+        }
+        lua_pop(L, 1);
+        
+        lua_getfield(L, index, "flags");
+        if (!lua_isnil(L, -1) && !lua_isnumber(L, -1)) {
+            luaL_error(L, "multi: op #%d: flags must be a number", op_index);
+        }
+        lua_pop(L, 1);
+    }
+    return kind;
 }
 
-static int
-lua_zoo_wget_children2(lua_State *L)
+static struct zk_multi_ctx *
+_zk_multi_ctx_new(int count)
 {
-    int top = lua_gettop(L);
-    struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
-    
-    const char *path = NULL;
-    size_t path_len = 0;
-    int zhref = 0;
-    int cbref = 0;
-    int internal_ctx_ref = 0;
-    int user_ctx_ref = 0;
-    int has_user_ctx = 0;
-    struct zk_local_wctx *wctx;
+    struct zk_multi_ctx *multi =
+        (struct zk_multi_ctx *) calloc(1, sizeof(struct zk_multi_ctx));
+    if (multi == NULL) {
+        return NULL;
+    }
+    multi->count = count;
+    multi->kinds = calloc(count, sizeof(enum zk_multi_op));
+    multi->ops = calloc(count, sizeof(zoo_op_t));
+    multi->results = calloc(count, sizeof(zoo_op_result_t));
+    multi->stats = calloc(count, sizeof(struct Stat));
+    multi->path_buffers = calloc(count, sizeof(char *));
+    if (count > 0 && (multi->kinds == NULL || multi->ops == NULL
+                      || multi->results == NULL || multi->stats == NULL
+                      || multi->path_buffers == NULL)) {
+        _zk_multi_ctx_free(multi);
+        return NULL;
+    }
+    return multi;
+}
 
-    /* check arguments */
-    path = luaL_checklstring(L, 2, &path_len); /* path */
-    luaL_checktype(L, 3, LUA_TFUNCTION); /* lua watcher function */
-    luaL_checktype(L, 4, LUA_TTABLE);  /* internal zookeep context */
-    if (top > 4 && !lua_isnil(L, 5)) {
-        has_user_ctx = 1; /* user's context */
+static void
+_zk_multi_ctx_free(struct zk_multi_ctx *multi)
+{
+    if (multi == NULL) {
+        return;
     }
     
-    /* saving references to context objects */
-    lua_pushvalue(L, 1);
-    zhref = luaL_ref(L, LUA_REGISTRYINDEX);
-    
-    lua_pushvalue(L, 3);
-    cbref = luaL_ref(L, LUA_REGISTRYINDEX);
-    
-    lua_pushvalue(L, 4);
-    internal_ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    
-    if (has_user_ctx) {
-        lua_pushvalue(L, 5);
-        user_ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    int i;
+    if (multi->path_buffers != NULL) {
+        for (i = 0; i < multi->count; ++i) {
+            free(multi->path_buffers[i]);
+        }
+    }
+    free(multi->path_buffers);
+    free(multi->stats);
+    free(multi->results);
+    free(multi->ops);
+    free(multi->kinds);
+    free(multi);
+}
+
+/**
+ * true for the codes the server fails a single op of a multi with.
+ * Anything else, e.g. ZCLOSING or ZSESSIONEXPIRED, comes from the client
+ * and leaves the per-op results unset.
+ **/
+static bool
+_zk_multi_op_error(int rc)
+{
+    switch (rc) {
+    case ZNONODE:
+    case ZNOAUTH:
+    case ZBADVERSION:
+    case ZNOCHILDRENFOREPHEMERALS:
+    case ZNODEEXISTS:
+    case ZNOTEMPTY:
+    case ZINVALIDACL:
+        return true;
+    default:
+        return false;
     }
-    wctx = _zk_local_wctx_init(L, zhref, cbref,
-                               internal_ctx_ref, user_ctx_ref);
-    
-    /* make request */
-    struct zk_data_result *cdata = _zk_data_result_init(L);
-    int ret = zoo_awget_children2(handle->zh,
-                                  path,
-                                  local_watcher_dispatch,
-                                  (void *) wctx,
-                                  _zk_strings_stat_cb,
-                                  cdata);
-    return _zk_handle_operation_result(L, cdata, ret);
 }
 
+/**
+ * build the per-op results table. Per-op results are only filled in
+ * when the server replied.
+ **/
 static int
-lua_zoo_get_acl(lua_State *L)
+_zk_multi_push_results(lua_State *L,
+                       struct zk_multi_ctx *multi,
+                       int rc)
 {
-    struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
+    if (multi == NULL || !(rc == ZOK || _zk_multi_op_error(rc))) {
+        lua_pushnil(L);
+        return 1;
+    }
     
-    const char *path = NULL;
-    size_t path_len = 0;
+    int i;
+    lua_createtable(L, multi->count, 0);
+    for (i = 0; i < multi->count; ++i) {
+        zoo_op_result_t *res = &multi->results[i];
+        
+        lua_newtable(L);
+        lua_pushstring(L, "rc");
+        lua_pushinteger(L, res->err);
+        lua_settable(L, -3);
+        
+        if (res->err == ZOK
+                && multi->kinds[i] == ZK_MULTI_OP_CREATE) {
+            lua_pushstring(L, "path");
+            lua_pushstring(L, res->value);
+            lua_settable(L, -3);
+        } else if (res->err == ZOK
+                && multi->kinds[i] == ZK_MULTI_OP_SET) {
+            lua_pushstring(L, "stat");
+            _zk_build_stat(L, &multi->stats[i]);
+            lua_settable(L, -3);
+        }
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
 
-    path = luaL_checklstring(L, 2, &path_len);
-    
-    struct zk_data_result *cdata = _zk_data_result_init(L);
-    int ret = zoo_aget_acl(handle->zh,
-                           path,
-                           _zk_acl_cb,
-                           cdata);
-    return _zk_handle_operation_result(L, cdata, ret);
+/**
+ * fill in zoo_op_t array from a lua table of ops. All ops must have been
+ * validated with _zk_parse_multi_op() already, so this never raises.
+ * Paths and values are borrowed from the table: zoo_amulti() serializes
+ * them before returning.
+ **/
+static int
+_zk_multi_ctx_fill(lua_State *L,
+                   int ops_index,
+                   struct ACL_vector *default_acl,
+                   struct zk_multi_ctx *multi)
+{
+    int i;
+    for (i = 0; i < multi->count; ++i) {
+        zoo_op_t *op = &multi->ops[i];
+        const char *path = NULL;
+        size_t path_len = 0;
+        const char *value = NULL;
+        size_t value_len = 0;
+        int version = -1;
+        
+        lua_rawgeti(L, ops_index, i + 1);
+        
+        lua_getfield(L, -1, "path");
+        path = lua_tolstring(L, -1, &path_len);
+        lua_pop(L, 1);
+        
+        lua_getfield(L, -1, "value");
+        if (!lua_isnil(L, -1)) {
+            value = lua_tolstring(L, -1, &value_len);
+        }
+        lua_pop(L, 1);
+        
+        lua_getfield(L, -1, "version");
+        if (!lua_isnil(L, -1)) {
+            version = (int) lua_tointeger(L, -1);
+        }
+        lua_pop(L, 1);
+        
+        switch (multi->kinds[i]) {
+        case ZK_MULTI_OP_CREATE: {
+            struct ACL_vector *acl = default_acl;
+            int flags = 0;
+            
+            lua_getfield(L, -1, "acl");
+            if (!lua_isnil(L, -1)) {
+                acl = (struct ACL_vector *) lua_touserdata(L, -1);
+            }
+            lua_pop(L, 1);
+            
+            lua_getfield(L, -1, "flags");
+            if (!lua_isnil(L, -1)) {
+                flags = (int) lua_tointeger(L, -1);
+            }
+            lua_pop(L, 1);
+            
+            /* room for a sequence suffix */
+            int buffer_len = path_len + 16;
+            multi->path_buffers[i] = (char *) malloc(buffer_len);
+            if (multi->path_buffers[i] == NULL) {
+                lua_pop(L, 1);
+                return -1;
+            }
+            zoo_create_op_init(op, path, value, value_len, acl, flags,
+                               multi->path_buffers[i], buffer_len);
+            break;
+        }
+        case ZK_MULTI_OP_DELETE:
+            zoo_delete_op_init(op, path, version);
+            break;
+        case ZK_MULTI_OP_SET:
+            zoo_set_op_init(op, path, value, value_len, version,
+                            &multi->stats[i]);
+            break;
+        case ZK_MULTI_OP_CHECK:
+            zoo_check_op_init(op, path, version);
+            break;
+        }
+        
+        lua_pop(L, 1);
+    }
+    return 0;
 }
 
 static int
-lua_zoo_set_acl(lua_State *L)
+_zoo_multi(lua_State *L,
+           bool async)
 {
     struct lua_zoo_handle *handle = _zk_check_zoo_handle_connected(L, 1);
     
-    const char *path = NULL;
-    size_t path_len = 0;
-    int version = -1;
-    struct ACL_vector *zoo_acl;
+    struct ACL_vector *default_acl;
+    struct zk_multi_ctx *multi;
+    int count = 0;
+    int i;
     
-    path = luaL_checklstring(L, 2, &path_len);
-    if (!lua_isnil(L, 3)) {
-        version = luaL_checkint(L, 3);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    default_acl = _zk_check_zoo_acl(L, 3);
+    
+    count = lua_objlen(L, 2);
+    if (count == 0) {
+        return luaL_error(L, "multi: at least one op is required");
     }
-    zoo_acl = _zk_check_zoo_acl(L, 4);
     
-    struct zk_data_result *cdata = _zk_data_result_init(L);
-    int ret = zoo_aset_acl(handle->zh,
-                           path,
-                           version,
-                           zoo_acl,
-                           _zk_void_cb,
-                           cdata);
+    /* validate everything first: nothing is allocated yet */
+    for (i = 0; i < count; ++i) {
+        lua_rawgeti(L, 2, i + 1);
+        _zk_parse_multi_op(L, lua_gettop(L), i + 1);
+        lua_pop(L, 1);
+    }
+    
+    double timeout = _zk_check_op_timeout(L, 4, handle);
+    struct zk_data_result *cdata = _zk_data_result_init(L, handle, async,
+                                                        timeout);
+    multi = _zk_multi_ctx_new(count);
+    if (multi == NULL) {
+        _zk_data_result_free(cdata);
+        return luaL_error(L, "zookeep: out of memory");
+    }
+    cdata->multi = multi;
+    for (i = 0; i < count; ++i) {
+        lua_rawgeti(L, 2, i + 1);
+        multi->kinds[i] = _zk_parse_multi_op(L, lua_gettop(L), i + 1);
+        lua_pop(L, 1);
+    }
+    if (_zk_multi_ctx_fill(L, 2, default_acl, multi) != 0) {
+        _zk_data_result_free(cdata);
+        return luaL_error(L, "zookeep: out of memory");
+    }
+    
+    _zk_op_begin(cdata, ZK_OP_MULTI, NULL);
+    int ret = zoo_amulti(handle->zh,
+                         count,
+                         multi->ops,
+                         multi->results,
+                         _zk_multi_cb,
+                         cdata);
     return _zk_handle_operation_result(L, cdata, ret);
 }
 
+static int
+lua_zoo_multi(lua_State *L)
+{
+    return _zoo_multi(L, false);
+}
+
+static int
+lua_zoo_multi_async(lua_State *L)
+{
+    return _zoo_multi(L, true);
+}
+
+/***************** multi end *****************/
+
 
 #define _zk_register_constant(s)\
     lua_pushstring(L, #s);\
@@ -1566,6 +5188,84 @@ luaopen_zookeeper_driver(lua_State *L)
     lua_setfield(L, -2, "__metatable");
     lua_pop(L, 1);
     
+    /*** stat ***/
+    static const struct luaL_Reg stat_methods[] = {
+        {"__index",     lua_zoo_stat_index},
+        {"__eq",        lua_zoo_stat_eq},
+        {"__tostring",  lua_zoo_stat_tostring},
+        {"__serialize", lua_zoo_stat_totable},
+        {NULL, NULL}
+    };
+    
+    luaL_newmetatable(L, ZOOKEEP_STAT_MT_NAME);
+    luaL_register(L, NULL, stat_methods);
+    lua_pushstring(L, ZOOKEEP_STAT_MT_NAME);
+    lua_setfield(L, -2, "__metatable");
+    lua_pop(L, 1);
+    
+    /*** buffer ***/
+    static const struct luaL_Reg buffer_methods[] = {
+        {"size",       lua_zoo_buffer_size},
+        {"ptr",        lua_zoo_buffer_ptr},
+        {"value",      lua_zoo_buffer_value},
+        {"__len",      lua_zoo_buffer_size},
+        {"__tostring", lua_zoo_buffer_tostring},
+        {"__gc",       lua_zoo_buffer_gc},
+        {NULL, NULL}
+    };
+    
+    luaL_newmetatable(L, ZOOKEEP_BUFFER_MT_NAME);
+    lua_pushvalue(L, -1);
+    luaL_register(L, NULL, buffer_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushstring(L, ZOOKEEP_BUFFER_MT_NAME);
+    lua_setfield(L, -2, "__metatable");
+    lua_pop(L, 1);
+    CTID_CONST_CHAR_PTR = luaL_ctypeid(L, "const char *");
+    
+    /*** children cursor ***/
+    static const struct luaL_Reg cursor_methods[] = {
+        {"next",  lua_zoo_cursor_next},
+        {"count", lua_zoo_cursor_count},
+        {"__gc",  lua_zoo_cursor_gc},
+        {NULL, NULL}
+    };
+    
+    luaL_newmetatable(L, ZOOKEEP_CURSOR_MT_NAME);
+    lua_pushvalue(L, -1);
+    luaL_register(L, NULL, cursor_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushstring(L, ZOOKEEP_CURSOR_MT_NAME);
+    lua_setfield(L, -2, "__metatable");
+    lua_pop(L, 1);
+    
+    /*** error ***/
+    static const struct luaL_Reg error_methods[] = {
+        {"__tostring", lua_zoo_error_tostring},
+        {NULL, NULL}
+    };
+    
+    luaL_newmetatable(L, ZOOKEEP_ERROR_MT_NAME);
+    luaL_register(L, NULL, error_methods);
+    lua_pop(L, 1);
+    
+    /*** future ***/
+    static const struct luaL_Reg future_methods[] = {
+        {"wait",       lua_zoo_future_wait},
+        {"is_ready",   lua_zoo_future_is_ready},
+        {"__tostring", lua_zoo_future_tostring},
+        {"__gc",       lua_zoo_future_gc},
+        {NULL, NULL}
+    };
+    
+    luaL_newmetatable(L, ZOOKEEP_FUTURE_MT_NAME);
+    lua_pushvalue(L, -1);
+    luaL_register(L, NULL, future_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushstring(L, ZOOKEEP_FUTURE_MT_NAME);
+    lua_setfield(L, -2, "__metatable");
+    lua_pop(L, 1);
+    
     /*** zookeep ***/
     static const struct luaL_Reg lua_zookeep_lib[] = {
         {"build_acl_list", lua_zoo_build_acl_list},
@@ -1574,13 +5274,28 @@ luaopen_zookeeper_driver(lua_State *L)
         {"close",                    lua_zoo_close},
         {"client_id",                lua_zoo_client_id},
         {"process",                  lua_zoo_process},
+        {"dispatch",                 lua_zoo_dispatch},
+        {"watch_backlog",            lua_zoo_watch_backlog},
         {"state",                    lua_zoo_state},
         {"wait_connected",           lua_zoo_wait_connected},
+        {"stats",                    lua_zoo_stats},
+        {"add_watch",                lua_zoo_add_watch},
+        {"children_cursor",          lua_zoo_children_cursor},
+        {"sequence_children",        lua_zoo_sequence_children},
+        {"remove_watches",           lua_zoo_remove_watches},
+        {"set_reconnect_backoff",    lua_zoo_set_reconnect_backoff},
         {"set_watcher",              lua_zookeep_set_watcher},
         {"add_auth",                 lua_zoo_add_auth},
         {"deterministic_conn_order", lua_zoo_deterministic_conn_order},
         {"zerror",                   lua_zoo_zerror},
+        {"error",                    lua_zoo_error},
+        {"error_code",               lua_zoo_error_code},
         {"set_log_level",            lua_zoo_set_log_level},
+        {"set_pool_size",            lua_zoo_set_pool_size},
+        {"pool_stats",               lua_zoo_pool_stats},
+        {"set_trace_size",           lua_zoo_set_trace_size},
+        {"trace_dump",               lua_zoo_trace_dump},
+        {"__gc",                     lua_zoo_gc},
         
         /* operations methods */
         {"create",         lua_zoo_create},
@@ -1597,6 +5312,25 @@ luaopen_zookeeper_driver(lua_State *L)
         {"wget_children2", lua_zoo_wget_children2},
         {"get_acl",        lua_zoo_get_acl},
         {"set_acl",        lua_zoo_set_acl},
+        {"multi",          lua_zoo_multi},
+        {"get_many",       lua_zoo_get_many},
+        
+        /* async operations methods, return a future */
+        {"create_async",         lua_zoo_create_async},
+        {"delete_async",         lua_zoo_delete_async},
+        {"exists_async",         lua_zoo_exists_async},
+        {"get_async",            lua_zoo_get_async},
+        {"set_async",            lua_zoo_set_async},
+        {"get_children_async",   lua_zoo_get_children_async},
+        {"get_children2_async",  lua_zoo_get_children2_async},
+        {"sync_async",           lua_zoo_sync_async},
+        {"wexists_async",        lua_zoo_wexists_async},
+        {"wget_async",           lua_zoo_wget_async},
+        {"wget_children_async",  lua_zoo_wget_children_async},
+        {"wget_children2_async", lua_zoo_wget_children2_async},
+        {"get_acl_async",        lua_zoo_get_acl_async},
+        {"set_acl_async",        lua_zoo_set_acl_async},
+        {"multi_async",          lua_zoo_multi_async},
         {NULL, NULL}
     };
 
@@ -1693,6 +5427,15 @@ luaopen_zookeeper_driver(lua_State *L)
     _zk_register_constant_name("NOTWATCHING", ZOO_NOTWATCHING_EVENT);
     lua_setfield(L, -2, "watch_types");
 
+    /**
+     * Persistent Watch Modes.
+     **/
+    lua_newtable(L);
+    _zk_register_constant_name("PERSISTENT", ZK_WATCH_PERSISTENT);
+    _zk_register_constant_name("PERSISTENT_RECURSIVE",
+                               ZK_WATCH_PERSISTENT_RECURSIVE);
+    lua_setfield(L, -2, "watch_modes");
+
     return 1;
 }
 
@@ -5,10 +5,111 @@
 
 #define ZOOKEEP_MT_NAME "__zookeeper_handle"
 #define ZOOKEEP_ACL_LIST_MT_NAME "__zookeeper_acl_list"
+#define ZOOKEEP_FUTURE_MT_NAME "__zookeeper_future"
+#define ZOOKEEP_STAT_MT_NAME "__zookeeper_stat"
+#define ZOOKEEP_BUFFER_MT_NAME "__zookeeper_buffer"
+#define ZOOKEEP_CURSOR_MT_NAME "__zookeeper_children_cursor"
+#define ZOOKEEP_ERROR_MT_NAME "__zookeeper_error"
+
+struct lua_zoo_handle;
+
+
+/* request types, as named in zk_op_names */
+enum zk_op {
+    ZK_OP_CREATE,
+    ZK_OP_DELETE,
+    ZK_OP_EXISTS,
+    ZK_OP_WEXISTS,
+    ZK_OP_GET,
+    ZK_OP_WGET,
+    ZK_OP_SET,
+    ZK_OP_GET_CHILDREN,
+    ZK_OP_WGET_CHILDREN,
+    ZK_OP_GET_CHILDREN2,
+    ZK_OP_WGET_CHILDREN2,
+    ZK_OP_SYNC,
+    ZK_OP_GET_ACL,
+    ZK_OP_SET_ACL,
+    ZK_OP_MULTI,
+    ZK_OP_ADD_AUTH,
+    ZK_OP_COUNT,
+};
+
+
+/**
+ * Latencies are counted in microseconds by a log-linear histogram: exact
+ * below 16us, then 8 buckets per power of two (12.5% precision) up to
+ * 2^27us (~134s); slower requests land in the last bucket.
+ **/
+#define ZK_LATENCY_SUB_BITS 3
+#define ZK_LATENCY_MAX_BITS 27
+#define ZK_LATENCY_LINEAR (1 << (ZK_LATENCY_SUB_BITS + 1))
+#define ZK_LATENCY_BUCKETS \
+    (ZK_LATENCY_LINEAR + \
+     (ZK_LATENCY_MAX_BITS - ZK_LATENCY_SUB_BITS - 1) * (1 << ZK_LATENCY_SUB_BITS))
+
+/* result codes are ZOK, -1..-15 (system) or -100..-131 (api) */
+#define ZK_STATS_RC_COUNT 48
+
+
+struct zk_op_stats {
+    uint64_t issued;
+    uint64_t completed;
+    uint64_t rcs[ZK_STATS_RC_COUNT]; /* completions by result code */
+    uint64_t latency_sum; /* microseconds */
+    uint64_t latency_max; /* microseconds */
+    uint64_t latency[ZK_LATENCY_BUCKETS];
+};
+
+
+/* states of a session, as returned by zoo_state() */
+#define ZK_STATS_STATE_COUNT 7
+
+
+struct zk_handle_stats {
+    struct zk_op_stats ops[ZK_OP_COUNT];
+    uint64_t reconnects;
+    int state; /* the state since state_since */
+    double state_since;
+    double state_time[ZK_STATS_STATE_COUNT]; /* seconds per state */
+    
+    /* waits between failed connection attempts */
+    uint64_t reconnect_attempts;
+    double reconnect_wait; /* seconds */
+    
+    /* periods from losing the connection until it is up again */
+    uint64_t outages;
+    double outage_time; /* seconds, all of them */
+    double outage_last;
+    double outage_max;
+    double disconnected_since; /* 0 unless disconnected */
+};
+
+
+enum zk_jitter {
+    ZK_JITTER_NONE,
+    ZK_JITTER_FULL, /* uniform in [0, delay] */
+    ZK_JITTER_DECORRELATED, /* uniform in [initial, previous * multiplier] */
+};
+
+
+#define ZK_BACKOFF_DEFAULT_MAX 30
+#define ZK_BACKOFF_DEFAULT_MULTIPLIER 2
+
+/* delays between connection attempts, reset once connected */
+struct zk_backoff {
+    double initial;
+    double max;
+    double multiplier;
+    enum zk_jitter jitter;
+    double ceiling; /* the next delay before jitter */
+    double prev; /* the previous delay */
+};
 
 
 struct zk_global_wctx {
-    lua_State *L;
+    struct lua_zoo_handle *handle;
+    int refs; /* held by the handle and by every queued event */
     int zhref;
     int cbref;
     int internal_ctx_ref;
@@ -17,11 +118,80 @@ struct zk_global_wctx {
 
 
 struct zk_local_wctx {
-    lua_State *L;
+    struct zk_local_wctx *next; /* free list link */
+    struct lua_zoo_handle *handle;
+    int zhref;
+    int cbref;
+    int internal_ctx_ref;
+    int user_ctx_ref;
+};
+
+
+/* watch modes, values as in ZooKeeper's AddWatchMode */
+enum zk_watch_mode {
+    ZK_WATCH_PERSISTENT = 0,
+    ZK_WATCH_PERSISTENT_RECURSIVE = 1,
+};
+
+
+struct zk_watched_path {
+    struct zk_watched_path *next; /* bucket chain */
+    char *path;
+};
+
+
+/* hash set of paths */
+struct zk_path_set {
+    struct zk_watched_path **buckets;
+    int capacity;
+    int count;
+};
+
+
+/**
+ * A watch that stays registered after firing: the driver sets the
+ * one-shot server watches again itself, with no Lua round trip.
+ */
+struct zk_persistent_wctx {
+    struct zk_persistent_wctx *next; /* the handle's list */
+    struct lua_zoo_handle *handle;
+    int refs; /* held by the handle, queued events and pending requests */
     int zhref;
     int cbref;
     int internal_ctx_ref;
     int user_ctx_ref;
+    char *path;
+    enum zk_watch_mode mode;
+    bool removed;
+    bool stale; /* some watches could not be set, set them once connected */
+    struct zk_path_set armed; /* paths the watches are set on */
+};
+
+
+struct zk_watch_event {
+    /* exactly one of the contexts is set */
+    struct zk_global_wctx *global_wctx;
+    struct zk_local_wctx *local_wctx;
+    struct zk_persistent_wctx *persistent_wctx;
+    int type;
+    int state;
+    char *path;
+};
+
+
+/**
+ * FIFO of watch events. zookeeper_process() only enqueues, user
+ * callbacks are run by the dispatch fibers. The ring grows when full:
+ * enqueueing must never yield inside the client.
+ */
+struct zk_watch_queue {
+    struct zk_watch_event *events;
+    int capacity;
+    int limit; /* above it the I/O loop lets the workers run first */
+    int head;
+    int count;
+    bool closed;
+    struct fiber_cond *not_empty;
 };
 
 
@@ -31,16 +201,137 @@ struct lua_zoo_handle {
     int flags;
     int recv_timeout;
     clientid_t *client_id;
-    double reconnect_timeout;
+    struct zk_backoff backoff;
     struct zk_global_wctx *global_wctx; /* global watcher context */
+    struct zk_persistent_wctx *persistent_wctxs;
+    bool rearm_watches; /* a new session has none of the server watches */
     struct fiber_cond *connected_cond;
     int prev_state;
+    struct zk_handle_stats stats;
+    double op_timeout; /* default request timeout, negative if none */
+    struct fiber *process_fiber; /* fiber running lua_zoo_process */
+    bool process_waiting; /* process_fiber is parked in coio_wait */
+    struct zk_watch_queue watch_queue;
+};
+
+
+enum zk_multi_op {
+    ZK_MULTI_OP_CREATE,
+    ZK_MULTI_OP_DELETE,
+    ZK_MULTI_OP_SET,
+    ZK_MULTI_OP_CHECK,
+};
+
+
+/* buffers zoo_amulti() writes per-op results into on completion */
+struct zk_multi_ctx {
+    int count;
+    enum zk_multi_op *kinds;
+    zoo_op_t *ops;
+    zoo_op_result_t *results;
+    struct Stat *stats;
+    char **path_buffers;
+};
+
+
+enum zk_result_kind {
+    ZK_RESULT_VOID,         /* rc */
+    ZK_RESULT_DATA,         /* value, stat, rc */
+    ZK_RESULT_STAT,         /* exists, stat, rc */
+    ZK_RESULT_STRING,       /* string, rc */
+    ZK_RESULT_STRINGS,      /* strings, rc */
+    ZK_RESULT_STRINGS_STAT, /* strings, stat, rc */
+    ZK_RESULT_ACL,          /* acl, stat, rc */
+    ZK_RESULT_MULTI,        /* per-op results, rc */
+};
+
+
+/* a reply value shared by the request and the Lua objects returned */
+struct zk_buffer {
+    int refs;
+    size_t size;
+    char data[];
+};
+
+
+/* children names handed out to Lua a batch at a time */
+struct zk_children_cursor {
+    char *buf; /* the names, back to back */
+    const char **names; /* into buf, filtered and ordered */
+    int count;
+    int pos;
+};
+
+
+/**
+ * A reply as copied out of the client library by a completion callback.
+ * Lua values are built from it later by the fiber collecting the reply.
+ **/
+struct zk_result {
+    enum zk_result_kind kind;
+    int rc;
+    bool has_stat;
+    struct Stat stat;
+    int value_len; /* -1 for no value */
+    int strings_count; /* -1 for no strings */
+    bool has_acl;
+    struct ACL_vector acl; /* points into buf */
+    char *buf; /* value, strings or ACL data; reused by later replies */
+    size_t buf_size;
+    bool want_buffer; /* the value goes to value_buf instead of buf */
+    struct zk_buffer *value_buf;
 };
 
 
 struct zk_data_result {
-    lua_State *L;
-    int ret_count;
+    struct zk_data_result *next; /* free list link */
+    struct lua_zoo_handle *handle;
+    double timeout; /* for sync requests, negative if none */
+    bool async;
     
     struct fiber_cond *cond;
+    
+    struct zk_result result;
+    bool completed;
+    bool abandoned; /* the waiter (or future) is gone */
+    
+    struct zk_multi_ctx *multi; /* set for multi requests only */
+    
+    /* one-shot watcher registered by this request, if any */
+    struct zk_local_wctx *wctx;
+    bool wctx_on_nonode; /* exists watches are set on missing nodes too */
+    
+    struct zk_batch *batch; /* set for requests issued by get_many */
+    int batch_index;
+    
+    enum zk_op op;
+    double start; /* submission time */
+    bool traced; /* tracing was enabled when the request was sent */
+    uint32_t path_hash; /* set only if traced */
+};
+
+
+/* a group of requests sharing one wakeup */
+struct zk_batch {
+    struct zk_data_result *items;
+    int count;
+    int *done; /* indexes of completed items not collected yet */
+    int done_count;
+    int inflight;
+    bool abandoned;
+    struct fiber_cond *cond;
+};
+
+
+/* a completed request as recorded by the trace ring */
+struct zk_trace_event {
+    enum zk_op op;
+    uint32_t path_hash;
+    double latency; /* seconds */
+    int rc;
+};
+
+
+struct zk_future {
+    struct zk_data_result *cdata;
 };
@@ -0,0 +1,325 @@
+local bit = require 'bit'
+local clock = require 'clock'
+local fiber = require 'fiber'
+local log = require 'log'
+local uuid = require 'uuid'
+
+local const = require 'zookeeper.const'
+local driver = require 'zookeeper.driver'
+
+local ZOK = const.ZOK
+local ZNONODE = const.api_errors.ZNONODE
+local ZCONNECTIONLOSS = const.errors.ZCONNECTIONLOSS
+local states = const.states
+local DELETED = const.watch_types.DELETED
+local CANDIDATE_FLAGS = bit.bor(const.create_flags.EPHEMERAL,
+                                const.create_flags.SEQUENCE)
+local RETRY_INTERVAL = 1
+
+local BECAME_LEADER = 'became_leader'
+local LOST_LEADERSHIP = 'lost_leadership'
+
+
+local election_methods
+
+local function _notify(self, event)
+    if self._callback ~= nil then
+        local ok, err = pcall(self._callback, event, self)
+        if not ok then
+            log.error('zookeeper: election callback failed: %s', err)
+        end
+    end
+    if self._channel ~= nil then
+        self._channel:put(event, 0)
+    end
+end
+
+
+local function _set_leader(self, leader)
+    if self._leader == leader then
+        return
+    end
+    self._leader = leader
+    if leader then
+        self._stats.elected = self._stats.elected + 1
+        _notify(self, BECAME_LEADER)
+    else
+        self._stats.lost = self._stats.lost + 1
+        _notify(self, LOST_LEADERSHIP)
+    end
+end
+
+
+local function _call(z, n, method, ...)
+    local res = {pcall(method, z, ...)}
+    if res[1] then
+        return unpack(res, 2, table.maxn(res))
+    end
+    if z:is_connected() then
+        error(res[2], 0)
+    end
+    res = {}
+    res[n] = ZCONNECTIONLOSS
+    return unpack(res, 1, n)
+end
+
+
+-- takes the candidates before the node with our tag from names in
+-- counter order; false if there is no such node
+local function _take_preds(self, names)
+    for i, name in ipairs(names) do
+        if string.sub(name, 1, #self._tag) == self._tag then
+            self.node = self.path .. '/' .. name
+            self._preds = {unpack(names, 1, i - 1)}
+            return true
+        end
+    end
+    return false
+end
+
+
+-- creates the candidate node and lists the candidates in one round trip,
+-- or finds the node whose create reply was lost
+local function _join(self)
+    local z = self._z
+    local f
+    if not self._sent then
+        local ok
+        ok, f = pcall(z.create_async, z,
+                      self.path .. '/' .. self._tag .. 'n-', self._value,
+                      nil, CANDIDATE_FLAGS)
+        if not ok then
+            return ZCONNECTIONLOSS
+        end
+        self._sent = true
+    end
+    local names, rc = _call(z, 2, z.sequence_children, self.path)
+    if f ~= nil then
+        local ok, _, crc = pcall(f.wait, f)
+        if not ok then
+            crc = ZCONNECTIONLOSS
+        end
+        if crc == ZNONODE then
+            self._sent = false
+            local erc = _call(z, 1, z.ensure_path, self.path)
+            return erc == ZOK and ZNONODE or erc
+        end
+        if crc ~= ZOK then
+            return crc
+        end
+    end
+    if rc ~= ZOK then
+        return rc
+    end
+    if not _take_preds(self, names) then
+        self._sent = false
+        return ZNONODE
+    end
+    return ZOK
+end
+
+
+-- waits for the candidates before ours to go away
+local function _wait_preds(self)
+    local z = self._z
+    local preds = self._preds
+    while #preds > 0 and not self._stopped do
+        local fired = false
+        local deleted = false
+        -- a get sets no watch on a predecessor that is gone already
+        local _, _, rc = _call(z, 3, z.wget,
+            self.path .. '/' .. preds[#preds], function(_, type)
+                fired = true
+                if type == DELETED then
+                    deleted = true
+                    self._fired_at = clock.monotonic()
+                end
+                self._cond:broadcast()
+            end)
+        if rc == ZNONODE then
+            table.remove(preds)
+        elseif rc ~= ZOK then
+            return rc
+        else
+            while not fired and not self._stopped and
+                    z:is_connected() do
+                self._cond:wait()
+            end
+            if deleted then
+                -- nodes never come back, no need to ask again
+                table.remove(preds)
+            elseif not z:is_connected() then
+                return ZCONNECTIONLOSS
+            end
+            -- any other event only needs the watch set again
+        end
+    end
+    return ZOK
+end
+
+
+-- while leading, waits for the session to be interrupted or a resign
+local function _lead(self)
+    local z = self._z
+    local fired_at = self._fired_at
+    _set_leader(self, true)
+    if fired_at ~= nil then
+        local elapsed = clock.monotonic() - fired_at
+        self._stats.takeover_time = self._stats.takeover_time + elapsed
+        self._stats.takeover_max = math.max(self._stats.takeover_max, elapsed)
+        self._fired_at = nil
+    end
+    while not self._stopped and z:is_connected() do
+        self._cond:wait()
+    end
+    -- without a connection the node may be gone with the session
+    _set_leader(self, false)
+end
+
+
+local function _run(self)
+    local z = self._z
+    while not self._stopped do
+        if not z:is_connected() then
+            if not pcall(z.wait_connected, z, RETRY_INTERVAL) and
+                    not pcall(z.state, z) then
+                -- the handle is closed
+                break
+            end
+        else
+            local rc = ZOK
+            if self.node ~= nil then
+                -- after a disconnect: the node is gone if the session is
+                local exists, _, erc = _call(z, 3, z.exists, self.node)
+                rc = erc
+                if erc == ZNONODE or (erc == ZOK and not exists) then
+                    self.node = nil
+                    self._sent = false
+                    self._preds = {}
+                    rc = ZNONODE
+                end
+            end
+            if self.node == nil and rc ~= ZCONNECTIONLOSS then
+                rc = _join(self)
+            end
+            if rc == ZOK then
+                rc = _wait_preds(self)
+            end
+            if rc == ZOK and not self._stopped then
+                _lead(self)
+            elseif rc ~= ZOK and rc ~= ZNONODE and rc ~= ZCONNECTIONLOSS then
+                log.error('zookeeper: election on %s failed: %s',
+                          self.path, driver.zerror(rc))
+                fiber.sleep(RETRY_INTERVAL)
+            end
+        end
+    end
+    -- resigned while joining
+    if self.node ~= nil then
+        pcall(z.delete, z, self.node)
+        self.node = nil
+    end
+end
+
+
+-- Leader election among the ephemeral sequential children of path: the
+-- candidate with the lowest counter leads. Nodes are only ever added
+-- after ours, so the candidates before ours are listed once and then only
+-- shrink; a deleted predecessor is dropped from that list and the next
+-- one is watched, with no new listing. The deletion event itself is
+-- trusted, so when the leader goes away its successor takes over when
+-- the watch fires, with no request in between; the node is only read
+-- again after a session event or a change of its value.
+local function election_new(z, path, opts)
+    if opts == nil then
+        opts = {}
+    end
+    if opts.callback ~= nil and type(opts.callback) ~= 'function' then
+        error('callback must be a function')
+    end
+    
+    local tag = '_c_' .. uuid.str() .. '-'
+    local self = setmetatable({
+        path = path,
+        node = nil,
+        
+        _z = z,
+        _tag = tag,
+        _value = opts.value or '',
+        _callback = opts.callback,
+        _channel = opts.channel,
+        _leader = false,
+        _stopped = false,
+        -- a create was sent and its node may exist
+        _sent = false,
+        -- names of the candidates before ours, the last one is watched
+        _preds = {},
+        _cond = fiber.cond(),
+        _stats = {
+            elected = 0,
+            lost = 0,
+            -- from the predecessor watch firing to taking over
+            takeover_time = 0,
+            takeover_max = 0,
+        },
+    }, {
+        __index = election_methods,
+    })
+    
+    self._listener = function(_, state)
+        if state ~= states.CONNECTED then
+            self._cond:broadcast()
+        end
+    end
+    z:add_session_listener(self._listener)
+    self._f = fiber.create(function()
+        fiber.self():name('zookeeper_election')
+        _run(self)
+    end)
+    return self
+end
+
+
+election_methods = {
+    is_leader = function(self)
+        return self._leader
+    end,
+    
+    -- the value of the current leader's node
+    leader = function(self)
+        local z = self._z
+        local names, rc = z:sequence_children(self.path)
+        if rc ~= ZOK or #names == 0 then
+            return nil, rc
+        end
+        local value, _, rc = z:get(self.path .. '/' .. names[1])
+        return value, rc
+    end,
+    
+    -- leaves the election and deletes the candidate node
+    resign = function(self)
+        if self._stopped then
+            return
+        end
+        self._stopped = true
+        -- the handle may be closed already
+        pcall(self._z.remove_session_listener, self._z, self._listener)
+        self._cond:broadcast()
+        _set_leader(self, false)
+        if self.node ~= nil then
+            pcall(self._z.delete, self._z, self.node)
+            self.node = nil
+        end
+    end,
+    
+    stats = function(self)
+        return table.copy(self._stats)
+    end,
+}
+
+
+return {
+    new = election_new,
+    BECAME_LEADER = BECAME_LEADER,
+    LOST_LEADERSHIP = LOST_LEADERSHIP,
+}
@@ -1,27 +1,63 @@
+local clock = require 'clock'
 local fiber = require 'fiber'
 local fio = require 'fio'
+local log = require 'log'
 local msgpack = require 'msgpack'
 
 local driver = require 'zookeeper.driver'
 local zookeeper_acl = require 'zookeeper.acl'
+local zookeeper_barrier = require 'zookeeper.barrier'
+local zookeeper_cache = require 'zookeeper.cache'
+local zookeeper_counter = require 'zookeeper.counter'
+local zookeeper_election = require 'zookeeper.election'
+local zookeeper_lock = require 'zookeeper.lock'
+local zookeeper_tree_cache = require 'zookeeper.tree_cache'
 local const = require 'zookeeper.const'
 local NULL = msgpack.NULL
 
 
 local zookeeper_methods
 
-local function zookeeper_new(handle, hosts, timeout, default_acl)
+local function zookeeper_new(handle, hosts, timeout, opts)
+    local default_acl = opts.default_acl
     if default_acl == nil then
         default_acl = zookeeper_acl.ACLS.OPEN_ACL_UNSAFE
     end
     
+    local watch_workers = opts.watch_workers
+    if watch_workers == nil then
+        watch_workers = 1
+    end
+    if type(watch_workers) ~= 'number' or watch_workers < 1 then
+        error('watch_workers must be a positive number')
+    end
+    
+    local share_watches = opts.share_watches
+    if share_watches == nil then
+        share_watches = true
+    end
+    
     return setmetatable({
         hosts = hosts,
         timeout = timeout,
         default_acl = default_acl,
+        watch_workers = watch_workers,
+        share_watches = share_watches,
         
         _handle = handle,
-        _f = NULL
+        _f = NULL,
+        _dispatch_f = {},
+        _watcher = nil,
+        _watcher_context = nil,
+        _session_listeners = {},
+        _op_timeout = opts.op_timeout,
+        _shared_watches = {},
+        _shared_replies = 0,
+        _coalescers = {},
+        _coalesced_events = 0,
+        _lock_stats = zookeeper_lock.stats_new(),
+        _counter_stats = zookeeper_counter.stats_new(),
+        _barrier_stats = zookeeper_barrier.stats_new(),
     }, {
         __index = zookeeper_methods,
         __gc = function(self)
@@ -31,6 +67,376 @@ local function zookeeper_new(handle, hosts, timeout, default_acl)
 end
 
 
+local function _check_acl(self, acl)
+    if acl == nil then
+        return self.default_acl
+    end
+    
+    if not zookeeper_acl.ACLList.check_acl(acl) then
+        error("acl must be a zookeeper.acl.ACLList instance")
+    end
+    return acl
+end
+
+
+-- The driver-level global watcher: fans session events out to the
+-- session listeners, then calls the user's watcher.
+local function _global_watcher(self, type, state, path)
+    if type == const.watch_types.SESSION then
+        for listener in pairs(self._session_listeners) do
+            local ok, err = pcall(listener, self, state)
+            if not ok then
+                log.error('zookeeper: session listener failed: %s', err)
+            end
+        end
+    end
+    
+    if self._watcher ~= nil then
+        self._watcher(self, type, state, path, self._watcher_context)
+    end
+end
+
+
+local function _update_global_watcher(self)
+    if self._watcher == nil and next(self._session_listeners) == nil then
+        driver.set_watcher(self._handle, nil)
+    else
+        driver.set_watcher(self._handle, _global_watcher, self)
+    end
+end
+
+
+-- Watch sharing. One-shot watches of the same kind on the same path
+-- share one request and one server watch: the first caller sends the
+-- request and the others wait for its reply. Until the watch fires,
+-- later callers get that reply without a request, as the node can not
+-- change without firing the watch first. When the watch fires, every
+-- subscriber is called.
+--
+-- The watch fires inside the I/O loop, but the entry is only dropped
+-- when a worker runs its event. While any event is queued, the entry
+-- may be stale, so its reply is not reused then.
+
+local function _pack(...)
+    return {n = select('#', ...), ...}
+end
+
+
+local function _unshare(self, entry)
+    if self._shared_watches[entry.key] == entry then
+        self._shared_watches[entry.key] = nil
+    end
+end
+
+
+local function _shared_watcher(self, type, state, path, entry)
+    local lost = type ~= const.watch_types.SESSION
+                 or state == const.states.EXPIRED_SESSION
+                 or state == const.states.AUTH_FAILED
+    if lost then
+        _unshare(self, entry)
+    end
+    
+    local subscribers = entry.subscribers
+    for i = 1, #subscribers do
+        local s = subscribers[i]
+        local ok, err = pcall(s.func, self, type, state, path, s.context)
+        if not ok then
+            log.error('zookeeper: watcher failed: %s', err)
+        end
+    end
+end
+
+
+local function _watch_is_set(kind, rc)
+    return rc == const.ZOK
+           or (kind == 'wexists' and rc == const.api_errors.ZNONODE)
+end
+
+
+local function _wait_shared(self, entry, timeout)
+    if timeout == nil then
+        timeout = self._op_timeout
+    end
+    local deadline = timeout ~= nil and clock.monotonic() + timeout or nil
+    while entry.reply == nil and entry.err == nil do
+        if deadline == nil then
+            entry.cond:wait()
+        else
+            local remaining = deadline - clock.monotonic()
+            if remaining <= 0 then
+                error(driver.error(const.errors.ZOPERATIONTIMEOUT))
+            end
+            entry.cond:wait(remaining)
+        end
+        fiber.testcancel()
+    end
+    if entry.err ~= nil then
+        error(entry.err, 0)
+    end
+end
+
+
+local function _shared_watch(self, kind, path, watcher_func, context, timeout)
+    if type(watcher_func) ~= 'function' then
+        error('watcher_func must be a function')
+    end
+    
+    local key = kind .. ':' .. path
+    local entry = self._shared_watches[key]
+    if entry ~= nil and entry.reply ~= nil and
+            driver.watch_backlog(self._handle) > 0 then
+        return driver[kind](self._handle,
+            path, watcher_func, self, context, timeout)
+    end
+    local subscriber = {func = watcher_func, context = context}
+    if entry ~= nil then
+        -- subscribe first: the watch may fire while waiting
+        table.insert(entry.subscribers, subscriber)
+        _wait_shared(self, entry, timeout)
+        self._shared_replies = self._shared_replies + 1
+    else
+        entry = {key = key, subscribers = {subscriber}, cond = fiber.cond()}
+        self._shared_watches[key] = entry
+        local reply = _pack(pcall(driver[kind], self._handle, path,
+                                  _shared_watcher, self, entry, timeout))
+        if not reply[1] then
+            _unshare(self, entry)
+            entry.err = reply[2]
+            entry.cond:broadcast()
+            error(reply[2], 0)
+        end
+        entry.reply = {n = reply.n - 1, unpack(reply, 2, reply.n)}
+        if not _watch_is_set(kind, entry.reply[entry.reply.n]) then
+            _unshare(self, entry)
+        end
+        entry.cond:broadcast()
+    end
+    
+    local reply = entry.reply
+    if kind == 'wget_children' or kind == 'wget_children2' then
+        -- callers may modify the list
+        if reply[1] ~= nil then
+            local children = {}
+            for i, name in ipairs(reply[1]) do
+                children[i] = name
+            end
+            return children, unpack(reply, 2, reply.n)
+        end
+    end
+    return unpack(reply, 1, reply.n)
+end
+
+
+local function _watch(self, kind, path, watcher_func, context, timeout)
+    -- a shared reply must not hide that the connection is down
+    if not self.share_watches or not self:is_connected() then
+        return driver[kind](self._handle,
+            path, watcher_func, self, context, timeout)
+    end
+    return _shared_watch(self, kind, path, watcher_func, context, timeout)
+end
+
+
+-- Coalescing of persistent watch events. Data events (created, changed,
+-- deleted) and child events of a path are collected for a window and
+-- delivered once, with the type of the last one; the current data or
+-- children list may be read once for the whole window as well.
+
+local function _coalesced_deliver(self, c, path, kind)
+    local pending = c.pending[path][kind]
+    c.pending[path][kind] = nil
+    if next(c.pending[path]) == nil then
+        c.pending[path] = nil
+    end
+    if c.removed then
+        return
+    end
+    
+    local read = {n = 0}
+    if c.read and pending.type ~= const.watch_types.DELETED then
+        local reply
+        if kind == 'children' then
+            reply = _pack(pcall(self.get_children, self, path))
+        else
+            reply = _pack(pcall(self.get, self, path))
+        end
+        if reply[1] then
+            read = {n = reply.n - 1, unpack(reply, 2, reply.n)}
+        else
+            log.warn('zookeeper: can not read %s: %s', path, reply[2])
+        end
+    end
+    
+    local ok, err = pcall(c.func, self, pending.type, pending.state, path,
+                          c.context, unpack(read, 1, read.n))
+    if not ok then
+        log.error('zookeeper: watcher failed: %s', err)
+    end
+end
+
+
+local function _coalescing_watcher(self, type, state, path, c)
+    if c.removed then
+        return
+    end
+    if type == const.watch_types.SESSION then
+        local ok, err = pcall(c.func, self, type, state, path, c.context)
+        if not ok then
+            log.error('zookeeper: watcher failed: %s', err)
+        end
+        return
+    end
+    
+    local kind = type == const.watch_types.CHILD and 'children' or 'data'
+    local by_kind = c.pending[path]
+    if by_kind == nil then
+        by_kind = {}
+        c.pending[path] = by_kind
+    end
+    local pending = by_kind[kind]
+    if pending ~= nil then
+        pending.type = type
+        pending.state = state
+        self._coalesced_events = self._coalesced_events + 1
+        return
+    end
+    
+    by_kind[kind] = {type = type, state = state}
+    fiber.create(function()
+        fiber.self():name('zookeeper_coalesce')
+        fiber.sleep(c.window)
+        _coalesced_deliver(self, c, path, kind)
+    end)
+end
+
+
+local function _rc_name(rc)
+    return const.errors_rev[rc] or const.api_errors_rev[rc] or tostring(rc)
+end
+
+
+local function _sorted_keys(t)
+    local keys = {}
+    for k in pairs(t) do
+        table.insert(keys, k)
+    end
+    table.sort(keys)
+    return keys
+end
+
+
+-- Prometheus text exposition format of z:stats()
+local function _format_prometheus(stats, prefix)
+    local lines = {}
+    local function family(name, kind, help)
+        table.insert(lines, string.format('# HELP %s%s %s', prefix, name, help))
+        table.insert(lines, string.format('# TYPE %s%s %s', prefix, name, kind))
+    end
+    local function sample(name, labels, value)
+        table.insert(lines, string.format('%s%s%s %s',
+                                          prefix, name, labels, value))
+    end
+    
+    local ops = _sorted_keys(stats.ops)
+    
+    family('requests_total', 'counter', 'Requests sent.')
+    for _, name in ipairs(ops) do
+        sample('requests_total', string.format('{op="%s"}', name),
+               stats.ops[name].issued)
+    end
+    
+    family('requests_inflight', 'gauge', 'Requests waiting for a reply.')
+    for _, name in ipairs(ops) do
+        sample('requests_inflight', string.format('{op="%s"}', name),
+               stats.ops[name].inflight)
+    end
+    
+    family('responses_total', 'counter', 'Completed requests by result.')
+    for _, name in ipairs(ops) do
+        local rcs = stats.ops[name].rcs
+        for _, rc in ipairs(_sorted_keys(rcs)) do
+            sample('responses_total',
+                   string.format('{op="%s",rc="%s"}', name, rc), rcs[rc])
+        end
+    end
+    
+    family('request_duration_seconds', 'histogram',
+           'Time from sending a request to its completion.')
+    for _, name in ipairs(ops) do
+        local latency = stats.ops[name].latency
+        for _, bucket in ipairs(latency.buckets) do
+            sample('request_duration_seconds_bucket',
+                   string.format('{op="%s",le="%g"}', name, bucket.le),
+                   bucket.count)
+        end
+        sample('request_duration_seconds_bucket',
+               string.format('{op="%s",le="+Inf"}', name), latency.count)
+        sample('request_duration_seconds_sum',
+               string.format('{op="%s"}', name), latency.sum)
+        sample('request_duration_seconds_count',
+               string.format('{op="%s"}', name), latency.count)
+    end
+    
+    family('reconnects_total', 'counter', 'Session handle re-creations.')
+    sample('reconnects_total', '', stats.reconnects)
+    
+    family('reconnect_attempts_total', 'counter',
+           'Waits before retrying a failed connection.')
+    sample('reconnect_attempts_total', '', stats.reconnect_attempts)
+    family('reconnect_wait_seconds_total', 'counter',
+           'Time spent waiting before connection retries.')
+    sample('reconnect_wait_seconds_total', '', stats.reconnect_wait)
+    
+    family('outages_total', 'counter', 'Connection losses recovered from.')
+    sample('outages_total', '', stats.outages.count)
+    family('outage_seconds_total', 'counter',
+           'Time spent without a connection after losing it.')
+    sample('outage_seconds_total', '', stats.outages.time)
+    
+    family('shared_watch_replies_total', 'counter',
+           'Watch requests answered by a shared request.')
+    sample('shared_watch_replies_total', '', stats.shared_watch_replies)
+    
+    family('coalesced_watch_events_total', 'counter',
+           'Watch events merged into an earlier one.')
+    sample('coalesced_watch_events_total', '', stats.coalesced_watch_events)
+    
+    family('locks_acquired_total', 'counter', 'Locks acquired.')
+    sample('locks_acquired_total', '', stats.locks.acquired)
+    family('lock_timeouts_total', 'counter',
+           'Lock waits that gave up on their timeout.')
+    sample('lock_timeouts_total', '', stats.locks.timeouts)
+    family('lock_waiters', 'gauge', 'Fibers waiting for a lock.')
+    sample('lock_waiters', '', stats.locks.waiting)
+    family('lock_acquire_seconds_total', 'counter',
+           'Time from requesting a lock to acquiring it.')
+    sample('lock_acquire_seconds_total', '', stats.locks.acquire_time)
+    
+    family('counter_increments_total', 'counter', 'Counter increments.')
+    sample('counter_increments_total', '', stats.counters.increments)
+    family('counter_conflicts_total', 'counter',
+           'Counter writes rejected for a stale version.')
+    sample('counter_conflicts_total', '', stats.counters.conflicts)
+    family('counter_backoff_seconds_total', 'counter',
+           'Time counter increments waited after conflicts.')
+    sample('counter_backoff_seconds_total', '', stats.counters.backoff_time)
+    
+    family('barrier_timeouts_total', 'counter',
+           'Barrier enters and leaves that gave up on their timeout.')
+    sample('barrier_timeouts_total', '', stats.barriers.timeouts)
+    
+    family('state_seconds_total', 'counter', 'Time spent in each state.')
+    for _, state in ipairs(_sorted_keys(stats.state_time)) do
+        sample('state_seconds_total', string.format('{state="%s"}', state),
+               stats.state_time[state])
+    end
+    
+    table.insert(lines, '')
+    return table.concat(lines, '\n')
+end
+
+
 local function _split_parent_path(path)
     local last_char = string.sub(path, #path, #path)
     if last_char == '/' then
@@ -44,42 +450,142 @@ local function _split_parent_path(path)
 end
 
 
+local function _ensure_path(self, path, deadline)
+    local timeout = deadline and math.max(deadline - clock.monotonic(), 0)
+    local exists, _, rc = self:exists(path, nil, timeout)
+    if exists then
+        return const.ZOK
+    elseif rc ~= const.ZOK and rc ~= const.api_errors.ZNONODE then
+        return rc
+    end
+    
+    local parent = _split_parent_path(path)
+    if parent ~= nil then
+        local rc = _ensure_path(self, parent, deadline)
+        if rc ~= const.ZOK then
+            return rc
+        end
+    end
+    timeout = deadline and math.max(deadline - clock.monotonic(), 0)
+    local _, rc = self:create(path, nil, nil, nil, timeout)
+    return rc
+end
+
+
 zookeeper_methods = {
     start = function(self)
         if self._f ~= nil and self._f:status() ~= 'dead' then
             error('zookeeper is already started')
         end
+        if self._f ~= nil then
+            self._f:join()
+        end
         
         self._f = fiber.create(function()
             fiber.self():name('zookeeper_process')
             driver.process(self._handle)
         end)
+        -- joined on close, so the client is never freed under it
+        self._f:set_joinable(true)
+        
+        -- watcher callbacks are run by these fibers, never by the I/O loop
+        for i = 1, self.watch_workers do
+            local f = self._dispatch_f[i]
+            if f == nil or f:status() == 'dead' then
+                self._dispatch_f[i] = fiber.create(function()
+                    fiber.self():name('zookeeper_watch')
+                    driver.dispatch(self._handle)
+                end)
+            end
+        end
     end,
     
     close = function(self)
-        if self._f ~= nil and self._f:status() ~= 'dead' then
-            self._f:cancel()
-        end
+        local f = self._f
         self._f = NULL
+        if f ~= nil and f:id() ~= fiber.id() then
+            if f:status() ~= 'dead' then
+                f:cancel()
+            end
+            f:join()
+        end
+        for _, f in ipairs(self._dispatch_f) do
+            if f:status() ~= 'dead' then
+                f:cancel()
+            end
+        end
+        self._dispatch_f = {}
         driver.close(self._handle)
     end,
     
     set_watcher = function(self, watcher_func, context)
-        driver.set_watcher(self._handle, watcher_func, self, context)
+        self._watcher = watcher_func
+        self._watcher_context = context
+        _update_global_watcher(self)
+    end,
+    
+    -- listener(z, state) is called on every session event
+    add_session_listener = function(self, listener)
+        self._session_listeners[listener] = true
+        _update_global_watcher(self)
+    end,
+    
+    remove_session_listener = function(self, listener)
+        self._session_listeners[listener] = nil
+        _update_global_watcher(self)
     end,
     
     client_id = function(self)
         return driver.client_id(self._handle)
     end,
     
-    add_auth = function(self, scheme, cert)
-        return driver.add_auth(self._handle, scheme, cert)
+    add_auth = function(self, scheme, cert, timeout)
+        return driver.add_auth(self._handle, scheme, cert, timeout)
     end,
     
     state = function(self)
         return driver.state(self._handle)
     end,
     
+    -- per request type counters and latencies, reconnects and time
+    -- spent in every state
+    stats = function(self)
+        local stats = driver.stats(self._handle)
+        for _, op in pairs(stats.ops) do
+            local rcs = {}
+            for rc, count in pairs(op.rcs) do
+                rcs[_rc_name(rc)] = count
+            end
+            op.rcs = rcs
+        end
+        
+        local state_time = {}
+        for state, seconds in pairs(stats.state_time) do
+            state_time[const.states_rev[state] or tostring(state)] = seconds
+        end
+        stats.state_time = state_time
+        stats.shared_watch_replies = self._shared_replies
+        stats.coalesced_watch_events = self._coalesced_events
+        stats.locks = table.copy(self._lock_stats)
+        stats.counters = table.copy(self._counter_stats)
+        stats.barriers = table.copy(self._barrier_stats)
+        return stats
+    end,
+    
+    -- opts: initial, max, multiplier (seconds) and jitter: 'none',
+    -- 'full' or 'decorrelated'; missing fields are left as they are
+    set_reconnect_backoff = function(self, opts)
+        driver.set_reconnect_backoff(self._handle, opts.initial, opts.max,
+                                     opts.multiplier, opts.jitter)
+    end,
+    
+    stats_prometheus = function(self, prefix)
+        if prefix == nil then
+            prefix = 'zookeeper_'
+        end
+        return _format_prometheus(self:stats(), prefix)
+    end,
+    
     is_connected = function(self)
         local ok, s = pcall(self.state, self)
         if ok then
@@ -93,89 +599,311 @@ zookeeper_methods = {
         return driver.wait_connected(self._handle, timeout)
     end,
     
-    create = function(self, path, value, acl, flags)
-        if acl == nil then
-            acl = self.default_acl
-        else
-            if not zookeeper_acl.ACLList.check_acl(acl) then
-                error("acl must be a zookeeper.acl.ACLList instance")
-            end
+    create = function(self, path, value, acl, flags, timeout)
+        acl = _check_acl(self, acl)
+        return driver.create(self._handle, path, value, acl, flags, timeout)
+    end,
+    
+    -- timeout bounds the whole call, not each of its requests
+    ensure_path = function(self, path, timeout)
+        local deadline = timeout and clock.monotonic() + timeout
+        return _ensure_path(self, path, deadline)
+    end,
+    
+    exists = function(self, path, watch, timeout)
+        return driver.exists(self._handle, path, watch, timeout)
+    end,
+    
+    delete = function(self, path, version, timeout)
+        return driver.delete(self._handle, path, version, timeout)
+    end,
+    
+    -- opts.buffer: return the value as a buffer object, not a string
+    get = function(self, path, watch, timeout, opts)
+        return driver.get(self._handle, path, watch, timeout,
+                          opts ~= nil and opts.buffer)
+    end,
+    
+    set = function(self, path, value, version, timeout)
+        return driver.set(self._handle, path, value, version, timeout)
+    end,
+    
+    get_children = function(self, path, watch, timeout)
+        return driver.get_children(self._handle, path, watch, timeout)
+    end,
+    
+    get_children2 = function(self, path, watch, timeout)
+        return driver.get_children2(self._handle, path, watch, timeout)
+    end,
+    
+    -- iterates over the children of path in tables of at most opts.batch
+    -- names; opts.prefix filters and opts.sorted orders them. The names
+    -- are kept on the C side until they are taken.
+    iter_children = function(self, path, opts)
+        opts = opts or {}
+        local batch = opts.batch or 1000
+        if type(batch) ~= 'number' or batch <= 0 then
+            error('batch must be a positive number')
+        end
+        local cursor, rc = driver.children_cursor(self._handle, path,
+            opts.prefix, opts.sorted == true, opts.timeout)
+        if cursor == nil then
+            return function() return nil end, rc
+        end
+        return function()
+            return cursor:next(batch)
+        end, rc
+    end,
+    
+    -- the sequential children of path ordered by their counters, only
+    -- those starting with opts.prefix. With opts.node returns the first of
+    -- them and the one right before opts.node instead of the list;
+    -- opts.node_tag finds that node by the start of its name.
+    sequence_children = function(self, path, opts)
+        opts = opts or {}
+        if opts.node_tag ~= nil then
+            return driver.sequence_children(self._handle, path,
+                opts.prefix, opts.node_tag, opts.timeout, true)
+        end
+        return driver.sequence_children(self._handle, path,
+            opts.prefix, opts.node, opts.timeout)
+    end,
+    
+    sync = function(self, path, timeout)
+        return driver.sync(self._handle, path, timeout)
+    end,
+    
+    wexists = function(self, path, watcher_func, context, timeout)
+        return _watch(self, 'wexists', path, watcher_func, context, timeout)
+    end,
+    
+    wget = function(self, path, watcher_func, context, timeout)
+        return _watch(self, 'wget', path, watcher_func, context, timeout)
+    end,
+    
+    wget_children = function(self, path, watcher_func, context, timeout)
+        return _watch(self, 'wget_children',
+                      path, watcher_func, context, timeout)
+    end,
+    
+    wget_children2 = function(self, path, watcher_func, context, timeout)
+        return _watch(self, 'wget_children2',
+                      path, watcher_func, context, timeout)
+    end,
+    
+    -- a watch that is not removed by firing; mode is one of
+    -- const.watch_modes. opts.coalesce (seconds) merges the events of a
+    -- path, opts.read passes the data or children read after them.
+    add_watch = function(self, path, mode, watcher_func, context, opts)
+        if opts == nil or opts.coalesce == nil then
+            return driver.add_watch(self._handle,
+                path, mode, watcher_func, self, context)
+        end
+        if type(watcher_func) ~= 'function' then
+            error('watcher_func must be a function')
+        end
+        if type(opts.coalesce) ~= 'number' or opts.coalesce < 0 then
+            error('coalesce must be a non-negative number')
         end
         
-        return driver.create(self._handle, path, value, acl, flags)
+        local c = {
+            func = watcher_func,
+            context = context,
+            window = opts.coalesce,
+            read = opts.read == true,
+            pending = {},
+            removed = false,
+        }
+        -- a function of its own, for remove_watches(path, watcher_func)
+        c.wrapper = function(z, event_type, state, event_path)
+            _coalescing_watcher(z, event_type, state, event_path, c)
+        end
+        driver.add_watch(self._handle, path, mode, c.wrapper, self, c)
+        local coalescers = self._coalescers[path]
+        if coalescers == nil then
+            coalescers = {}
+            self._coalescers[path] = coalescers
+        end
+        table.insert(coalescers, c)
     end,
     
-    ensure_path = function(self, path)
-        local exists, _, rc = self:exists(path)
-        if exists then
-            return const.ZOK
-        elseif rc ~= const.ZOK and rc ~= const.api_errors.ZNONODE then
-            return rc
+    remove_watches = function(self, path, watcher_func)
+        local coalescers = self._coalescers[path]
+        if coalescers == nil then
+            return driver.remove_watches(self._handle, path, watcher_func)
+        end
+        if watcher_func == nil then
+            for _, c in ipairs(coalescers) do
+                c.removed = true
+            end
+            self._coalescers[path] = nil
+            return driver.remove_watches(self._handle, path)
         end
         
-        local parent, last_node = _split_parent_path(path)
-        if parent ~= nil then
-            local rc = self:ensure_path(parent)
-            if rc ~= const.ZOK then
-                return rc
+        local removed = driver.remove_watches(self._handle,
+                                              path, watcher_func)
+        local kept = {}
+        for _, c in ipairs(coalescers) do
+            if c.func == watcher_func then
+                c.removed = true
+                removed = removed + driver.remove_watches(self._handle,
+                                                          path, c.wrapper)
+            else
+                table.insert(kept, c)
             end
         end
-        local _, rc = self:create(path)
-        return rc
+        self._coalescers[path] = #kept > 0 and kept or nil
+        return removed
+    end,
+    
+    get_acl = function(self, path, timeout)
+        return driver.get_acl(self._handle, path, timeout)
+    end,
+    
+    set_acl = function(self, path, acl, version, timeout)
+        return driver.set_acl(self._handle, path, version, acl, timeout)
+    end,
+    
+    get_many = function(self, paths, opts)
+        if opts == nil then
+            opts = {}
+        end
+        return driver.get_many(self._handle, paths,
+                               opts.max_inflight, opts.watch, opts.timeout)
+    end,
+    
+    cache = function(self)
+        return zookeeper_cache.new(self)
+    end,
+    
+    tree_cache = function(self, root, opts)
+        return zookeeper_tree_cache.new(self, root, opts)
+    end,
+    
+    -- exclusive lock on path; opts.timeout in seconds
+    lock = function(self, path, opts)
+        return zookeeper_lock.lock(self, path, opts)
+    end,
+    
+    -- joins the leader election on path; opts.value, opts.callback and
+    -- opts.channel
+    election = function(self, path, opts)
+        return zookeeper_election.new(self, path, opts)
+    end,
+    
+    -- a number in the value of path; opts.initial, opts.backoff_initial
+    -- and opts.backoff_max
+    counter = function(self, path, opts)
+        return zookeeper_counter.new(self, path, opts)
+    end,
+    
+    -- a double barrier for count members on path; opts.value
+    barrier = function(self, path, count, opts)
+        return zookeeper_barrier.new(self, path, count, opts)
+    end,
+    
+    multi = function(self, ops, timeout)
+        return driver.multi(self._handle, ops, self.default_acl, timeout)
     end,
     
-    exists = function(self, path, watch)
-        return driver.exists(self._handle, path, watch)
+    -- Async operations. Each one sends the request and returns a future
+    -- immediately; future:wait(timeout) returns the same values as the
+    -- synchronous counterpart.
+    
+    create_async = function(self, path, value, acl, flags)
+        acl = _check_acl(self, acl)
+        return driver.create_async(self._handle, path, value, acl, flags)
+    end,
+    
+    exists_async = function(self, path, watch)
+        return driver.exists_async(self._handle, path, watch)
     end,
     
-    delete = function(self, path, version)
-        return driver.delete(self._handle, path, version)
+    delete_async = function(self, path, version)
+        return driver.delete_async(self._handle, path, version)
     end,
     
-    get = function(self, path, watch)
-        return driver.get(self._handle, path, watch)
+    get_async = function(self, path, watch, opts)
+        return driver.get_async(self._handle, path, watch, nil,
+                                opts ~= nil and opts.buffer)
     end,
     
-    set = function(self, path, value, version)
-        return driver.set(self._handle, path, value, version)
+    set_async = function(self, path, value, version)
+        return driver.set_async(self._handle, path, value, version)
     end,
     
-    get_children = function(self, path, watch)
-        return driver.get_children(self._handle, path, watch)
+    get_children_async = function(self, path, watch)
+        return driver.get_children_async(self._handle, path, watch)
     end,
     
-    get_children2 = function(self, path, watch)
-        return driver.get_children2(self._handle, path, watch)
+    get_children2_async = function(self, path, watch)
+        return driver.get_children2_async(self._handle, path, watch)
     end,
     
-    sync = function(self, path)
-        return driver.sync(self._handle, path)
+    sync_async = function(self, path)
+        return driver.sync_async(self._handle, path)
     end,
     
-    wexists = function(self, path, watcher_func, context)
-        return driver.wexists(self._handle, path, watcher_func, self, context)
+    wexists_async = function(self, path, watcher_func, context)
+        return driver.wexists_async(self._handle,
+            path, watcher_func, self, context)
     end,
     
-    wget = function(self, path, watcher_func, context)
-        return driver.wget(self._handle, path, watcher_func, self, context)
+    wget_async = function(self, path, watcher_func, context)
+        return driver.wget_async(self._handle,
+            path, watcher_func, self, context)
     end,
     
-    wget_children = function(self, path, watcher_func, context)
-        return driver.wget_children(self._handle,
+    wget_children_async = function(self, path, watcher_func, context)
+        return driver.wget_children_async(self._handle,
             path, watcher_func, self, context)
     end,
     
-    wget_children2 = function(self, path, watcher_func, context)
-        return driver.wget_children2(self._handle,
+    wget_children2_async = function(self, path, watcher_func, context)
+        return driver.wget_children2_async(self._handle,
             path, watcher_func, self, context)
     end,
     
-    get_acl = function(self, path)
-        return driver.get_acl(self._handle, path)
+    get_acl_async = function(self, path)
+        return driver.get_acl_async(self._handle, path)
+    end,
+    
+    set_acl_async = function(self, path, acl, version)
+        return driver.set_acl_async(self._handle, path, version, acl)
     end,
     
-    set_acl = function(self, path, acl, version)
-        return driver.set_acl(self._handle, path, version, acl)
+    multi_async = function(self, ops)
+        return driver.multi_async(self._handle, ops, self.default_acl)
+    end,
+    
+    wait_all = function(self, futures, timeout)
+        local deadline
+        if timeout ~= nil then
+            deadline = fiber.time() + timeout
+        end
+        
+        -- a late future does not discard the results of the others
+        local results = {}
+        local rc = const.ZOK
+        for i, f in ipairs(futures) do
+            local remaining
+            if deadline ~= nil then
+                remaining = math.max(deadline - fiber.time(), 0)
+            end
+            local res = {pcall(f.wait, f, remaining)}
+            if res[1] then
+                res = {unpack(res, 2, table.maxn(res))}
+                res.rc = res[table.maxn(res)]
+            elseif driver.error_code(res[2]) ==
+                    const.errors.ZOPERATIONTIMEOUT then
+                res = {rc = const.errors.ZOPERATIONTIMEOUT}
+                rc = res.rc
+            else
+                error(res[2], 0)
+            end
+            results[i] = res
+        end
+        return results, rc
     end,
 }
 
@@ -199,11 +927,25 @@ return {
         local handle = driver.init(hosts, timeout,
                                    opts.clientid,
                                    opts.flags,
-                                   opts.reconnect_timeout)
-        return zookeeper_new(handle, hosts, timeout, opts.default_acl)
+                                   opts.reconnect_timeout,
+                                   opts.watch_queue_size,
+                                   opts.op_timeout)
+        if opts.reconnect_backoff ~= nil then
+            driver.set_reconnect_backoff(handle,
+                                         opts.reconnect_backoff.initial,
+                                         opts.reconnect_backoff.max,
+                                         opts.reconnect_backoff.multiplier,
+                                         opts.reconnect_backoff.jitter)
+        end
+        return zookeeper_new(handle, hosts, timeout, opts)
     end,
     zerror = driver.zerror,
+    error_code = driver.error_code,
     deterministic_conn_order = driver.deterministic_conn_order,
     set_log_level = driver.set_log_level,
+    set_pool_size = driver.set_pool_size,
+    pool_stats = driver.pool_stats,
+    set_trace_size = driver.set_trace_size,
+    trace_dump = driver.trace_dump,
     const = const,
 }
@@ -0,0 +1,285 @@
+local bit = require 'bit'
+local clock = require 'clock'
+local fiber = require 'fiber'
+local uuid = require 'uuid'
+
+local const = require 'zookeeper.const'
+local driver = require 'zookeeper.driver'
+
+local ZOK = const.ZOK
+local ZNONODE = const.api_errors.ZNONODE
+local ZCONNECTIONLOSS = const.errors.ZCONNECTIONLOSS
+local ZOPERATIONTIMEOUT = const.errors.ZOPERATIONTIMEOUT
+local LOCK_FLAGS = bit.bor(const.create_flags.EPHEMERAL,
+                           const.create_flags.SEQUENCE)
+
+
+local lock_methods
+
+local function stats_new()
+    return {
+        acquired = 0,
+        timeouts = 0,
+        waiting = 0,
+        acquire_time = 0,
+        acquire_max = 0,
+        session_losses = 0,
+    }
+end
+
+
+local function _remaining(deadline)
+    if deadline == nil then
+        return nil
+    end
+    return math.max(deadline - clock.monotonic(), 0)
+end
+
+
+-- calls a request method returning its code at position n; a request
+-- refused on a lost connection gives ZCONNECTIONLOSS there, like one
+-- that was sent before the loss, and one that ran out of time gives
+-- ZOPERATIONTIMEOUT
+local function _call(z, n, method, ...)
+    local res = {pcall(method, z, ...)}
+    if res[1] then
+        return unpack(res, 2, table.maxn(res))
+    end
+    local rc
+    if driver.error_code(res[2]) == ZOPERATIONTIMEOUT then
+        rc = ZOPERATIONTIMEOUT
+    elseif not z:is_connected() then
+        rc = ZCONNECTIONLOSS
+    else
+        error(res[2], 0)
+    end
+    res = {}
+    res[n] = rc
+    return unpack(res, 1, n)
+end
+
+
+local function _wait_connected(z, deadline)
+    local timeout = _remaining(deadline)
+    if timeout ~= nil and timeout <= 0 then
+        return false
+    end
+    return (pcall(z.wait_connected, z, timeout))
+end
+
+
+local function _set_node(self, name)
+    self._name = name
+    self.node = self.path .. '/' .. name
+end
+
+
+-- the lock node is created and the children are read in one round trip:
+-- ZooKeeper answers the requests of a session in order, so the read
+-- already sees the new node
+local function _create(self, deadline)
+    local z = self._z
+    local ok, f = pcall(z.create_async, z, self._prefix .. 'lock-', '',
+                        nil, LOCK_FLAGS)
+    if not ok then
+        return ZCONNECTIONLOSS
+    end
+    self._sent = true
+    local _, pred, rc, name = _call(z, 3, z.sequence_children, self.path,
+        {node_tag = self._tag, timeout = _remaining(deadline)})
+    
+    local ok, err, crc = pcall(f.wait, f, _remaining(deadline))
+    if not ok then
+        if driver.error_code(err) ~= ZOPERATIONTIMEOUT then
+            error(err, 0)
+        end
+        crc = ZOPERATIONTIMEOUT
+    end
+    if crc == ZNONODE then
+        self._sent = false
+        local erc = _call(z, 1, z.ensure_path, self.path)
+        return erc == ZOK and ZNONODE or erc
+    end
+    if crc ~= ZOK then
+        return crc
+    end
+    if rc ~= ZOK then
+        return rc
+    end
+    _set_node(self, name)
+    return rc, pred
+end
+
+
+-- after a lost create reply the node may exist: it is the only child
+-- with our tag
+local function _recover(self, deadline)
+    local _, pred, rc, name = _call(self._z, 3, self._z.sequence_children,
+        self.path, {node_tag = self._tag, timeout = _remaining(deadline)})
+    if rc == ZNONODE then
+        self._sent = false
+    end
+    if rc ~= ZOK then
+        return rc
+    end
+    _set_node(self, name)
+    return rc, pred
+end
+
+
+local function _check(self, deadline)
+    local _, pred, rc = _call(self._z, 3, self._z.sequence_children,
+        self.path, {node = self._name, timeout = _remaining(deadline)})
+    if rc == ZNONODE then
+        -- the session that owned the node has expired
+        self.node = nil
+        self._sent = false
+        self._stats.session_losses = self._stats.session_losses + 1
+    end
+    return rc, pred
+end
+
+
+-- waits until the predecessor is gone; only that node is watched, so a
+-- release wakes up one waiter and not the whole queue. A get sets no
+-- watch on a missing node, unlike exists.
+local function _wait_predecessor(self, pred, deadline)
+    local cond = fiber.cond()
+    local fired = false
+    local _, _, rc = _call(self._z, 3, self._z.wget,
+        self.path .. '/' .. pred, function()
+            fired = true
+            cond:signal()
+        end, nil, _remaining(deadline))
+    if rc ~= ZOK then
+        return rc == ZNONODE and ZOK or rc
+    end
+    while not fired do
+        local timeout = _remaining(deadline)
+        if timeout ~= nil and timeout <= 0 then
+            return ZOPERATIONTIMEOUT
+        end
+        cond:wait(timeout)
+    end
+    return ZOK
+end
+
+
+local function _acquire(self, deadline)
+    while true do
+        if deadline ~= nil and clock.monotonic() >= deadline then
+            return ZOPERATIONTIMEOUT
+        end
+        
+        local rc, pred
+        if self.node ~= nil then
+            rc, pred = _check(self, deadline)
+        elseif self._sent then
+            rc, pred = _recover(self, deadline)
+        else
+            rc, pred = _create(self, deadline)
+        end
+        
+        if rc == ZOK then
+            if pred == nil then
+                return ZOK
+            end
+            rc = _wait_predecessor(self, pred, deadline)
+        end
+        
+        if rc == ZCONNECTIONLOSS then
+            if not _wait_connected(self._z, deadline) then
+                return ZOPERATIONTIMEOUT
+            end
+        elseif rc ~= ZOK and rc ~= ZNONODE then
+            return rc
+        end
+    end
+end
+
+
+local function _release(self)
+    if self.node == nil and self._sent then
+        _recover(self, nil)
+    end
+    self._sent = false
+    if self.node == nil then
+        return ZOK
+    end
+    local rc = _call(self._z, 1, self._z.delete, self.node)
+    self.node = nil
+    return rc == ZNONODE and ZOK or rc
+end
+
+
+-- Exclusive lock held through an ephemeral sequential child of path.
+-- Returns the lock, or nil and the return code if it fails or is not
+-- acquired in opts.timeout seconds.
+local function lock(z, path, opts)
+    opts = opts or {}
+    if opts.timeout ~= nil and
+            (type(opts.timeout) ~= 'number' or opts.timeout < 0) then
+        error('timeout must be a non-negative number')
+    end
+    
+    local tag = '_c_' .. uuid.str() .. '-'
+    local self = setmetatable({
+        path = path,
+        node = nil,
+        
+        _z = z,
+        _tag = tag,
+        _prefix = path .. '/' .. tag,
+        _name = nil,
+        -- a create was sent and its node may exist
+        _sent = false,
+        _stats = z._lock_stats,
+    }, {
+        __index = lock_methods,
+    })
+    
+    local stats = self._stats
+    local start = clock.monotonic()
+    local deadline = opts.timeout and start + opts.timeout
+    stats.waiting = stats.waiting + 1
+    local ok, rc = pcall(_acquire, self, deadline)
+    stats.waiting = stats.waiting - 1
+    
+    if ok and rc == ZOK then
+        local elapsed = clock.monotonic() - start
+        stats.acquired = stats.acquired + 1
+        stats.acquire_time = stats.acquire_time + elapsed
+        stats.acquire_max = math.max(stats.acquire_max, elapsed)
+        return self, rc
+    end
+    
+    if ok and rc == ZOPERATIONTIMEOUT then
+        stats.timeouts = stats.timeouts + 1
+    end
+    -- a waiter that gave up must not become the owner later
+    pcall(_release, self)
+    if not ok then
+        error(rc, 0)
+    end
+    return nil, rc
+end
+
+
+lock_methods = {
+    -- deletes the lock node; its watch wakes up the next waiter
+    unlock = function(self)
+        return _release(self)
+    end,
+    
+    -- false after unlock(); a lock is also lost with its session, which
+    -- is not noticed here
+    is_held = function(self)
+        return self.node ~= nil
+    end,
+}
+
+
+return {
+    lock = lock,
+    stats_new = stats_new,
+}
@@ -0,0 +1,461 @@
+local fiber = require 'fiber'
+local log = require 'log'
+
+local const = require 'zookeeper.const'
+
+local watch_types = const.watch_types
+local states = const.states
+local ZOK = const.ZOK
+local ZNONODE = const.api_errors.ZNONODE
+
+local DEFAULT_MAX_INFLIGHT = 1000
+local RETRY_INTERVAL = 1
+
+
+local tree_cache_methods
+
+-- In-memory mirror of the subtree under root. Every mirrored node holds
+-- one data watch and one child watch; a fired watch only queues the path,
+-- the cache fiber re-reads it and applies the difference.
+local function tree_cache_new(z, root, opts)
+    if type(root) ~= 'string' or string.sub(root, 1, 1) ~= '/' then
+        error('root must be an absolute path')
+    end
+    if #root > 1 and string.sub(root, #root, #root) == '/' then
+        root = string.sub(root, 1, #root - 1)
+    end
+    
+    if opts == nil then
+        opts = {}
+    end
+    local max_inflight = opts.max_inflight
+    if max_inflight == nil then
+        max_inflight = DEFAULT_MAX_INFLIGHT
+    end
+    if type(max_inflight) ~= 'number' or max_inflight < 1 then
+        error('max_inflight must be a positive number')
+    end
+    
+    return setmetatable({
+        _z = z,
+        _root = root,
+        _max_inflight = max_inflight,
+        
+        _nodes = {},
+        _listeners = {},
+        _initialized = false,
+        
+        -- paths with a watch registered on the server
+        _data_watched = {},
+        _child_watched = {},
+        
+        _pending = {},
+        _retry = {},
+        _resync = false,
+        _cond = fiber.cond(),
+        _running = false,
+        _f = nil,
+        _session_listener = nil,
+    }, {
+        __index = tree_cache_methods,
+    })
+end
+
+
+local function _child_path(path, name)
+    if path == '/' then
+        return '/' .. name
+    end
+    return path .. '/' .. name
+end
+
+
+local function _split_path(path)
+    local parent, name = string.match(path, '^(.*)/([^/]*)$')
+    if parent == '' then
+        parent = '/'
+    end
+    return parent, name
+end
+
+
+local function _emit(self, event, path, node)
+    if not self._initialized then
+        return
+    end
+    for listener in pairs(self._listeners) do
+        local ok, err = pcall(listener, event, path, node.value, node.stat)
+        if not ok then
+            log.error('zookeeper: tree cache listener failed: %s', err)
+        end
+    end
+end
+
+
+local function _enqueue(self, path)
+    if not self._pending[path] then
+        self._pending[path] = true
+        self._cond:signal()
+    end
+end
+
+
+local function _data_watcher(_, type, state, path, self)
+    if type == watch_types.SESSION or type == watch_types.NOTWATCHING then
+        return
+    end
+    self._data_watched[path] = nil
+    _enqueue(self, path)
+end
+
+
+local function _child_watcher(_, type, state, path, self)
+    if type == watch_types.SESSION or type == watch_types.NOTWATCHING then
+        return
+    end
+    self._child_watched[path] = nil
+    _enqueue(self, path)
+end
+
+
+local function _remove(self, path)
+    local node = self._nodes[path]
+    if node == nil then
+        return
+    end
+    for name in pairs(node.children) do
+        _remove(self, _child_path(path, name))
+    end
+    
+    self._nodes[path] = nil
+    if path ~= self._root then
+        local parent_path, name = _split_path(path)
+        local parent = self._nodes[parent_path]
+        if parent ~= nil then
+            parent.children[name] = nil
+        end
+    end
+    _emit(self, 'deleted', path, node)
+end
+
+
+-- A missing root is watched with wexists to notice its creation.
+local function _watch_root(self)
+    local root = self._root
+    if self._data_watched[root] then
+        return
+    end
+    
+    self._data_watched[root] = true
+    local z = self._z
+    local ok, exists, _, rc = pcall(z.wexists, z, root, _data_watcher, self)
+    if not ok or (rc ~= ZOK and rc ~= ZNONODE) then
+        self._data_watched[root] = nil
+        self._retry[root] = true
+    elseif exists then
+        _enqueue(self, root)
+    end
+end
+
+
+-- Reads the data (or only the stat) and the children of every path,
+-- keeping at most max_inflight requests on the wire. Watches are only
+-- requested for paths that do not have one registered already.
+local function _fetch(self, paths, values)
+    local z = self._z
+    local step = math.max(1, math.floor(self._max_inflight / 2))
+    local results = {}
+    
+    for first = 1, #paths, step do
+        local last = math.min(first + step - 1, #paths)
+        local futures = {}
+        
+        for i = first, last do
+            local path = paths[i]
+            local arm_data = not self._data_watched[path]
+            local arm_child = not self._child_watched[path]
+            
+            local data_f, child_f
+            if values and arm_data then
+                data_f = z:wget_async(path, _data_watcher, self)
+            elseif values then
+                data_f = z:get_async(path)
+            elseif arm_data then
+                data_f = z:wexists_async(path, _data_watcher, self)
+            else
+                data_f = z:exists_async(path)
+            end
+            if arm_child then
+                child_f = z:wget_children2_async(path, _child_watcher, self)
+            else
+                child_f = z:get_children2_async(path)
+            end
+            -- marked right after sending: the watch may fire before
+            -- this fiber gets the reply
+            self._data_watched[path] = true
+            self._child_watched[path] = true
+            futures[i] = {data_f, child_f, arm_data, arm_child}
+        end
+        
+        for i = first, last do
+            local path = paths[i]
+            local f = futures[i]
+            local r = {}
+            
+            local value, stat, rc = f[1]:wait()
+            if values then
+                r.value = value
+            end
+            r.stat, r.rc = stat, rc
+            r.children, r.cstat, r.children_rc = f[2]:wait()
+            
+            local data_armed = rc == ZOK or (not values and rc == ZNONODE)
+            if f[3] and not data_armed then
+                self._data_watched[path] = nil
+            end
+            if f[4] and r.children_rc ~= ZOK then
+                self._child_watched[path] = nil
+            end
+            results[i] = r
+        end
+    end
+    return results
+end
+
+
+local function _diff_children(self, path, node, children, next_paths, next_new)
+    local seen = {}
+    for _, name in ipairs(children) do
+        seen[name] = true
+        if not node.children[name] then
+            local child = _child_path(path, name)
+            table.insert(next_paths, child)
+            next_new[child] = true
+        end
+    end
+    for name in pairs(node.children) do
+        if not seen[name] then
+            _remove(self, _child_path(path, name))
+        end
+    end
+end
+
+
+local function _apply(self, path, r, values, is_new, next_paths, next_new)
+    local node = self._nodes[path]
+    
+    if r.rc == ZNONODE or r.children_rc == ZNONODE then
+        _remove(self, path)
+        if path == self._root then
+            _watch_root(self)
+        end
+        return
+    end
+    if r.rc ~= ZOK or r.children_rc ~= ZOK then
+        self._retry[path] = true
+        return
+    end
+    
+    if node == nil then
+        -- only nodes listed by their parent (or the root) are mirrored
+        if not is_new and path ~= self._root then
+            return
+        end
+        if not values then
+            table.insert(next_paths, path)
+            next_new[path] = true
+            return
+        end
+        
+        local parent
+        if path ~= self._root then
+            local parent_path, name = _split_path(path)
+            parent = self._nodes[parent_path]
+            if parent == nil then
+                return
+            end
+            parent.children[name] = true
+        end
+        
+        node = {
+            value = r.value,
+            stat = r.stat,
+            pzxid = r.cstat.pzxid,
+            children = {},
+        }
+        self._nodes[path] = node
+        _emit(self, 'created', path, node)
+        
+        for _, name in ipairs(r.children) do
+            local child = _child_path(path, name)
+            table.insert(next_paths, child)
+            next_new[child] = true
+        end
+        return
+    end
+    
+    if r.stat.mzxid ~= node.stat.mzxid then
+        if not values then
+            -- fetch the new value, the children are compared then too
+            table.insert(next_paths, path)
+            return
+        end
+        node.value = r.value
+        node.stat = r.stat
+        _emit(self, 'changed', path, node)
+    end
+    
+    if r.cstat.pzxid ~= node.pzxid then
+        node.pzxid = r.cstat.pzxid
+        _diff_children(self, path, node, r.children, next_paths, next_new)
+    end
+end
+
+
+-- Brings the given paths up to date level by level. With values == false
+-- only stats are read first and data is fetched for nodes whose mzxid
+-- moved; children are compared only for nodes whose pzxid moved.
+local function _sync(self, paths, values, is_new)
+    while #paths > 0 do
+        local results = _fetch(self, paths, values)
+        local next_paths, next_new = {}, {}
+        for i, path in ipairs(paths) do
+            _apply(self, path, results[i], values, is_new[path],
+                   next_paths, next_new)
+        end
+        paths, values, is_new = next_paths, true, next_new
+    end
+end
+
+
+local function _take(set)
+    local paths = {}
+    for path in pairs(set) do
+        table.insert(paths, path)
+    end
+    table.sort(paths) -- parents go before their children
+    return paths
+end
+
+
+local function _resync(self)
+    local paths = _take(self._nodes)
+    if self._nodes[self._root] == nil then
+        table.insert(paths, 1, self._root)
+    end
+    _sync(self, paths, false, {})
+end
+
+
+local function _loop(self)
+    while self._running do
+        local ok, err = true
+        if self._resync and self._z:is_connected() then
+            self._resync = false
+            ok, err = pcall(_resync, self)
+        elseif next(self._pending) ~= nil then
+            local paths = _take(self._pending)
+            self._pending = {}
+            ok, err = pcall(_sync, self, paths, true, {})
+        else
+            local timeout
+            if next(self._retry) ~= nil then
+                timeout = RETRY_INTERVAL
+            end
+            if not self._cond:wait(timeout) and self._z:is_connected() then
+                for path in pairs(self._retry) do
+                    _enqueue(self, path)
+                end
+                self._retry = {}
+            end
+        end
+        
+        if not ok then
+            log.error('zookeeper: tree cache refresh failed: %s', err)
+            self._resync = true
+            fiber.sleep(RETRY_INTERVAL)
+        end
+    end
+end
+
+
+tree_cache_methods = {
+    -- Loads the subtree and starts following it. Listeners are not
+    -- called for the initial load.
+    start = function(self)
+        if self._f ~= nil then
+            error('tree cache is already started')
+        end
+        
+        self._session_listener = function(_, state)
+            if state == states.EXPIRED_SESSION then
+                -- all watches are gone together with the session
+                self._data_watched = {}
+                self._child_watched = {}
+                self._resync = true
+            elseif state == states.CONNECTED and self._resync then
+                self._cond:signal()
+            end
+        end
+        self._z:add_session_listener(self._session_listener)
+        
+        local ok, err = pcall(_sync, self, {self._root}, true,
+                              {[self._root] = true})
+        if not ok then
+            self._z:remove_session_listener(self._session_listener)
+            self._session_listener = nil
+            error(err)
+        end
+        self._initialized = true
+        
+        self._running = true
+        self._f = fiber.create(function()
+            fiber.self():name('zookeeper_tree_cache')
+            _loop(self)
+        end)
+    end,
+    
+    stop = function(self)
+        if self._session_listener ~= nil then
+            self._z:remove_session_listener(self._session_listener)
+            self._session_listener = nil
+        end
+        self._running = false
+        self._f = nil
+        self._cond:signal()
+    end,
+    
+    -- value, stat of a mirrored node or nil
+    get = function(self, path)
+        local node = self._nodes[path]
+        if node == nil then
+            return nil
+        end
+        return node.value, node.stat
+    end,
+    
+    -- sorted child names of a mirrored node or nil
+    children = function(self, path)
+        local node = self._nodes[path]
+        if node == nil then
+            return nil
+        end
+        local names = {}
+        for name in pairs(node.children) do
+            table.insert(names, name)
+        end
+        table.sort(names)
+        return names
+    end,
+    
+    -- listener(event, path, value, stat), event is one of
+    -- 'created', 'changed' or 'deleted'
+    on_change = function(self, listener)
+        self._listeners[listener] = true
+    end,
+}
+
+
+return {
+    new = tree_cache_new,
+}